@@ -0,0 +1,915 @@
+/**
+ * File: demo_bench.cpp
+ * Date: October 2026
+ * Description: micro benchmarks of the alternative implementations of
+ *   DBoW2 (query engines, transform engines, ...) against the reference 
+ *   ones
+ * License: see the LICENSE.txt file
+ */
+
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+// DBoW2
+#include "DBoW2.h"
+
+#include <DUtils/DUtils.h>
+
+using namespace DBoW2;
+using namespace DUtils;
+using namespace std;
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+void createVocabulary(Surf64Vocabulary &voc);
+void createFeatures(int nimages, int nfeatures,
+  vector<vector<FSurf64::TDescriptor> > &features);
+void createNoisyQueries(const vector<vector<FSurf64::TDescriptor> > &features,
+  vector<vector<FSurf64::TDescriptor> > &queries);
+void createBowVector(const Surf64Vocabulary &voc, int nwords, BowVector &v);
+void benchQueryEngines(const Surf64Vocabulary &voc);
+void benchTransformEngines(Surf64Vocabulary &voc);
+void benchMeanValues();
+void benchPruning(const Surf64Vocabulary &voc);
+void benchBeamSearch(const Surf64Vocabulary &voc);
+void benchCoarseQueries(const Surf64Vocabulary &voc);
+void benchTransformCache(const Surf64Vocabulary &voc);
+void benchGrowth(const Surf64Vocabulary &voc);
+void benchMatcher(const Surf64Vocabulary &voc);
+void benchOrbValues();
+void benchBriefValues();
+double queryRecall(const Surf64Database &db,
+  const vector<vector<FSurf64::TDescriptor> > &queries);
+void referenceMeanValue(const vector<FORB::pDescriptor> &descriptors,
+  FORB::TDescriptor &mean);
+void referenceMeanValue(const vector<FBrief::pDescriptor> &descriptors,
+  FBrief::TDescriptor &mean);
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+// number of entries of the synthetic database
+const int NENTRIES = 100000;
+
+// number of words of each synthetic bow vector
+const int NWORDS = 100;
+
+// number of queries per benchmark
+const int NQUERIES = 50;
+
+// number of images and features per image to transform
+const int NIMAGES = 50;
+const int NFEATURES = 1000;
+
+// number of binary descriptors whose mean is computed
+const int NMEAN = 1000000;
+
+// words with fewer descriptors than this are pruned
+const unsigned int MIN_OCCUPANCY = 3;
+
+// noise added to the descriptors of the queries of an image
+const float QUERY_NOISE = 0.2f;
+
+// number of features whose closest word is found by brute force
+const int NEXACT = 1000;
+
+// scale of the distances of the soft assignment
+const double SOFT_SIGMA = 1.;
+
+// level of the coarse inverted file and number of candidates it selects
+const int COARSE_LEVEL = 3;
+const int COARSE_RESULTS = 5;
+
+// fraction of the features of an image that are not tracked with 
+// identical descriptors from the previous one
+const double UNTRACKED_FEATURES = 0.2;
+
+// words with more descriptors than this are split when growing the 
+// vocabulary
+const unsigned int GROW_OCCUPANCY = 10;
+
+// levels up of the nodes whose features are matched, and ratio of the 
+// ratio test (of squared distances)
+const int MATCH_LEVELS_UP = 2;
+const double MATCH_RATIO = 0.8;
+
+// - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+int main()
+{
+  Random::SeedRand(0);
+
+  Surf64Vocabulary voc(10, 4, TF_IDF, L1_NORM);
+  createVocabulary(voc);
+  cout << voc << endl;
+
+  benchQueryEngines(voc);
+  benchTransformEngines(voc);
+  benchMeanValues();
+  benchPruning(voc);
+  benchBeamSearch(voc);
+  benchCoarseQueries(voc);
+  benchTransformCache(voc);
+  benchGrowth(voc);
+  benchMatcher(voc);
+  benchOrbValues();
+  benchBriefValues();
+
+  return 0;
+}
+
+// ----------------------------------------------------------------------------
+
+void createVocabulary(Surf64Vocabulary &voc)
+{
+  // random descriptors are enough to obtain a full tree
+  vector<vector<FSurf64::TDescriptor> > features;
+  createFeatures(50, 400, features);
+
+  cout << "Creating vocabulary..." << endl;
+  voc.create(features);
+}
+
+// ----------------------------------------------------------------------------
+
+void createFeatures(int nimages, int nfeatures,
+  vector<vector<FSurf64::TDescriptor> > &features)
+{
+  features.resize(nimages);
+  for(size_t i = 0; i < features.size(); ++i)
+  {
+    features[i].resize(nfeatures);
+    for(size_t j = 0; j < features[i].size(); ++j)
+    {
+      features[i][j].resize(FSurf64::L);
+      for(int k = 0; k < FSurf64::L; ++k)
+        features[i][j][k] = Random::RandomValue<float>(-1.f, 1.f);
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void createNoisyQueries(const vector<vector<FSurf64::TDescriptor> > &features,
+  vector<vector<FSurf64::TDescriptor> > &queries)
+{
+  queries = features;
+  for(size_t i = 0; i < queries.size(); ++i)
+    for(size_t j = 0; j < queries[i].size(); ++j)
+      for(int k = 0; k < FSurf64::L; ++k)
+        queries[i][j][k] += Random::RandomValue<float>(-QUERY_NOISE, 
+          QUERY_NOISE);
+}
+
+// ----------------------------------------------------------------------------
+
+void createBowVector(const Surf64Vocabulary &voc, int nwords, BowVector &v)
+{
+  // skewed word distribution, so that some inverted rows are long
+  v.clear();
+  const int W = voc.size();
+  for(int i = 0; i < nwords; ++i)
+  {
+    double r = Random::RandomValue<double>(0, 1);
+    WordId wid = (WordId)(r * r * (W - 1));
+    v.addWeight(wid, Random::RandomValue<double>(0.1, 1.));
+  }
+  v.normalize(L1);
+}
+
+// ----------------------------------------------------------------------------
+
+void benchQueryEngines(const Surf64Vocabulary &voc)
+{
+  cout << "Creating a database with " << NENTRIES << " entries..." << endl;
+  Surf64Database db(voc, false, 0);
+
+  BowVector v;
+  for(int i = 0; i < NENTRIES; ++i)
+  {
+    createBowVector(voc, NWORDS, v);
+    db.add(v);
+  }
+
+  vector<BowVector> queries(NQUERIES);
+  for(int i = 0; i < NQUERIES; ++i)
+    createBowVector(voc, NWORDS, queries[i]);
+
+  const QueryEngine engines[] = { ROW_AT_A_TIME, ENTRY_BLOCKS, ENTRY_BLOCKS };
+  const bool quantized[] = { false, false, true };
+  const char *names[] = { "row at a time", "entry blocks", 
+    "entry blocks (quantized)" };
+
+  vector<QueryResults> reference(NQUERIES);
+
+  for(int e = 0; e < 3; ++e)
+  {
+    db.setQueryEngine(engines[e]);
+    db.setQuantizedScoring(quantized[e]);
+
+    Timestamp t0, t1;
+    t0.setToCurrentTime();
+
+    bool same = true;
+    for(int i = 0; i < NQUERIES; ++i)
+    {
+      QueryResults ret;
+      db.query(queries[i], ret, 10);
+
+      if(e == 0)
+        reference[i] = ret;
+      else if(ret.size() != reference[i].size() ||
+        (!ret.empty() && ret[0].Id != reference[i][0].Id))
+        same = false;
+    }
+
+    t1.setToCurrentTime();
+
+    cout << "Query engine " << names[e] << ": "
+      << (t1 - t0) / NQUERIES * 1e3 << " ms/query"
+      << (same ? "" : " (results differ!)") << endl;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void benchTransformEngines(Surf64Vocabulary &voc)
+{
+  vector<vector<FSurf64::TDescriptor> > features;
+  createFeatures(NIMAGES, NFEATURES, features);
+
+  const TransformEngine engines[] = { FEATURE_AT_A_TIME, INTERLEAVED, 
+    INTERLEAVED };
+  const int group_sizes[] = { 1, 8, 16 };
+  const char *names[] = { "feature at a time", "interleaved (8)",
+    "interleaved (16)" };
+
+  vector<BowVector> reference(NIMAGES);
+
+  for(int e = 0; e < 3; ++e)
+  {
+    voc.setTransformEngine(engines[e], group_sizes[e]);
+
+    Timestamp t0, t1;
+    t0.setToCurrentTime();
+
+    bool same = true;
+    for(int i = 0; i < NIMAGES; ++i)
+    {
+      BowVector v;
+      voc.transform(features[i], v);
+
+      if(e == 0)
+        reference[i] = v;
+      else if(!(v == reference[i]))
+        same = false;
+    }
+
+    t1.setToCurrentTime();
+
+    cout << "Transform engine " << names[e] << ": "
+      << (t1 - t0) / NIMAGES * 1e3 << " ms/image"
+      << (same ? "" : " (results differ!)") << endl;
+  }
+
+  voc.setTransformEngine(FEATURE_AT_A_TIME);
+}
+
+// ----------------------------------------------------------------------------
+
+void benchMeanValues()
+{
+  // ORB descriptors are rows of a single matrix
+  cv::Mat orb_data(NMEAN, FORB::L, CV_8U);
+  vector<cv::Mat> orb(NMEAN);
+  vector<FORB::pDescriptor> porb(NMEAN);
+
+  vector<FBrief::TDescriptor> brief(NMEAN, FBrief::TDescriptor(FORB::L * 8));
+  vector<FBrief::pDescriptor> pbrief(NMEAN);
+
+  for(int i = 0; i < NMEAN; ++i)
+  {
+    unsigned char *p = orb_data.ptr<unsigned char>(i);
+    for(int j = 0; j < FORB::L; ++j) 
+      p[j] = (unsigned char)Random::RandomInt(0, 255);
+    orb[i] = orb_data.row(i);
+    porb[i] = &orb[i];
+
+    for(size_t j = 0; j < brief[i].size(); ++j)
+      brief[i][j] = (Random::RandomInt(0, 1) == 1);
+    pbrief[i] = &brief[i];
+  }
+
+  Timestamp t0, t1, t2;
+
+  cv::Mat orb_ref, orb_mean;
+  t0.setToCurrentTime();
+  referenceMeanValue(porb, orb_ref);
+  t1.setToCurrentTime();
+  FORB::meanValue(porb, orb_mean);
+  t2.setToCurrentTime();
+
+  cout << "ORB mean of " << NMEAN << " descriptors: reference " 
+    << (t1 - t0) * 1e3 << " ms, bit counters " << (t2 - t1) * 1e3 << " ms"
+    << (FORB::distance(orb_ref, orb_mean) == 0 ? "" : " (results differ!)")
+    << endl;
+
+  FBrief::TDescriptor brief_ref(brief[0].size()), brief_mean(brief[0].size());
+  t0.setToCurrentTime();
+  referenceMeanValue(pbrief, brief_ref);
+  t1.setToCurrentTime();
+  FBrief::meanValue(pbrief, brief_mean);
+  t2.setToCurrentTime();
+
+  cout << "BRIEF mean of " << NMEAN << " descriptors: reference " 
+    << (t1 - t0) * 1e3 << " ms, bit counters " << (t2 - t1) * 1e3 << " ms"
+    << (brief_ref == brief_mean ? "" : " (results differ!)") << endl;
+}
+
+// ----------------------------------------------------------------------------
+
+void referenceMeanValue(const vector<FORB::pDescriptor> &descriptors,
+  FORB::TDescriptor &mean)
+{
+  // one bit at a time
+  vector<int> sum(FORB::L * 8, 0);
+
+  for(size_t i = 0; i < descriptors.size(); ++i)
+  {
+    const unsigned char *p = descriptors[i]->ptr<unsigned char>();
+    for(int j = 0; j < FORB::L; ++j, ++p)
+    {
+      if(*p & (1 << 7)) ++sum[ j*8     ];
+      if(*p & (1 << 6)) ++sum[ j*8 + 1 ];
+      if(*p & (1 << 5)) ++sum[ j*8 + 2 ];
+      if(*p & (1 << 4)) ++sum[ j*8 + 3 ];
+      if(*p & (1 << 3)) ++sum[ j*8 + 4 ];
+      if(*p & (1 << 2)) ++sum[ j*8 + 5 ];
+      if(*p & (1 << 1)) ++sum[ j*8 + 6 ];
+      if(*p & (1))      ++sum[ j*8 + 7 ];
+    }
+  }
+
+  mean = cv::Mat::zeros(1, FORB::L, CV_8U);
+  unsigned char *p = mean.ptr<unsigned char>();
+
+  const int N2 = (int)(descriptors.size() / 2 + descriptors.size() % 2);
+  for(size_t i = 0; i < sum.size(); ++i)
+  {
+    if(sum[i] >= N2) p[i / 8] |= 1 << (7 - (i % 8));
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void referenceMeanValue(const vector<FBrief::pDescriptor> &descriptors,
+  FBrief::TDescriptor &mean)
+{
+  // one bit at a time
+  mean.reset();
+  const int N2 = descriptors.size() / 2;
+  vector<int> sum(mean.size(), 0);
+
+  for(size_t i = 0; i < descriptors.size(); ++i)
+  {
+    for(size_t j = 0; j < sum.size(); ++j)
+    {
+      if((*descriptors[i])[j]) ++sum[j];
+    }
+  }
+
+  for(size_t j = 0; j < sum.size(); ++j)
+  {
+    if(sum[j] > N2) mean.set(j);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+// ----------------------------------------------------------------------------
+
+void benchPruning(const Surf64Vocabulary &voc)
+{
+  vector<vector<FSurf64::TDescriptor> > features, queries;
+  createFeatures(NIMAGES, NFEATURES, features);
+
+  // queries are noisy versions of the images
+  createNoisyQueries(features, queries);
+
+  Surf64Database db(voc, true, 2);
+  for(int i = 0; i < NIMAGES; ++i) db.add(features[i]);
+
+  vector<unsigned int> occupancy;
+  voc.getOccupancy(features, occupancy);
+
+  Surf64Vocabulary pruned = voc;
+  vector<WordId> word_map;
+  vector<NodeId> node_map;
+  pruned.prune(occupancy, MIN_OCCUPANCY, word_map, &node_map);
+
+  // the database is remapped instead of rebuilt
+  const double recall = queryRecall(db, queries);
+  db.remapVocabulary(pruned, word_map, node_map);
+  const double pruned_recall = queryRecall(db, queries);
+
+  Timestamp t0, t1, t2;
+  t0.setToCurrentTime();
+  for(int i = 0; i < NIMAGES; ++i)
+  {
+    BowVector v;
+    voc.transform(features[i], v);
+  }
+  t1.setToCurrentTime();
+  for(int i = 0; i < NIMAGES; ++i)
+  {
+    BowVector v;
+    pruned.transform(features[i], v);
+  }
+  t2.setToCurrentTime();
+
+  cout << "Pruning words with less than " << MIN_OCCUPANCY 
+    << " descriptors: " << voc.size() << " -> " << pruned.size() 
+    << " words" << endl;
+  cout << "  transform: " << (t1 - t0) / NIMAGES * 1e3 << " -> " 
+    << (t2 - t1) / NIMAGES * 1e3 << " ms/image" << endl;
+  cout << "  recall@1 of the remapped database: " << recall << " -> " 
+    << pruned_recall << endl;
+}
+
+// ----------------------------------------------------------------------------
+
+double queryRecall(const Surf64Database &db,
+  const vector<vector<FSurf64::TDescriptor> > &queries)
+{
+  int hits = 0;
+  for(size_t i = 0; i < queries.size(); ++i)
+  {
+    QueryResults ret;
+    db.query(queries[i], ret, 1);
+    if(!ret.empty() && ret[0].Id == i) ++hits;
+  }
+  return (double)hits / (double)queries.size();
+}
+
+// ----------------------------------------------------------------------------
+
+void benchBeamSearch(const Surf64Vocabulary &voc)
+{
+  vector<vector<FSurf64::TDescriptor> > features, queries;
+  createFeatures(NIMAGES, NFEATURES, features);
+
+  createNoisyQueries(features, queries);
+
+  // closest words by brute force
+  const vector<FSurf64::TDescriptor> &sample = features[0];
+  const int nexact = min(NEXACT, (int)sample.size());
+  vector<double> closest(nexact, 0.);
+  for(int i = 0; i < nexact; ++i)
+  {
+    closest[i] = FSurf64::distance(sample[i], voc.getWord(0));
+    for(WordId w = 1; w < voc.size(); ++w)
+      closest[i] = min(closest[i], FSurf64::distance(sample[i], 
+        voc.getWord(w)));
+  }
+
+  Surf64Vocabulary beam = voc;
+  const int widths[] = { 1, 2, 4, 8, 16 };
+
+  for(int b = 0; b < 5; ++b)
+  {
+    beam.setBeamWidth(widths[b]);
+
+    Timestamp t0, t1;
+    t0.setToCurrentTime();
+    for(int i = 0; i < NIMAGES; ++i)
+    {
+      BowVector v;
+      beam.transform(features[i], v);
+    }
+    t1.setToCurrentTime();
+
+    // ties count as hits
+    int hits = 0;
+    for(int i = 0; i < nexact; ++i)
+    {
+      const WordId w = beam.transform(sample[i]);
+      if(FSurf64::distance(sample[i], beam.getWord(w)) <= closest[i]) ++hits;
+    }
+
+    cout << "Beam width " << widths[b] << ": " 
+      << (t1 - t0) / NIMAGES * 1e3 << " ms/image, closest word of " 
+      << 100. * hits / nexact << "% of the features" << endl;
+  }
+
+  // soft assignment, with the words found with a beam of 4
+  for(int nwords = 1; nwords <= 3; nwords += 2)
+  {
+    Surf64Vocabulary soft = voc;
+    soft.setBeamWidth(4);
+    soft.setSoftAssignment(nwords, SOFT_SIGMA);
+
+    Surf64Database db(soft, false, 0);
+    for(int i = 0; i < NIMAGES; ++i) db.add(features[i]);
+
+    // the margin between the right image and the others measures how
+    // well the noisy features keep their words
+    double right = 0., other = 0.;
+    for(int i = 0; i < NIMAGES; ++i)
+    {
+      QueryResults ret;
+      db.query(queries[i], ret, 2);
+      for(size_t r = 0; r < ret.size(); ++r)
+      {
+        if(ret[r].Id == (EntryId)i) right += ret[r].Score;
+        else if(r == 0 || ret[0].Id == (EntryId)i) other += ret[r].Score;
+      }
+    }
+
+    cout << "Soft assignment to " << nwords << " words: score of the "
+      "right image " << right / NIMAGES << ", of the best other one " 
+      << other / NIMAGES << endl;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void benchCoarseQueries(const Surf64Vocabulary &voc)
+{
+  vector<vector<FSurf64::TDescriptor> > features, queries;
+  createFeatures(NIMAGES, NFEATURES, features);
+
+  createNoisyQueries(features, queries);
+
+  Surf64Database db(voc, false, 0);
+  db.setCoarseLevel(COARSE_LEVEL);
+  for(int i = 0; i < NIMAGES; ++i) db.add(features[i]);
+
+  int hits[3] = { 0, 0, 0 };
+  Timestamp t0, t1, t2, t3;
+  t0.setToCurrentTime();
+  for(int i = 0; i < NIMAGES; ++i)
+  {
+    QueryResults ret;
+    db.query(queries[i], ret, 1);
+    if(!ret.empty() && ret[0].Id == (EntryId)i) ++hits[0];
+  }
+  t1.setToCurrentTime();
+  for(int i = 0; i < NIMAGES; ++i)
+  {
+    QueryResults ret;
+    db.queryCoarse(queries[i], ret, 1);
+    if(!ret.empty() && ret[0].Id == (EntryId)i) ++hits[1];
+  }
+  t2.setToCurrentTime();
+  for(int i = 0; i < NIMAGES; ++i)
+  {
+    QueryResults ret;
+    db.queryTwoStage(queries[i], ret, 1, COARSE_RESULTS);
+    if(!ret.empty() && ret[0].Id == (EntryId)i) ++hits[2];
+  }
+  t3.setToCurrentTime();
+
+  cout << "Queries at level " << COARSE_LEVEL << " of " 
+    << voc.getDepthLevels() << ":" << endl;
+  cout << "  leaves: " << (t1 - t0) / NIMAGES * 1e3 << " ms/query, "
+    "recall@1 " << (double)hits[0] / NIMAGES << endl;
+  cout << "  coarse: " << (t2 - t1) / NIMAGES * 1e3 << " ms/query, "
+    "recall@1 " << (double)hits[1] / NIMAGES << endl;
+  cout << "  two stages (" << COARSE_RESULTS << " candidates): " 
+    << (t3 - t2) / NIMAGES * 1e3 << " ms/query, recall@1 " 
+    << (double)hits[2] / NIMAGES << endl;
+}
+
+// ----------------------------------------------------------------------------
+
+void benchTransformCache(const Surf64Vocabulary &voc)
+{
+  // a sequence of images whose features are tracked from the previous 
+  // one, with a few of them changing their descriptor
+  vector<vector<FSurf64::TDescriptor> > images;
+  createFeatures(1, NFEATURES, images);
+  images.resize(NIMAGES);
+  for(int i = 1; i < NIMAGES; ++i)
+  {
+    images[i] = images[i-1];
+    for(size_t j = 0; j < images[i].size(); ++j)
+    {
+      if(Random::RandomValue<double>(0, 1) >= UNTRACKED_FEATURES) continue;
+      for(int k = 0; k < FSurf64::L; ++k)
+        images[i][j][k] += Random::RandomValue<float>(-QUERY_NOISE, 
+          QUERY_NOISE);
+    }
+  }
+
+  vector<vector<WordId> > words(NIMAGES);
+  Timestamp t0, t1;
+  t0.setToCurrentTime();
+  for(int i = 0; i < NIMAGES; ++i)
+  {
+    words[i].resize(images[i].size());
+    for(size_t j = 0; j < images[i].size(); ++j)
+      words[i][j] = voc.transform(images[i][j]);
+  }
+  t1.setToCurrentTime();
+  cout << "Transforming a sequence: " << (t1 - t0) / NIMAGES * 1e3 
+    << " ms/image" << endl;
+
+  for(int hints = 0; hints < 2; ++hints)
+  {
+    Surf64Vocabulary::TransformCache cache(voc);
+    vector<WordId> previous, current;
+    int same = 0;
+    BowVector v;
+
+    t0.setToCurrentTime();
+    for(int i = 0; i < NIMAGES; ++i)
+    {
+      cache.transform(images[i], v, (hints && i > 0 ? &previous : NULL),
+        &current);
+      for(size_t j = 0; j < current.size(); ++j)
+        if(current[j] == words[i][j]) ++same;
+      previous.swap(current);
+    }
+    t1.setToCurrentTime();
+
+    cout << "  with a cache" << (hints ? " and hints: " : ": ") 
+      << (t1 - t0) / NIMAGES * 1e3 << " ms/image, " << cache.getHits() 
+      << " hits, " << cache.getMisses() << " misses, " 
+      << 100. * same / (NIMAGES * NFEATURES) << "% of the words equal"
+      << (same == NIMAGES * NFEATURES ? "" : " (words differ!)") << endl;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void benchGrowth(const Surf64Vocabulary &voc)
+{
+  // the entries added before growing the vocabulary must get the same 
+  // scores after it
+  vector<vector<FSurf64::TDescriptor> > features, queries;
+  createFeatures(NIMAGES, NFEATURES, features);
+  createNoisyQueries(features, queries);
+
+  Surf64Vocabulary grown = voc;
+  Surf64Database db(grown, false, 0);
+  for(int i = 0; i < NIMAGES / 2; ++i) db.add(features[i]);
+
+  vector<QueryResults> before(NIMAGES);
+  Timestamp t0, t1;
+  t0.setToCurrentTime();
+  for(int i = 0; i < NIMAGES; ++i)
+    db.query(queries[i], before[i], NIMAGES);
+  t1.setToCurrentTime();
+  const double t_before = (t1 - t0) / NIMAGES * 1e3;
+
+  const unsigned int added = grown.grow(features, GROW_OCCUPANCY);
+  db.updateVocabulary(grown);
+  for(int i = NIMAGES / 2; i < NIMAGES; ++i) db.add(features[i]);
+
+  double max_diff = 0;
+  int hits = 0;
+  t0.setToCurrentTime();
+  for(int i = 0; i < NIMAGES; ++i)
+  {
+    QueryResults ret;
+    db.query(queries[i], ret, NIMAGES);
+    if(!ret.empty() && ret[0].Id == (EntryId)i) ++hits;
+
+    // scores of the pre-growth entries, by id
+    vector<double> scores(NIMAGES / 2, 0);
+    for(size_t j = 0; j < ret.size(); ++j)
+      if(ret[j].Id < (EntryId)(NIMAGES / 2)) scores[ret[j].Id] = ret[j].Score;
+    for(size_t j = 0; j < before[i].size(); ++j)
+    {
+      const double d = fabs(scores[before[i][j].Id] - before[i][j].Score);
+      if(d > max_diff) max_diff = d;
+    }
+  }
+  t1.setToCurrentTime();
+
+  cout << "Growing the vocabulary with " << added << " words:" << endl;
+  cout << "  before: " << t_before << " ms/query" << endl;
+  cout << "  after: " << (t1 - t0) / NIMAGES * 1e3 << " ms/query, "
+    "recall@1 " << (double)hits / NIMAGES << ", max score change of the "
+    "former entries " << max_diff 
+    << (max_diff < 1e-6 ? "" : " (scores differ!)") << endl;
+}
+
+// ----------------------------------------------------------------------------
+
+void benchMatcher(const Surf64Vocabulary &voc)
+{
+  // feature j of each query image must match feature j of its image
+  vector<vector<FSurf64::TDescriptor> > features, queries;
+  createFeatures(NIMAGES, NFEATURES, features);
+  createNoisyQueries(features, queries);
+
+  vector<FeatureVector> train_fv(NIMAGES), query_fv(NIMAGES);
+  for(int i = 0; i < NIMAGES; ++i)
+  {
+    BowVector v;
+    voc.transform(features[i], v, train_fv[i], MATCH_LEVELS_UP);
+    voc.transform(queries[i], v, query_fv[i], MATCH_LEVELS_UP);
+  }
+
+  Surf64Matcher matcher(MATCH_RATIO, -1, false);
+  int nmatches[2] = { 0, 0 }, right[2] = { 0, 0 };
+  Timestamp t0, t1, t2;
+
+  t0.setToCurrentTime();
+  for(int i = 0; i < NIMAGES; ++i)
+  {
+    for(size_t q = 0; q < queries[i].size(); ++q)
+    {
+      double best = std::numeric_limits<double>::max(), second = best;
+      size_t best_idx = 0;
+      for(size_t t = 0; t < features[i].size(); ++t)
+      {
+        const double d = FSurf64::distance(queries[i][q], features[i][t]);
+        if(d < best)
+        {
+          second = best;
+          best = d;
+          best_idx = t;
+        }
+        else if(d < second)
+          second = d;
+      }
+
+      if(best < MATCH_RATIO * second)
+      {
+        ++nmatches[0];
+        if(best_idx == q) ++right[0];
+      }
+    }
+  }
+  t1.setToCurrentTime();
+  for(int i = 0; i < NIMAGES; ++i)
+  {
+    vector<FeatureMatch> matches;
+    matcher.match(queries[i], query_fv[i], features[i], train_fv[i], 
+      matches);
+    nmatches[1] += matches.size();
+    for(size_t j = 0; j < matches.size(); ++j)
+      if(matches[j].QueryIdx == matches[j].TrainIdx) ++right[1];
+  }
+  t2.setToCurrentTime();
+
+  cout << "Matching " << NFEATURES << " features:" << endl;
+  cout << "  brute force: " << (t1 - t0) / NIMAGES * 1e3 << " ms/image, "
+    << (double)nmatches[0] / NIMAGES << " matches/image, " 
+    << 100. * right[0] / std::max(nmatches[0], 1) << "% right" << endl;
+  cout << "  by nodes " << MATCH_LEVELS_UP << " levels up: " 
+    << (t2 - t1) / NIMAGES * 1e3 << " ms/image, " 
+    << (double)nmatches[1] / NIMAGES << " matches/image, " 
+    << 100. * right[1] / std::max(nmatches[1], 1) << "% right" << endl;
+}
+
+// ----------------------------------------------------------------------------
+
+void benchOrbValues()
+{
+  // ORB descriptors as extracted by OpenCV, one matrix per image
+  vector<cv::Mat> data(NIMAGES);
+  for(int i = 0; i < NIMAGES; ++i)
+  {
+    data[i].create(NFEATURES, FORB::L, CV_8U);
+    for(int r = 0; r < NFEATURES; ++r)
+      for(int k = 0; k < FORB::L; ++k)
+        data[i].at<unsigned char>(r, k) = 
+          (unsigned char)Random::RandomInt(0, 255);
+  }
+
+  // one header per row vs one value per row
+  vector<vector<FORB::TDescriptor> > orb(NIMAGES);
+  vector<vector<FORB256::TDescriptor> > orb256(NIMAGES);
+  for(int i = 0; i < NIMAGES; ++i)
+  {
+    orb[i].resize(NFEATURES);
+    for(int r = 0; r < NFEATURES; ++r) orb[i][r] = data[i].row(r);
+    FORB256::fromMat8U(data[i], orb256[i]);
+  }
+
+  // same seeds, so that both vocabularies are the same
+  OrbVocabulary voc(10, 4, TF_IDF, L1_NORM);
+  Orb256Vocabulary voc256(10, 4, TF_IDF, L1_NORM);
+
+  Timestamp t0, t1, t2;
+  Random::SeedRand(0);
+  t0.setToCurrentTime();
+  voc.create(orb);
+  t1.setToCurrentTime();
+  Random::SeedRand(0);
+  voc256.create(orb256);
+  t2.setToCurrentTime();
+
+  cout << "Creating ORB vocabularies: FORB " << t1 - t0 << " s, FORB256 "
+    << t2 - t1 << " s" << endl;
+
+  int same = 0;
+  t0.setToCurrentTime();
+  for(int i = 0; i < NIMAGES; ++i)
+  {
+    BowVector v;
+    voc.transform(orb[i], v);
+  }
+  t1.setToCurrentTime();
+  for(int i = 0; i < NIMAGES; ++i)
+  {
+    BowVector v;
+    voc256.transform(orb256[i], v);
+  }
+  t2.setToCurrentTime();
+  for(int r = 0; r < NFEATURES; ++r)
+    if(voc.transform(orb[0][r]) == voc256.transform(orb256[0][r])) ++same;
+
+  cout << "  transform: FORB " << (t1 - t0) / NIMAGES * 1e3 << " ms/image, "
+    "FORB256 " << (t2 - t1) / NIMAGES * 1e3 << " ms/image, " 
+    << 100. * same / NFEATURES << "% of the words equal" << endl;
+  cout << "  descriptor size: FORB " << sizeof(FORB::TDescriptor) + FORB::L
+    << " bytes, FORB256 " << sizeof(FORB256::TDescriptor) << " bytes" 
+    << endl;
+}
+
+// ----------------------------------------------------------------------------
+
+void benchBriefValues()
+{
+  // BRIEF descriptors as computed by DVision, one bitset per feature
+  vector<vector<FBrief::TDescriptor> > brief(NIMAGES);
+  vector<vector<FBrief256::TDescriptor> > brief256(NIMAGES);
+  for(int i = 0; i < NIMAGES; ++i)
+  {
+    brief[i].resize(NFEATURES, FBrief::TDescriptor(FBrief256::BITS));
+    for(int r = 0; r < NFEATURES; ++r)
+      for(int k = 0; k < FBrief256::BITS; ++k)
+        brief[i][r][k] = (Random::RandomInt(0, 1) == 1);
+    FBrief256::fromBitset(brief[i], brief256[i]);
+  }
+
+  vector<FBrief::pDescriptor> pbrief;
+  vector<FBrief256::pDescriptor> pbrief256;
+  for(int i = 0; i < NIMAGES; ++i)
+  {
+    for(int r = 0; r < NFEATURES; ++r)
+    {
+      pbrief.push_back(&brief[i][r]);
+      pbrief256.push_back(&brief256[i][r]);
+    }
+  }
+
+  Timestamp t0, t1, t2;
+
+  FBrief::TDescriptor mean(FBrief256::BITS);
+  FBrief256::TDescriptor mean256;
+  t0.setToCurrentTime();
+  FBrief::meanValue(pbrief, mean);
+  t1.setToCurrentTime();
+  FBrief256::meanValue(pbrief256, mean256);
+  t2.setToCurrentTime();
+
+  cout << "BRIEF mean of " << pbrief.size() << " descriptors: FBrief " 
+    << (t1 - t0) * 1e3 << " ms, FBrief256 " << (t2 - t1) * 1e3 << " ms"
+    << (FBrief::toString(mean) == FBrief256::toString(mean256) ? "" : 
+      " (results differ!)") << endl;
+
+  // same seeds, so that both vocabularies are the same
+  BriefVocabulary voc(10, 4, TF_IDF, L1_NORM);
+  Brief256Vocabulary voc256(10, 4, TF_IDF, L1_NORM);
+
+  Random::SeedRand(0);
+  t0.setToCurrentTime();
+  voc.create(brief);
+  t1.setToCurrentTime();
+  Random::SeedRand(0);
+  voc256.create(brief256);
+  t2.setToCurrentTime();
+
+  cout << "Creating BRIEF vocabularies: FBrief " << t1 - t0 
+    << " s, FBrief256 " << t2 - t1 << " s" << endl;
+
+  int same = 0;
+  t0.setToCurrentTime();
+  for(int i = 0; i < NIMAGES; ++i)
+  {
+    BowVector v;
+    voc.transform(brief[i], v);
+  }
+  t1.setToCurrentTime();
+  for(int i = 0; i < NIMAGES; ++i)
+  {
+    BowVector v;
+    voc256.transform(brief256[i], v);
+  }
+  t2.setToCurrentTime();
+  for(int r = 0; r < NFEATURES; ++r)
+    if(voc.transform(brief[0][r]) == voc256.transform(brief256[0][r])) 
+      ++same;
+
+  cout << "  transform: FBrief " << (t1 - t0) / NIMAGES * 1e3 
+    << " ms/image, FBrief256 " << (t2 - t1) / NIMAGES * 1e3 << " ms/image, " 
+    << 100. * same / NFEATURES << "% of the words equal" << endl;
+}
@@ -0,0 +1,102 @@
+/**
+ * File: BitCounter.h
+ * Date: October 2026
+ * Description: counters of the set bits of many binary descriptors
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_BIT_COUNTER__
+#define __D_T_BIT_COUNTER__
+
+#include <vector>
+#include <cstddef>
+#include <stdint.h>
+
+namespace DBoW2 {
+
+/// Counts how many times each bit is set in a sequence of byte strings
+/**
+ * Instead of testing the bits one by one, the counters of the 8 bits of 
+ * each byte are kept in the 8 bytes of a 64-bit word, so that a byte is 
+ * counted with one table lookup and one addition. The small counters are 
+ * moved to the full ones before they can overflow. Bit i of the counter 
+ * is bit (i % 8) of byte (i / 8), from the least significant bit.
+ */
+class BitCounter
+{
+public:
+
+  /**
+   * Creates the counters of byte strings of the given length
+   * @param nbytes number of bytes of each string
+   */
+  BitCounter(size_t nbytes = 0);
+
+  /**
+   * Clears the counters and sets the length of the byte strings
+   * @param nbytes number of bytes of each string
+   */
+  void reset(size_t nbytes);
+
+  /**
+   * Counts the set bits of a byte string
+   * @param bytes string with the number of bytes given in the constructor
+   */
+  void add(const unsigned char *bytes);
+
+  /**
+   * Returns the number of times each bit was set
+   * @return counters of the nbytes * 8 bits
+   */
+  const std::vector<unsigned int>& counts();
+
+  /**
+   * Returns the number of byte strings added
+   * @return number of strings
+   */
+  inline size_t size() const { return m_n; }
+
+  /**
+   * Counts the set bits of a word
+   * @param v
+   * @return number of bits set
+   */
+  static inline int popcount(uint64_t v)
+  {
+#ifdef __GNUC__
+    return __builtin_popcountll(v);
+#else
+    v = v - ((v >> 1) & (uint64_t)~(uint64_t)0/3);
+    v = (v & (uint64_t)~(uint64_t)0/15*3) + ((v >> 2) &
+      (uint64_t)~(uint64_t)0/15*3);
+    v = (v + (v >> 4)) & (uint64_t)~(uint64_t)0/255*15;
+    return (int)((uint64_t)(v * ((uint64_t)~(uint64_t)0/255)) >> 56);
+#endif
+  }
+
+protected:
+
+  /**
+   * Moves the byte counters to the full counters
+   */
+  void flush();
+
+protected:
+
+  /// Byte counters: byte i of m_lanes[j] counts bit i of byte j
+  std::vector<uint64_t> m_lanes;
+
+  /// Full counters
+  std::vector<unsigned int> m_counts;
+
+  /// Number of strings added to m_lanes since the last flush
+  unsigned int m_pending;
+
+  /// Number of strings added
+  size_t m_n;
+};
+
+} // namespace DBoW2
+
+#endif
@@ -0,0 +1,332 @@
+/**
+ * File: CompactFeatureVector.h
+ * Date: October 2026
+ * Description: feature vectors stored in contiguous arrays (CSR layout)
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_COMPACT_FEATURE_VECTOR__
+#define __D_T_COMPACT_FEATURE_VECTOR__
+
+#include "BowVector.h"
+#include "FeatureVector.h"
+#include <vector>
+#include <utility>
+#include <iostream>
+
+namespace DBoW2 {
+
+/// Indexes of the local features of a node, stored elsewhere
+class FeatureIndices
+{
+public:
+
+  typedef const unsigned int* const_iterator;
+
+  /**
+   * Creates a range of feature indexes
+   * @param begin first index
+   * @param end index after the last one
+   */
+  inline FeatureIndices(const unsigned int *begin = NULL,
+    const unsigned int *end = NULL): m_begin(begin), m_end(end){}
+
+  inline const_iterator begin() const { return m_begin; }
+  inline const_iterator end() const { return m_end; }
+  inline size_t size() const { return m_end - m_begin; }
+  inline bool empty() const { return m_begin == m_end; }
+  inline unsigned int operator[](size_t i) const { return m_begin[i]; }
+
+protected:
+
+  const unsigned int *m_begin;
+  const unsigned int *m_end;
+};
+
+/// Read-only view of a feature vector stored in CSR layout
+/**
+ * The view does not own the data. It can be iterated as a FeatureVector:
+ * it->first is the node id and it->second, the indexes of the features
+ * of that node. Nodes are in ascending id order.
+ */
+class FeatureVectorView
+{
+public:
+
+  /// Node and its feature indexes
+  typedef std::pair<NodeId, FeatureIndices> value_type;
+
+  /// Iterator over the nodes of the view. It remains valid after the
+  /// view is destroyed, as long as the underlying arrays are not modified
+  class const_iterator
+  {
+  public:
+
+    inline const_iterator(): m_nodes(NULL), m_offsets(NULL),
+      m_features(NULL){}
+
+    inline const_iterator(const NodeId *nodes, const unsigned int *offsets,
+      const unsigned int *features)
+      : m_nodes(nodes), m_offsets(offsets), m_features(features){}
+
+    inline const value_type& operator*() const { update(); return m_value; }
+    inline const value_type* operator->() const { update(); return &m_value; }
+
+    inline const_iterator& operator++()
+      { ++m_nodes; ++m_offsets; return *this; }
+    inline const_iterator operator++(int)
+      { const_iterator it = *this; ++(*this); return it; }
+
+    inline bool operator==(const const_iterator &it) const
+      { return m_nodes == it.m_nodes; }
+    inline bool operator!=(const const_iterator &it) const
+      { return m_nodes != it.m_nodes; }
+
+  protected:
+
+    inline void update() const
+    {
+      m_value.first = *m_nodes;
+      m_value.second = FeatureIndices(m_features + m_offsets[0],
+        m_features + m_offsets[1]);
+    }
+
+  protected:
+
+    const NodeId *m_nodes;
+    const unsigned int *m_offsets;
+    const unsigned int *m_features;
+    mutable value_type m_value;
+  };
+
+  /**
+   * Creates an empty view
+   */
+  inline FeatureVectorView(): m_nodes(NULL), m_offsets(NULL),
+    m_features(NULL), m_size(0){}
+
+  /**
+   * Creates a view of CSR arrays
+   * @param nodes node ids, in ascending order
+   * @param offsets the features of node i are features[offsets[i]] ..
+   *   features[offsets[i+1] - 1]. It must contain size + 1 items
+   * @param features feature indexes
+   * @param size number of nodes
+   */
+  inline FeatureVectorView(const NodeId *nodes, const unsigned int *offsets,
+    const unsigned int *features, size_t size)
+    : m_nodes(nodes), m_offsets(offsets), m_features(features),
+    m_size(size){}
+
+  /// Number of nodes
+  inline size_t size() const { return m_size; }
+
+  /// Returns whether there are no nodes
+  inline bool empty() const { return m_size == 0; }
+
+  inline const_iterator begin() const
+    { return const_iterator(m_nodes, m_offsets, m_features); }
+  inline const_iterator end() const
+    { return const_iterator(m_nodes + m_size, m_offsets + m_size, m_features); }
+
+  /**
+   * Returns the id of the i-th node
+   * @param i node index (< size())
+   */
+  inline NodeId nodeId(size_t i) const { return m_nodes[i]; }
+
+  /**
+   * Returns the feature indexes of the i-th node
+   * @param i node index (< size())
+   */
+  inline FeatureIndices features(size_t i) const
+  {
+    return FeatureIndices(m_features + m_offsets[i],
+      m_features + m_offsets[i+1]);
+  }
+
+  /**
+   * Returns the i-th node and its features
+   * @param i node index (< size())
+   */
+  inline value_type at(size_t i) const
+  {
+    return value_type(nodeId(i), features(i));
+  }
+
+  /**
+   * Looks for a node
+   * @param id node id
+   * @return iterator to the node, or end() if it is not in the view
+   */
+  const_iterator find(NodeId id) const;
+
+  /**
+   * Copies the view into a FeatureVector
+   * @param fv (out) feature vector
+   */
+  void toFeatureVector(FeatureVector &fv) const;
+
+  /**
+   * Sends a string version of the view through the stream, in the same
+   * format as FeatureVector
+   * @param out stream
+   * @param v view
+   */
+  friend std::ostream& operator<<(std::ostream &out,
+    const FeatureVectorView &v);
+
+protected:
+
+  const NodeId *m_nodes;
+  const unsigned int *m_offsets;
+  const unsigned int *m_features;
+  size_t m_size;
+};
+
+/// Feature vector stored in three contiguous arrays
+class CompactFeatureVector
+{
+public:
+
+  /**
+   * Creates an empty vector
+   */
+  CompactFeatureVector();
+
+  /**
+   * Creates a vector with the content of a FeatureVector
+   * @param fv feature vector
+   */
+  explicit CompactFeatureVector(const FeatureVector &fv);
+
+  /**
+   * Removes all the nodes
+   */
+  void clear();
+
+  /**
+   * Sets the content from pairs of node id and feature index
+   * @param pairs (in/out) <node id, feature index>. They are sorted
+   */
+  void assign(std::vector<std::pair<NodeId, unsigned int> > &pairs);
+
+  /**
+   * Sets the content from a FeatureVector
+   * @param fv feature vector
+   */
+  void assign(const FeatureVector &fv);
+
+  /// Number of nodes
+  inline size_t size() const { return m_nodes.size(); }
+
+  /// Returns whether there are no nodes
+  inline bool empty() const { return m_nodes.empty(); }
+
+  /**
+   * Returns a view of the vector, valid until it is modified
+   */
+  FeatureVectorView view() const;
+
+protected:
+
+  /// Node ids, in ascending order
+  std::vector<NodeId> m_nodes;
+
+  /// Offsets of the features of each node. It has size() + 1 items
+  std::vector<unsigned int> m_offsets;
+
+  /// Feature indexes of all the nodes
+  std::vector<unsigned int> m_features;
+};
+
+/// Feature vectors of many entries stored in a single arena
+/**
+ * This is the direct file of the database: node ids, node offsets and
+ * feature indexes of all the entries are in three arrays, and entry i
+ * spans nodes entry_offsets[i] .. entry_offsets[i+1] - 1. Entries can
+ * only be appended.
+ */
+class CompactDirectFile
+{
+public:
+
+  /**
+   * Creates an empty file
+   */
+  CompactDirectFile();
+
+  /**
+   * Removes all the entries
+   */
+  void clear();
+
+  /**
+   * Reserves memory
+   * @param nentries number of entries
+   * @param nnodes total number of nodes
+   * @param nfeatures total number of feature indexes
+   */
+  void reserve(size_t nentries, size_t nnodes = 0, size_t nfeatures = 0);
+
+  /**
+   * Appends an entry
+   * @param fv features of the entry
+   */
+  void push_back(const FeatureVector &fv);
+
+  /**
+   * Appends an entry
+   * @param fv features of the entry
+   */
+  void push_back(const FeatureVectorView &fv);
+
+  /**
+   * Appends an empty entry, which can be filled with addNode and
+   * addFeature
+   */
+  void push_back();
+
+  /**
+   * Adds a node to the last entry. Nodes must be added in ascending order
+   * @param id node id
+   */
+  void addNode(NodeId id);
+
+  /**
+   * Adds a feature index to the last node of the last entry
+   * @param i_feature feature index
+   */
+  void addFeature(unsigned int i_feature);
+
+  /// Number of entries
+  inline size_t size() const { return m_entry_offsets.size() - 1; }
+
+  /// Returns whether there are no entries
+  inline bool empty() const { return size() == 0; }
+
+  /**
+   * Returns a view of an entry, valid until the file is modified
+   * @param i entry index (< size())
+   */
+  FeatureVectorView operator[](size_t i) const;
+
+protected:
+
+  /// Node ids of all the entries
+  std::vector<NodeId> m_nodes;
+
+  /// Offsets in m_features of each node. It has m_nodes.size() + 1 items
+  std::vector<unsigned int> m_node_offsets;
+
+  /// Feature indexes of all the nodes
+  std::vector<unsigned int> m_features;
+
+  /// Offsets in m_nodes of each entry. It has size() + 1 items
+  std::vector<unsigned int> m_entry_offsets;
+};
+
+} // namespace DBoW2
+
+#endif
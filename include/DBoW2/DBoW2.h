@@ -62,12 +62,17 @@ namespace DBoW2
 
 #include "TemplatedVocabulary.h"
 #include "TemplatedDatabase.h"
+#include "TemplatedMatcher.h"
 #include "BowVector.h"
 #include "FeatureVector.h"
+#include "CompactFeatureVector.h"
 #include "QueryResults.h"
+#include "EntryFilter.h"
 #include "FSurf64.h"
 #include "FBrief.h"
+#include "FBrief256.h"
 #include "FORB.h"
+#include "FORB256.h"
 #include "FCNN.h"
 
 /// SURF64 Vocabulary
@@ -77,6 +82,10 @@ typedef DBoW2::TemplatedVocabulary<DBoW2::FSurf64::TDescriptor, DBoW2::FSurf64>
 /// SURF64 Database
 typedef DBoW2::TemplatedDatabase<DBoW2::FSurf64::TDescriptor, DBoW2::FSurf64> 
   Surf64Database;
+
+/// SURF64 Matcher
+typedef DBoW2::TemplatedMatcher<DBoW2::FSurf64::TDescriptor, DBoW2::FSurf64>
+  Surf64Matcher;
   
 /// BRIEF Vocabulary
 typedef DBoW2::TemplatedVocabulary<DBoW2::FBrief::TDescriptor, DBoW2::FBrief> 
@@ -86,6 +95,22 @@ typedef DBoW2::TemplatedVocabulary<DBoW2::FBrief::TDescriptor, DBoW2::FBrief>
 typedef DBoW2::TemplatedDatabase<DBoW2::FBrief::TDescriptor, DBoW2::FBrief> 
   BriefDatabase;
 
+/// BRIEF Matcher
+typedef DBoW2::TemplatedMatcher<DBoW2::FBrief::TDescriptor, DBoW2::FBrief>
+  BriefMatcher;
+
+/// BRIEF Vocabulary with 256-bit descriptor values
+typedef DBoW2::TemplatedVocabulary<DBoW2::FBrief256::TDescriptor, 
+  DBoW2::FBrief256> Brief256Vocabulary;
+
+/// BRIEF Database with 256-bit descriptor values
+typedef DBoW2::TemplatedDatabase<DBoW2::FBrief256::TDescriptor, 
+  DBoW2::FBrief256> Brief256Database;
+
+/// BRIEF Matcher with 256-bit descriptor values
+typedef DBoW2::TemplatedMatcher<DBoW2::FBrief256::TDescriptor, 
+  DBoW2::FBrief256> Brief256Matcher;
+
 /// CNN Vocabulary
 typedef DBoW2::TemplatedVocabulary<DBoW2::FCNN::TDescriptor, DBoW2::FCNN>
   CnnVocabulary;
@@ -94,6 +119,10 @@ typedef DBoW2::TemplatedVocabulary<DBoW2::FCNN::TDescriptor, DBoW2::FCNN>
 typedef DBoW2::TemplatedDatabase<DBoW2::FCNN::TDescriptor, DBoW2::FCNN>
   CnnDatabase;
 
+/// CNN Matcher
+typedef DBoW2::TemplatedMatcher<DBoW2::FCNN::TDescriptor, DBoW2::FCNN>
+  CnnMatcher;
+
 /// ORB Vocabulary
 typedef DBoW2::TemplatedVocabulary<DBoW2::FORB::TDescriptor, DBoW2::FORB>
   OrbVocabulary;
@@ -102,5 +131,21 @@ typedef DBoW2::TemplatedVocabulary<DBoW2::FORB::TDescriptor, DBoW2::FORB>
 typedef DBoW2::TemplatedDatabase<DBoW2::FORB::TDescriptor, DBoW2::FORB>
   OrbDatabase;
 
+/// ORB Matcher
+typedef DBoW2::TemplatedMatcher<DBoW2::FORB::TDescriptor, DBoW2::FORB>
+  OrbMatcher;
+
+/// ORB Vocabulary with 256-bit descriptor values
+typedef DBoW2::TemplatedVocabulary<DBoW2::FORB256::TDescriptor, 
+  DBoW2::FORB256> Orb256Vocabulary;
+
+/// ORB Database with 256-bit descriptor values
+typedef DBoW2::TemplatedDatabase<DBoW2::FORB256::TDescriptor, 
+  DBoW2::FORB256> Orb256Database;
+
+/// ORB Matcher with 256-bit descriptor values
+typedef DBoW2::TemplatedMatcher<DBoW2::FORB256::TDescriptor, 
+  DBoW2::FORB256> Orb256Matcher;
+
 #endif
 
@@ -0,0 +1,145 @@
+/**
+ * File: EntryFilter.h
+ * Date: October 2026
+ * Description: set of database entries that can be returned by a query
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_ENTRY_FILTER__
+#define __D_T_ENTRY_FILTER__
+
+#include <vector>
+#include <iostream>
+#include <stdint.h>
+
+#include "QueryResults.h"
+
+namespace DBoW2 {
+
+/// Set of entries that are allowed or denied in a query
+/**
+ * The filter is a bitmap of entry ids. Entries that have not been set
+ * explicitly take the default state given in the constructor, so that
+ * both allow lists (default denied) and deny lists (default allowed) are
+ * cheap to build. E.g. to exclude the last N entries and some others:
+ *
+ *   EntryFilter filter(true);
+ *   filter.deny(db.size() - N, db.size());
+ *   filter.deny(covisible_id);
+ */
+class EntryFilter
+{
+public:
+
+  /**
+   * Creates a filter in which all the entries have the given state
+   * @param allowed default state of the entries
+   */
+  EntryFilter(bool allowed = true);
+
+  /**
+   * Allows an entry
+   * @param id entry id
+   */
+  void allow(EntryId id);
+
+  /**
+   * Allows the entries in the range [first, last)
+   * @param first first entry id
+   * @param last entry id after the last one
+   */
+  void allow(EntryId first, EntryId last);
+
+  /**
+   * Denies an entry
+   * @param id entry id
+   */
+  void deny(EntryId id);
+
+  /**
+   * Denies the entries in the range [first, last)
+   * @param first first entry id
+   * @param last entry id after the last one
+   */
+  void deny(EntryId first, EntryId last);
+
+  /**
+   * Sets all the entries to the given state
+   * @param allowed state of the entries
+   */
+  void reset(bool allowed = true);
+
+  /**
+   * Checks if an entry is allowed
+   * @param id entry id
+   * @return true iff the entry is allowed
+   */
+  inline bool isAllowed(EntryId id) const;
+
+  /**
+   * Returns the first allowed entry id >= id
+   * @param id entry id
+   * @return allowed entry id, or the maximum EntryId value if there is none
+   */
+  EntryId nextAllowed(EntryId id) const;
+
+  /**
+   * Checks if some entry in the range [first, last) is allowed
+   * @param first first entry id
+   * @param last entry id after the last one
+   * @return true iff any entry is allowed
+   */
+  bool anyAllowed(EntryId first, EntryId last) const;
+
+  /**
+   * Checks if all the entries in the range [first, last) are allowed
+   * @param first first entry id
+   * @param last entry id after the last one
+   * @return true iff all the entries are allowed
+   */
+  bool allAllowed(EntryId first, EntryId last) const;
+
+  /**
+   * Prints the allowed ranges of the filter
+   * @param os ostream
+   * @param filter EntryFilter to print
+   */
+  friend std::ostream & operator<<(std::ostream& os,
+    const EntryFilter& filter);
+
+protected:
+
+  /**
+   * Sets the state of the entries in the range [first, last)
+   * @param first first entry id
+   * @param last entry id after the last one
+   * @param allowed new state
+   */
+  void set(EntryId first, EntryId last, bool allowed);
+
+protected:
+
+  /// Bitmap of entries. Bit i is set iff entry i is allowed
+  std::vector<uint64_t> m_bits;
+
+  /// State of the entries beyond the bitmap
+  bool m_default;
+
+};
+
+// --------------------------------------------------------------------------
+
+inline bool EntryFilter::isAllowed(EntryId id) const
+{
+  const size_t w = id >> 6;
+  if(w >= m_bits.size()) return m_default;
+  return (m_bits[w] >> (id & 63)) & 1;
+}
+
+// --------------------------------------------------------------------------
+
+} // namespace DBoW2
+
+#endif
+
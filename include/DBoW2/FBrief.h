@@ -43,6 +43,13 @@ public:
    */
   static double distance(const TDescriptor &a, const TDescriptor &b);
   
+  /**
+   * Returns a hash of the bits of the descriptor
+   * @param a
+   * @return hash
+   */
+  static size_t hash(const TDescriptor &a);
+  
   /**
    * Returns a string version of the descriptor
    * @param a descriptor
@@ -0,0 +1,133 @@
+/**
+ * File: FBrief256.h
+ * Date: October 2026
+ * Description: functions for BRIEF descriptors stored in fixed-size values
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_F_BRIEF_256__
+#define __D_T_F_BRIEF_256__
+
+#include <opencv2/core.hpp>
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#include <DVision/DVision.h>
+
+#include "FClass.h"
+#include "BitCounter.h"
+
+namespace DBoW2 {
+
+/// Functions to manipulate BRIEF descriptors stored as 256-bit values
+/**
+ * The descriptors are plain values instead of dynamic bitsets, so that they
+ * are not allocated in the heap one by one and the distance is computed
+ * inline on four 64-bit words. Bit i of a descriptor is bit (i % 64) of
+ * bits[i / 64], as bit i of a DVision::BRIEF::bitset. Their string version
+ * is the same as that of FBrief, so vocabularies and databases saved with
+ * FBrief can be loaded with this class and vice versa
+ */
+class FBrief256: protected FClass
+{
+public:
+
+  /// Descriptor type
+  struct TDescriptor
+  {
+    /// Bits of the BRIEF descriptor, from the least significant one
+    uint64_t bits[4];
+  };
+  /// Pointer to a single descriptor
+  typedef const TDescriptor *pDescriptor;
+  /// Descriptor length (in bits)
+  static const int BITS = 256;
+
+  /**
+   * Calculates the mean value of a set of descriptors
+   * @param descriptors
+   * @param mean mean descriptor
+   */
+  static void meanValue(const std::vector<pDescriptor> &descriptors,
+    TDescriptor &mean);
+
+  /**
+   * Calculates the distance between two descriptors
+   * @param a
+   * @param b
+   * @return distance
+   */
+  static inline double distance(const TDescriptor &a, const TDescriptor &b)
+  {
+    return BitCounter::popcount(a.bits[0] ^ b.bits[0]) +
+      BitCounter::popcount(a.bits[1] ^ b.bits[1]) +
+      BitCounter::popcount(a.bits[2] ^ b.bits[2]) +
+      BitCounter::popcount(a.bits[3] ^ b.bits[3]);
+  }
+
+  /**
+   * Returns a hash of the bits of the descriptor
+   * @param a
+   * @return hash
+   */
+  static size_t hash(const TDescriptor &a);
+
+  /**
+   * Returns a string version of the descriptor
+   * @param a descriptor
+   * @return string version
+   */
+  static std::string toString(const TDescriptor &a);
+
+  /**
+   * Returns a descriptor from a string
+   * @param a descriptor
+   * @param s string version
+   */
+  static void fromString(TDescriptor &a, const std::string &s);
+
+  /**
+   * Returns a mat with the descriptors in float format
+   * @param descriptors
+   * @param mat (out) NxBITS 32F matrix
+   */
+  static void toMat32F(const std::vector<TDescriptor> &descriptors,
+    cv::Mat &mat);
+
+  /**
+   * Converts a BRIEF bitset into a descriptor
+   * @param a bitset of BITS bits
+   * @param b (out) descriptor
+   */
+  static void fromBitset(const DVision::BRIEF::bitset &a, TDescriptor &b);
+
+  /**
+   * Converts the BRIEF bitsets of an image into descriptors
+   * @param a bitsets of BITS bits
+   * @param b (out) descriptors
+   */
+  static void fromBitset(const std::vector<DVision::BRIEF::bitset> &a,
+    std::vector<TDescriptor> &b);
+
+  /**
+   * Converts a descriptor into a BRIEF bitset
+   * @param a descriptor
+   * @param b (out) bitset of BITS bits
+   */
+  static void toBitset(const TDescriptor &a, DVision::BRIEF::bitset &b);
+
+  /**
+   * Converts descriptors into BRIEF bitsets
+   * @param a descriptors
+   * @param b (out) bitsets of BITS bits
+   */
+  static void toBitset(const std::vector<TDescriptor> &a,
+    std::vector<DVision::BRIEF::bitset> &b);
+
+};
+
+} // namespace DBoW2
+
+#endif
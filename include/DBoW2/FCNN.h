@@ -39,6 +39,24 @@ public:
      */
     static double distance(const TDescriptor &a, const TDescriptor &b);
 
+    /**
+     * Calculates the (squared) distance between two descriptors, stopping as soon
+     * as it reaches the bound
+     * @param a
+     * @param b
+     * @param bound
+     * @return (squared) distance if it is lower than bound, or a value >= bound
+     */
+    static double distance(const TDescriptor &a, const TDescriptor &b,
+      double bound);
+
+    /**
+     * Returns a hash of the values of the descriptor
+     * @param a
+     * @return hash
+     */
+    static size_t hash(const TDescriptor &a);
+
     /**
      * Returns a string version of the descriptor
      * @param a descriptor
@@ -61,5 +79,12 @@ public:
     static void toMat32F(const std::vector<TDescriptor> &descriptors,
       cv::Mat &mat);
 };
+
+/// CNN descriptors are dense and compared with the squared L2 distance
+template<>
+struct IsDenseL2<FCNN>
+{
+  static const bool value = true;
+};
 }
 #endif // FCNN_H
@@ -13,6 +13,7 @@
 #include <opencv2/core.hpp>
 #include <vector>
 #include <string>
+#include <stdint.h>
 
 namespace DBoW2 {
 
@@ -43,6 +44,19 @@ class FClass
    */
   static double distance(const TDescriptor &a, const TDescriptor &b);
   
+  /**
+   * Optional. Calculates the distance between two descriptors, but may 
+   * stop as soon as it reaches the given bound. Used through 
+   * BoundedDistance, which falls back to the full distance if the class 
+   * does not provide it
+   * @param a
+   * @param b
+   * @param bound
+   * @return distance if it is lower than bound, or a value >= bound
+   */
+  static double distance(const TDescriptor &a, const TDescriptor &b, 
+    double bound);
+  
   /**
    * Returns a string version of the descriptor
    * @param a descriptor
@@ -64,6 +78,148 @@ class FClass
    */
   static void toMat32F(const std::vector<TDescriptor> &descriptors, 
     cv::Mat &mat);
+  
+  /**
+   * Optional. Returns a hash of the descriptor, so that equal descriptors
+   * have equal hashes. Used through DescriptorHash, which falls back to
+   * hashing the string version if the class does not provide it
+   * @param a descriptor
+   * @return hash
+   */
+  static size_t hash(const TDescriptor &a);
+};
+
+/**
+ * Hashes a sequence of bytes (64-bit FNV-1a)
+ * @param data
+ * @param n number of bytes
+ * @return hash
+ */
+inline size_t hashBytes(const void *data, size_t n)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  uint64_t h = 14695981039346656037ULL;
+  for(size_t i = 0; i < n; ++i)
+  {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return (size_t)h;
+}
+
+/// Checks whether the class F provides the bounded distance
+/// F::distance(a, b, bound)
+template<class F>
+class HasBoundedDistance
+{
+  template<class G, double (*)(const typename G::TDescriptor &, 
+    const typename G::TDescriptor &, double)>
+  struct Check;
+  
+  template<class G> static char test(Check<G, &G::distance> *);
+  template<class G> static long test(...);
+  
+public:
+
+  static const bool value = (sizeof(test<F>(0)) == sizeof(char));
+};
+
+/// Calculates distances with the bounded distance of F, if it has one,
+/// or with its full distance otherwise
+template<class F, bool = HasBoundedDistance<F>::value>
+struct BoundedDistance
+{
+  /**
+   * Calculates the distance between two descriptors, stopping as soon as
+   * it reaches the bound if F supports it
+   * @param a
+   * @param b
+   * @param bound
+   * @return distance if it is lower than bound, or a value >= bound
+   */
+  static inline double distance(const typename F::TDescriptor &a, 
+    const typename F::TDescriptor &b, double bound)
+  {
+    return F::distance(a, b, bound);
+  }
+};
+
+template<class F>
+struct BoundedDistance<F, false>
+{
+  static inline double distance(const typename F::TDescriptor &a, 
+    const typename F::TDescriptor &b, double)
+  {
+    return F::distance(a, b);
+  }
+};
+
+/// Checks whether the class F provides F::hash(a)
+template<class F>
+class HasHash
+{
+  template<class G, size_t (*)(const typename G::TDescriptor &)>
+  struct Check;
+  
+  template<class G> static char test(Check<G, &G::hash> *);
+  template<class G> static long test(...);
+  
+public:
+
+  static const bool value = (sizeof(test<F>(0)) == sizeof(char));
+};
+
+/// Hashes descriptors with the hash of F, if it has one, or with their 
+/// string version otherwise
+template<class F, bool = HasHash<F>::value>
+struct DescriptorHash
+{
+  /**
+   * Returns a hash of the descriptor
+   * @param a
+   * @return hash
+   */
+  static inline size_t hash(const typename F::TDescriptor &a)
+  {
+    return F::hash(a);
+  }
+};
+
+template<class F>
+struct DescriptorHash<F, false>
+{
+  static inline size_t hash(const typename F::TDescriptor &a)
+  {
+    const std::string s = F::toString(a);
+    return hashBytes(s.data(), s.size());
+  }
+};
+
+/**
+ * Copies a descriptor so that the copy does not share data with it
+ * @param a descriptor
+ * @param b (out) copy
+ */
+template<class TDescriptor>
+inline void copyDescriptor(const TDescriptor &a, TDescriptor &b)
+{
+  b = a;
+}
+
+/// cv::Mat descriptors are copied with their data
+inline void copyDescriptor(const cv::Mat &a, cv::Mat &b)
+{
+  a.copyTo(b);
+}
+
+/// Tells whether the descriptors of F are dense vectors of numbers (with
+/// value_type, size() and operator[]) whose distance is the squared 
+/// euclidean one, which is not a metric until it is square-rooted.
+/// Specialize it for those classes
+template<class F>
+struct IsDenseL2
+{
+  static const bool value = false;
 };
 
 } // namespace DBoW2
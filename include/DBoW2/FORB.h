@@ -45,6 +45,24 @@ public:
    * @return distance
    */
   static double distance(const TDescriptor &a, const TDescriptor &b);
+
+  /**
+   * Calculates the distance between two descriptors, stopping as soon
+   * as it reaches the bound
+   * @param a
+   * @param b
+   * @param bound
+   * @return distance if it is lower than bound, or a value >= bound
+   */
+  static double distance(const TDescriptor &a, const TDescriptor &b,
+    double bound);
+  
+  /**
+   * Returns a hash of the bits of the descriptor
+   * @param a
+   * @return hash
+   */
+  static size_t hash(const TDescriptor &a);
   
   /**
    * Returns a string version of the descriptor
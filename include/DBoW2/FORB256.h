@@ -0,0 +1,135 @@
+/**
+ * File: FORB256.h
+ * Date: October 2026
+ * Description: functions for ORB descriptors stored in fixed-size values
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_F_ORB_256__
+#define __D_T_F_ORB_256__
+
+#include <opencv2/core.hpp>
+#include <vector>
+#include <string>
+#include <stdint.h>
+
+#include "FClass.h"
+#include "BitCounter.h"
+
+namespace DBoW2 {
+
+/// Functions to manipulate ORB descriptors stored as 256-bit values
+/**
+ * The descriptors are plain values, with no header or reference count,
+ * so that vectors of them and the nodes of the vocabularies hold the bits
+ * themselves, and the distance is computed inline on four 64-bit words.
+ * Their string version is the same as that of FORB, so vocabularies and
+ * databases saved with FORB can be loaded with this class and vice versa
+ */
+class FORB256: protected FClass
+{
+public:
+
+  /// Descriptor type
+  struct TDescriptor
+  {
+    /// Bytes of the ORB descriptor, in order
+    uint64_t bits[4];
+  };
+  /// Pointer to a single descriptor
+  typedef const TDescriptor *pDescriptor;
+  /// Descriptor length (in bytes)
+  static const int L = 32;
+
+  /**
+   * Calculates the mean value of a set of descriptors
+   * @param descriptors
+   * @param mean mean descriptor
+   */
+  static void meanValue(const std::vector<pDescriptor> &descriptors,
+    TDescriptor &mean);
+
+  /**
+   * Calculates the distance between two descriptors
+   * @param a
+   * @param b
+   * @return distance
+   */
+  static inline double distance(const TDescriptor &a, const TDescriptor &b)
+  {
+    return BitCounter::popcount(a.bits[0] ^ b.bits[0]) +
+      BitCounter::popcount(a.bits[1] ^ b.bits[1]) +
+      BitCounter::popcount(a.bits[2] ^ b.bits[2]) +
+      BitCounter::popcount(a.bits[3] ^ b.bits[3]);
+  }
+
+  /**
+   * Returns a hash of the bits of the descriptor
+   * @param a
+   * @return hash
+   */
+  static size_t hash(const TDescriptor &a);
+
+  /**
+   * Returns a string version of the descriptor
+   * @param a descriptor
+   * @return string version
+   */
+  static std::string toString(const TDescriptor &a);
+
+  /**
+   * Returns a descriptor from a string
+   * @param a descriptor
+   * @param s string version
+   */
+  static void fromString(TDescriptor &a, const std::string &s);
+
+  /**
+   * Returns a mat with the descriptors in float format
+   * @param descriptors
+   * @param mat (out) NxL*8 32F matrix
+   */
+  static void toMat32F(const std::vector<TDescriptor> &descriptors,
+    cv::Mat &mat);
+
+  /**
+   * Returns a matrix with the descriptors in OpenCV format
+   * @param descriptors
+   * @param mat (out) NxL CV_8U matrix
+   */
+  static void toMat8U(const std::vector<TDescriptor> &descriptors,
+    cv::Mat &mat);
+
+  /**
+   * Copies the rows of a matrix of ORB descriptors into a vector, without
+   * creating a header per row
+   * @param descriptors NxL CV_8U matrix
+   * @param out (out) descriptors
+   */
+  static void fromMat8U(const cv::Mat &descriptors,
+    std::vector<TDescriptor> &out);
+
+  /**
+   * Returns the rows of a matrix of ORB descriptors as descriptors,
+   * without copying them. The matrix must be continuous and its data
+   * aligned to 8 bytes, as those allocated by OpenCV are
+   * @param descriptors NxL CV_8U matrix
+   * @return pointer to the N descriptors, valid while the data of the
+   *   matrix are
+   */
+  static const TDescriptor* view(const cv::Mat &descriptors);
+
+  /**
+   * Returns a matrix header on the data of a vector of descriptors,
+   * without copying them
+   * @param descriptors
+   * @return NxL CV_8U matrix, valid while the vector is not modified
+   */
+  static cv::Mat wrap(const std::vector<TDescriptor> &descriptors);
+
+};
+
+} // namespace DBoW2
+
+#endif
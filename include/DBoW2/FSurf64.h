@@ -54,6 +54,24 @@ public:
    * @return (squared) distance
    */
   static double distance(const TDescriptor &a, const TDescriptor &b);
+
+  /**
+   * Calculates the (squared) distance between two descriptors, stopping as soon
+   * as it reaches the bound
+   * @param a
+   * @param b
+   * @param bound
+   * @return (squared) distance if it is lower than bound, or a value >= bound
+   */
+  static double distance(const TDescriptor &a, const TDescriptor &b,
+    double bound);
+  
+  /**
+   * Returns a hash of the values of the descriptor
+   * @param a
+   * @return hash
+   */
+  static size_t hash(const TDescriptor &a);
   
   /**
    * Returns a string version of the descriptor
@@ -79,6 +97,13 @@ public:
 
 };
 
+/// SURF64 descriptors are dense and compared with the squared L2 distance
+template<>
+struct IsDenseL2<FSurf64>
+{
+  static const bool value = true;
+};
+
 } // namespace DBoW2
 
 #endif
@@ -192,6 +192,39 @@ public:
   
 };
 
+/// Statistics about the work done by a single query
+struct QueryStats
+{
+  /// Number of words in the query vector
+  unsigned int nQueryWords;
+
+  /// Number of query words whose inverted rows were scanned
+  unsigned int nScannedWords;
+
+  /// Number of inverted file postings visited
+  unsigned long nScannedPostings;
+
+  /// Number of postings skipped because of the query word budget or the
+  /// stop words
+  unsigned long nSkippedPostings;
+
+  /// Number of query words removed as stop words
+  unsigned int nStopWords;
+
+  /**
+   * Creates zeroed statistics
+   */
+  QueryStats(): nQueryWords(0), nScannedWords(0), nScannedPostings(0),
+    nSkippedPostings(0), nStopWords(0){}
+
+  /**
+   * Prints the statistics
+   * @param os ostream
+   * @param stats QueryStats to print
+   */
+  friend std::ostream & operator<<(std::ostream& os, const QueryStats& stats);
+};
+
 // --------------------------------------------------------------------------
 
 inline void QueryResults::scaleScores(double factor)
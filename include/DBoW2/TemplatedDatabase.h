@@ -16,20 +16,54 @@
 #include <string>
 #include <list>
 #include <set>
+#include <algorithm>
+#include <functional>
 
 #include "TemplatedVocabulary.h"
 #include "QueryResults.h"
+#include "EntryFilter.h"
 #include "ScoringObject.h"
 #include "BowVector.h"
 #include "FeatureVector.h"
+#include "CompactFeatureVector.h"
 
 #include <DUtils/DUtils.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 namespace DBoW2 {
 
-// For query functions
+// For query functions: default minimum number of words in common with
+// the query for an entry to be returned by chi square and Bhattacharyya
+// queries (see TemplatedDatabase::setMinCommonWords)
 static int MIN_COMMON_WORDS = 5;
 
+// Scale of the 16-bit fixed point weights used by quantized scoring: 
+// a weight w in [0..1] is stored as round(w * QUANTIZED_WEIGHT_SCALE)
+static const unsigned int QUANTIZED_WEIGHT_SCALE = 32767;
+
+/// Criterion to select the query words kept by the query word budget
+enum QueryWordSelection
+{
+  /// Keep the words with the greatest weight in the query vector
+  BY_WORD_WEIGHT,
+  /// Keep the words with the greatest weight / inverted row length ratio
+  BY_WEIGHT_ROW_LENGTH
+};
+
+/// Strategy to accumulate the scores of the entries during a query
+enum QueryEngine
+{
+  /// Scans the inverted rows one after another, accumulating in a map
+  ROW_AT_A_TIME,
+  /// Scans all the inverted rows block by block of entry ids, accumulating
+  /// in a dense array that fits in cache. Blocks are run in parallel when
+  /// OpenMP is available
+  ENTRY_BLOCKS
+};
+
 /// @param TDescriptor class of descriptor
 /// @param F class of descriptor functions
 template<class TDescriptor, class F>
@@ -108,6 +142,39 @@ public:
   template<class T>
   void setVocabulary(const T& voc, bool use_di, int di_levels = 0);
   
+  /**
+   * Replaces the vocabulary with a grown version of it (see 
+   * TemplatedVocabulary::grow) keeping the content of the database. The
+   * inverted file gets empty rows for the new words, and entries added 
+   * afterwards use them. The postings of the entries added before are not
+   * rewritten: queries score those entries with the query words mapped 
+   * back to the words they were split from, so that both sides use the
+   * same words. The direct index keeps its nodes, which are still in the 
+   * tree
+   * @param T class inherited from TemplatedVocabulary<TDescriptor, F>
+   * @param voc vocabulary to copy, with at least the words of the current 
+   *   one
+   */
+  template<class T>
+  void updateVocabulary(const T &voc);
+  
+  /**
+   * Replaces the vocabulary with a pruned version of it (see 
+   * TemplatedVocabulary::prune) keeping the content of the database. The 
+   * postings of each former word are moved to its new word, summing the 
+   * weights of the words of an entry that are merged. With L2 scoring, the
+   * entries are normalized again afterwards. The nodes of the 
+   * direct index are mapped in the same way, joining their features
+   * @param T class inherited from TemplatedVocabulary<TDescriptor, F>
+   * @param voc vocabulary to copy
+   * @param word_map new id of each word of the current vocabulary
+   * @param node_map new id of each node of the current vocabulary. Only 
+   *   used if the direct index is used
+   */
+  template<class T>
+  void remapVocabulary(const T &voc, const std::vector<WordId> &word_map,
+    const std::vector<NodeId> &node_map);
+  
   /**
    * Returns a pointer to the vocabulary used
    * @return vocabulary
@@ -142,6 +209,15 @@ public:
   EntryId add(const BowVector &vec, 
     const FeatureVector &fec = FeatureVector() );
 
+  /**
+   * Adds an entry to the database and returns its index
+   * @param vec bow vector
+   * @param fec feature vector to add the entry (e.g. from a 
+   *   CompactFeatureVector). Only necessary if using the direct index
+   * @return id of new entry
+   */
+  EntryId add(const BowVector &vec, const FeatureVectorView &fec);
+
   /**
    * Empties the database
    */
@@ -165,6 +241,152 @@ public:
    */
   inline int getDirectIndexLevels() const;
   
+  /**
+   * Limits the number of query words whose inverted rows are scanned by
+   * each query. When a query vector has more words with non-empty rows 
+   * than the budget, only the best ones according to the given criterion
+   * are kept, and the resulting vector is normalized again
+   * @param max_words maximum number of rows to scan. <= 0 means no limit
+   * @param selection criterion to choose the words to keep
+   */
+  void setQueryWordBudget(int max_words, 
+    QueryWordSelection selection = BY_WORD_WEIGHT);
+  
+  /**
+   * Returns the query word budget
+   * @return maximum number of rows scanned per query. <= 0 means no limit
+   */
+  inline int getQueryWordBudget() const;
+  
+  /**
+   * Sets the minimum number of words an entry must have in common with the
+   * query to be returned by chi square and Bhattacharyya queries. The 
+   * entries are first filtered by counting their common words, so that
+   * only the ones that pass the threshold are scored
+   * @param n minimum number of common words (up to 255)
+   */
+  void setMinCommonWords(int n);
+  
+  /**
+   * Returns the minimum number of common words of chi square and 
+   * Bhattacharyya queries
+   * @return minimum number of common words
+   */
+  inline int getMinCommonWords() const;
+  
+  /**
+   * Enables or disables quantized scoring. When enabled, the weights of the
+   * inverted file are also stored as 16-bit fixed point values, and 
+   * the ENTRY_BLOCKS engine accumulates L1 and L2 scores with 32-bit 
+   * integers, halving the memory traffic of the queries. The double 
+   * weights are kept for saving and for the other queries, so the 
+   * inverted file takes 24 bytes per posting instead of 16. Hence it can
+   * only be enabled with the ENTRY_BLOCKS engine and L1 or L2 scoring,
+   * and it is disabled if the vocabulary is replaced by one with another
+   * scoring type.
+   * 
+   * The score of each entry differs from the one of the double path in 
+   * at most n * 0.5 / QUANTIZED_WEIGHT_SCALE for L1 (n: number of words 
+   * in common), and (sum v_i + sum w_i) * 0.5 / QUANTIZED_WEIGHT_SCALE 
+   * for the dot product that L2 scores are computed from, so only entries
+   * whose scores are closer than that can be ranked differently
+   * @param quantized
+   */
+  void setQuantizedScoring(bool quantized);
+  
+  /**
+   * Checks if quantized scoring is enabled
+   * @return true iff using quantized scoring
+   */
+  inline bool usingQuantizedScoring() const;
+  
+  /**
+   * Keeps a second inverted file with the nodes of a level of the 
+   * vocabulary tree, so that queries can be run on coarse vectors (see 
+   * queryCoarse and queryTwoStage). Since the inverted rows of the nodes
+   * are shorter in number but longer than those of the words, coarse 
+   * queries compare less accurately but transform the query features 
+   * with fewer distance computations. The coarse file is built from the 
+   * inverted file, so it is not saved
+   * @param level level of the nodes (the root is at level 0). <= 0 
+   *   disables the coarse file
+   */
+  void setCoarseLevel(int level);
+  
+  /**
+   * Returns the level of the coarse inverted file
+   * @return level, or 0 if the coarse file is disabled
+   */
+  inline int getCoarseLevel() const { return m_coarse_level; }
+  
+  /**
+   * Sets the strategy to accumulate scores in the queries. Both engines
+   * return the same results. ROW_AT_A_TIME cannot be set while quantized
+   * scoring is enabled
+   * @param engine query engine
+   * @param block_size number of entry ids per block when using ENTRY_BLOCKS
+   */
+  void setQueryEngine(QueryEngine engine, unsigned int block_size = 8192);
+  
+  /**
+   * Returns the query engine in use
+   * @return query engine
+   */
+  inline QueryEngine getQueryEngine() const;
+  
+  /**
+   * Enables or disables weighting the query words with the idf of the 
+   * database entries instead of the idf of the vocabulary, which was fixed
+   * by the training images. The number of entries a word appears in is the
+   * length of its inverted row, so it is always up to date. The postings
+   * keep the weights they were added with; only the query vector is 
+   * reweighted, by idf_db / idf_voc for each word, and normalized again.
+   * Words that appear in all the entries get a null weight and are not
+   * scanned. Not used with binary weighting
+   * @param use
+   */
+  void setDatabaseIdf(bool use);
+  
+  /**
+   * Checks if queries are weighted with the idf of the database
+   * @return true iff using the idf of the database
+   */
+  inline bool usingDatabaseIdf() const;
+  
+  /**
+   * Sets the stop words of the queries: the words that appear in more than
+   * a fraction of the entries are removed from the query vectors, which 
+   * are normalized again, so that their long inverted rows are not 
+   * scanned. The postings are kept, so the threshold can be changed later
+   * @param max_frequency maximum fraction of the entries a query word can
+   *   appear in. >= 1 disables the stop words
+   * @param min_entries stop words are only removed when the database has
+   *   at least this number of entries
+   */
+  void setStopWords(double max_frequency, unsigned int min_entries = 100);
+  
+  /**
+   * Returns the maximum fraction of entries a query word can appear in
+   * @return max frequency. >= 1 means no stop words
+   */
+  inline double getStopWordFrequency() const;
+  
+  /**
+   * Returns the number of entries a word appears in
+   * @param wid word id
+   * @return document frequency
+   */
+  inline unsigned int getDocumentFrequency(WordId wid) const;
+  
+  /**
+   * Returns the idf of a word in the database, ln(N / Ni), where N is the 
+   * number of entries and Ni the number of entries the word appears in. 
+   * Words that do not appear count as if they appeared in one entry
+   * @param wid word id
+   * @return idf
+   */
+  double getDatabaseIdf(WordId wid) const;
+  
   /**
    * Queries the database with some features
    * @param features query features
@@ -172,9 +394,10 @@ public:
    * @param max_results number of results to return. <= 0 means all
    * @param max_id only entries with id <= max_id are returned in ret. 
    *   < 0 means all
+   * @param stats (out) if given, statistics of the query are returned
    */
   void query(const std::vector<TDescriptor> &features, QueryResults &ret,
-    int max_results = 1, int max_id = -1) const;
+    int max_results = 1, int max_id = -1, QueryStats *stats = NULL) const;
   
   /**
    * Queries the database with a vector
@@ -183,17 +406,238 @@ public:
    * @param max_results number of results to return. <= 0 means all
    * @param max_id only entries with id <= max_id are returned in ret. 
    *   < 0 means all
+   * @param stats (out) if given, statistics of the query are returned
    */
   void query(const BowVector &vec, QueryResults &ret, 
+    int max_results = 1, int max_id = -1, QueryStats *stats = NULL) const;
+  
+  /**
+   * Queries the database with some features, returning only the entries
+   * allowed by a filter
+   * @param features query features
+   * @param ret (out) query results
+   * @param max_results number of results to return. <= 0 means all
+   * @param filter entries that can be returned. Excluded entries are not
+   *   scored at all
+   * @param stats (out) if given, statistics of the query are returned
+   */
+  void query(const std::vector<TDescriptor> &features, QueryResults &ret,
+    int max_results, const EntryFilter &filter, 
+    QueryStats *stats = NULL) const;
+  
+  /**
+   * Queries the database with a vector, returning only the entries
+   * allowed by a filter
+   * @param vec bow vector already normalized
+   * @param ret results
+   * @param max_results number of results to return. <= 0 means all
+   * @param filter entries that can be returned. Excluded entries are not
+   *   scored at all
+   * @param stats (out) if given, statistics of the query are returned
+   */
+  void query(const BowVector &vec, QueryResults &ret,
+    int max_results, const EntryFilter &filter,
+    QueryStats *stats = NULL) const;
+  
+  /**
+   * Queries the coarse inverted file with some features, which are 
+   * quantized only down to the coarse level. The coarse level must be set
+   * @param features query features
+   * @param ret (out) query results
+   * @param max_results number of results to return. <= 0 means all
+   * @param max_id only entries with id <= max_id are returned in ret. 
+   *   < 0 means all
+   */
+  void queryCoarse(const std::vector<TDescriptor> &features, 
+    QueryResults &ret, int max_results = 1, int max_id = -1) const;
+  
+  /**
+   * Queries the coarse inverted file with a vector of nodes
+   * @param coarse_vec vector of nodes of the coarse level, as obtained by
+   *   the transformLevel functions of the vocabulary
+   * @param ret (out) query results
+   * @param max_results number of results to return. <= 0 means all
+   * @param max_id only entries with id <= max_id are returned in ret. 
+   *   < 0 means all
+   */
+  void queryCoarse(const BowVector &coarse_vec, QueryResults &ret, 
     int max_results = 1, int max_id = -1) const;
+  
+  /**
+   * Queries the database in two stages: the coarse inverted file selects
+   * some candidates, which are then scored with the words. The coarse 
+   * level must be set
+   * @param features query features
+   * @param ret (out) query results
+   * @param max_results number of results to return. <= 0 means all
+   * @param coarse_results number of candidates of the coarse stage
+   * @param max_id only entries with id <= max_id are returned in ret. 
+   *   < 0 means all
+   * @param stats (out) if given, statistics of the second stage are 
+   *   returned
+   */
+  void queryTwoStage(const std::vector<TDescriptor> &features, 
+    QueryResults &ret, int max_results, int coarse_results, 
+    int max_id = -1, QueryStats *stats = NULL) const;
+  
+  /**
+   * Queries the database in two stages, obtaining the coarse vector from
+   * the words of the query vector
+   * @param vec bow vector already normalized
+   * @param ret (out) query results
+   * @param max_results number of results to return. <= 0 means all
+   * @param coarse_results number of candidates of the coarse stage
+   * @param max_id only entries with id <= max_id are returned in ret. 
+   *   < 0 means all
+   * @param stats (out) if given, statistics of the second stage are 
+   *   returned
+   */
+  void queryTwoStage(const BowVector &vec, QueryResults &ret, 
+    int max_results, int coarse_results, int max_id = -1, 
+    QueryStats *stats = NULL) const;
+
+  /// Sequence of queries that reuses the scores of the previous query
+  /**
+   * Consecutive queries (e.g. of a tracked camera) share most of their
+   * words. The session keeps the accumulated score of each entry and,
+   * for a new query, only scans the inverted rows of the words that were
+   * added, removed or changed their weight since the previous one.
+   *
+   * This is available for L1_NORM, L2_NORM and DOT_PRODUCT scorings,
+   * whose scores are sums of per word terms. Since L2_NORM and
+   * DOT_PRODUCT terms are linear in the query weights, a global rescaling
+   * of the query (e.g. by its normalization) does not count as a change.
+   * When the changed words would scan more postings than the complete
+   * query, the scores are computed from scratch instead. Other scorings
+   * run a complete query every time.
+   *
+   * Entries added to the database between queries are scored by scanning
+   * only the tails of the rows. The accumulators are computed again from
+   * scratch periodically to bound the rounding drift, and when the 
+   * database is cleared or its vocabulary updated or remapped. The word
+   * budget, the database idf, the stop words and the query engine 
+   * settings of the database are not used by sessions, and entries added
+   * before a vocabulary update are scored with the current words.
+   */
+  class QuerySession
+  {
+  public:
+
+    /**
+     * Creates a session on a database, which must outlive the session
+     * @param db database to query
+     * @param refresh_period number of incremental queries after which
+     *   the scores are computed again from scratch
+     */
+    QuerySession(const TemplatedDatabase &db, int refresh_period = 100);
+
+    /**
+     * Queries the database with some features
+     * @param features query features
+     * @param ret (out) query results
+     * @param max_results number of results to return. <= 0 means all
+     * @param stats (out) if given, statistics of the query are returned.
+     *   Only the rescanned words and postings are counted
+     */
+    void query(const std::vector<TDescriptor> &features, QueryResults &ret,
+      int max_results = 1, QueryStats *stats = NULL);
+
+    /**
+     * Queries the database with a vector
+     * @param vec bow vector already normalized
+     * @param ret (out) query results
+     * @param max_results number of results to return. <= 0 means all
+     * @param stats (out) if given, statistics of the query are returned.
+     *   Only the rescanned words and postings are counted
+     */
+    void query(const BowVector &vec, QueryResults &ret,
+      int max_results = 1, QueryStats *stats = NULL);
+
+    /**
+     * Forgets the previous query, so that the next one is computed from
+     * scratch
+     */
+    void reset();
+
+  protected:
+
+    /**
+     * Returns the term of the scoring type for a query and entry weight
+     * @param q query weight (in the scale of the session)
+     * @param d entry weight
+     * @return term
+     */
+    inline double value(WordValue q, WordValue d) const;
+
+    /**
+     * Replaces the terms of a word in the accumulators
+     * @param wid word id
+     * @param old_q previous query weight, or NULL if the word was absent
+     * @param new_q new query weight, or NULL if the word is removed
+     * @param first_id id of the first entry to update
+     * @param stats (out) if given, the scanned postings are added here
+     */
+    void scanRow(WordId wid, const WordValue *old_q, const WordValue *new_q,
+      EntryId first_id, QueryStats *stats);
+
+    /**
+     * Estimates the scale of a new query with respect to the previous one
+     * as the median ratio of the weights of their common words
+     * @param vec new query
+     * @return scale
+     */
+    double estimateScale(const BowVector &vec) const;
+
+  protected:
+
+    /// Database queried
+    const TemplatedDatabase *m_db;
+
+    /// Previous query vector, in the scale of the accumulators
+    BowVector m_vec;
+
+    /// Scale of the previous query with respect to m_vec
+    double m_scale;
+
+    /// Accumulated score of each entry, in the scale of m_vec
+    std::vector<double> m_scores;
+
+    /// Number of words each entry has in common with m_vec
+    std::vector<int> m_nwords;
+
+    /// Entries that have had words in common with m_vec since the last 
+    /// query, without repetitions
+    std::vector<EntryId> m_touched;
+
+    /// Flag of the entries in m_touched
+    std::vector<bool> m_listed;
+
+    /// Number of entries of the database when it was last queried
+    EntryId m_nentries;
+
+    /// Modifications of the database when it was last queried
+    unsigned int m_modifications;
+
+    /// Scoring type of the accumulated terms
+    ScoringType m_scoring;
+
+    /// True if the weighting is binary
+    bool m_binary;
+
+    /// Incremental queries done since the last complete one
+    int m_updates;
+
+    /// Incremental queries before computing the scores from scratch
+    int m_refresh_period;
+  };
 
   /**
    * Returns the a feature vector associated with a database entry
    * @param id entry id (must be < size())
-   * @return const reference to map of nodes and their associated features in
-   *   the given entry
+   * @return view of the nodes and their associated features in the given 
+   *   entry. It is valid until the database is modified
    */
-  const FeatureVector& retrieveFeatures(EntryId id) const;
+  FeatureVectorView retrieveFeatures(EntryId id) const;
 
   /**
    * Stores the database in a file
@@ -225,29 +669,200 @@ public:
 
 protected:
   
+  /**
+   * Queries the database with a vector
+   * @param vec bow vector already normalized
+   * @param ret results
+   * @param max_results number of results to return. <= 0 means all
+   * @param max_id only entries with id < max_id are scored. -1 means all
+   * @param filter if given, only the allowed entries are scored
+   * @param stats (out) if given, statistics of the query are returned
+   */
+  void queryFiltered(const BowVector &vec, QueryResults &ret, 
+    int max_results, int max_id, const EntryFilter *filter, 
+    QueryStats *stats) const;
+  
+  /**
+   * Queries the entries with a vector of the current words, without taking
+   * the vocabulary updates into account. Parameters as in queryFiltered,
+   * plus:
+   * @param min_id only entries with id >= min_id are scored
+   */
+  void queryEntries(const BowVector &vec, QueryResults &ret, 
+    int max_results, int max_id, const EntryFilter *filter, 
+    QueryStats *stats, EntryId min_id = 0) const;
+  
+  /**
+   * Queries each generation of entries with the query words mapped to the
+   * words the entries were added with, and merges the results. 
+   * Parameters as in queryFiltered
+   */
+  void queryGenerations(const BowVector &vec, QueryResults &ret, 
+    int max_results, int max_id, const EntryFilter *filter, 
+    QueryStats *stats) const;
+  
+  /**
+   * Moves a row iterator to the first pair allowed by a filter, jumping
+   * over whole segments of excluded entries
+   * @param rit first pair to check
+   * @param rend end of the row
+   * @param filter filter to apply. If NULL, rit is returned
+   * @return iterator to an allowed pair, or rend
+   */
+  template<class TIterator>
+  static inline TIterator skipFiltered(TIterator rit, TIterator rend, 
+    const EntryFilter *filter);
+  
+  /**
+   * Applies the query word budget to a query vector
+   * @param vec query vector
+   * @param budget_vec (out) vector with the selected words, normalized 
+   *   again if the scoring requires so
+   * @param stats (out) if given, the skipped postings are added here
+   * @return true iff some words were removed. If false, budget_vec is not 
+   *   modified and vec must be used
+   */
+  bool selectQueryWords(const BowVector &vec, BowVector &budget_vec,
+    QueryStats *stats) const;
+  
+  /**
+   * Applies the database idf and the stop words to a query vector
+   * @param vec query vector
+   * @param idf_vec (out) vector with the new weights and without the stop
+   *   words, normalized again if the scoring requires so
+   * @param stats (out) if given, the stop words and their postings are 
+   *   counted here
+   * @return true iff the vector was modified. If false, idf_vec is not 
+   *   modified and vec must be used
+   */
+  bool reweightQueryWords(const BowVector &vec, BowVector &idf_vec,
+    QueryStats *stats) const;
+  
+  /**
+   * Normalizes a query vector whose words were modified, so that the 
+   * scores keep their range
+   * @param vec query vector
+   */
+  void normalizeQuery(BowVector &vec) const;
+  
+  /**
+   * Completes the scores accumulated by a query engine according to the 
+   * scoring type, sorts them and cuts the vector
+   * @param vec query vector
+   * @param ret (in/out) accumulated results, in ascending entry id order. 
+   *   nWords, sumCommonVi and sumCommonWi must be filled if the scoring 
+   *   type uses them
+   * @param max_results number of results to return. <= 0 means all
+   * @param coarse whether vec and the scores are those of the coarse 
+   *   inverted file
+   */
+  void completeScores(const BowVector &vec, QueryResults &ret, 
+    int max_results, bool coarse = false) const;
+  
+  /**
+   * Converts a word weight into 16-bit fixed point
+   * @param w weight in [0..1]
+   * @return quantized weight
+   */
+  static inline unsigned short quantizeWeight(WordValue w);
+  
+  /**
+   * Checks if quantized scoring can be used with the vocabulary
+   * @return true iff the scoring type has quantized terms (L1 and L2)
+   */
+  inline bool hasQuantizedTerms() const;
+  
+  /**
+   * Creates the quantized inverted file from the inverted file
+   */
+  void buildQuantizedFile();
+  
+  /**
+   * Creates the coarse inverted file from the inverted file
+   */
+  void buildCoarseFile();
+  
+  /**
+   * Adds the postings of an entry to the coarse inverted file
+   * @param entry_id
+   * @param v bow vector of words of the entry
+   */
+  void addCoarseEntry(EntryId entry_id, const BowVector &v);
+  
+  /**
+   * Returns the id of the first entry that must not be scored by a query
+   * @param max_id max_id argument of query
+   * @return end entry id
+   */
+  inline EntryId getQueryEndId(int max_id) const;
+  
+  /**
+   * Counts the words each entry has in common with the query, saturating
+   * at 255
+   * @param vec query vector
+   * @param begin_id id of the first entry that is counted
+   * @param end_id id of the first entry that is not counted
+   * @param filter if given, only the allowed entries are counted
+   * @param counts (out) counts[entry_id] = number of common words
+   */
+  void countCommonWords(const BowVector &vec, EntryId begin_id, 
+    EntryId end_id, const EntryFilter *filter, 
+    std::vector<unsigned char> &counts) const;
+  
+  /// Query with the ENTRY_BLOCKS engine
+  void queryBlocks(const BowVector &vec, QueryResults &ret, 
+    int max_results, int max_id, const EntryFilter *filter, 
+    EntryId min_id = 0) const;
+  
+  /**
+   * Accumulates the scores of the entries with begin_id <= id < end_id by
+   * scanning the inverted rows of the query words block by block of 
+   * entries
+   * @param TTerm term of the scoring type (see L1Term...), which also 
+   *   defines the inverted file and the accumulator type to use
+   * @param vec query vector
+   * @param ret (out) accumulated results, in ascending entry id order
+   * @param begin_id id of the first entry that is scored
+   * @param end_id id of the first entry that is not scored
+   * @param filter if given, only the allowed entries are scored
+   * @param counts if given, only the entries with counts[entry_id] >= 
+   *   min_count are scored
+   * @param min_count minimum count of the scored entries
+   */
+  template<class TTerm>
+  void accumulateBlocks(const BowVector &vec, QueryResults &ret, 
+    EntryId begin_id, EntryId end_id, const EntryFilter *filter, 
+    const unsigned char *counts = NULL, unsigned char min_count = 0) const;
+  
   /// Query with L1 scoring
   void queryL1(const BowVector &vec, QueryResults &ret, 
-    int max_results, int max_id) const;
+    int max_results, int max_id, const EntryFilter *filter, 
+    EntryId min_id = 0) const;
   
   /// Query with L2 scoring
   void queryL2(const BowVector &vec, QueryResults &ret, 
-    int max_results, int max_id) const;
+    int max_results, int max_id, const EntryFilter *filter, 
+    EntryId min_id = 0) const;
   
   /// Query with Chi square scoring
   void queryChiSquare(const BowVector &vec, QueryResults &ret, 
-    int max_results, int max_id) const;
+    int max_results, int max_id, const EntryFilter *filter, 
+    EntryId min_id = 0) const;
   
   /// Query with Bhattacharyya scoring
   void queryBhattacharyya(const BowVector &vec, QueryResults &ret, 
-    int max_results, int max_id) const;
+    int max_results, int max_id, const EntryFilter *filter, 
+    EntryId min_id = 0) const;
   
   /// Query with KL divergence scoring  
   void queryKL(const BowVector &vec, QueryResults &ret, 
-    int max_results, int max_id) const;
+    int max_results, int max_id, const EntryFilter *filter, 
+    EntryId min_id = 0) const;
   
   /// Query with dot product scoring
   void queryDotProduct(const BowVector &vec, QueryResults &ret, 
-    int max_results, int max_id) const;
+    int max_results, int max_id, const EntryFilter *filter, 
+    EntryId min_id = 0) const;
 
 protected:
 
@@ -280,43 +895,277 @@ protected:
      * @return true iff this entry id is the same as eid
      */
     inline bool operator==(EntryId eid) const { return entry_id == eid; }
+    
+    /**
+     * Compares the entry ids
+     * @param eid
+     * @return true iff this entry id is lower than eid
+     */
+    inline bool operator<(EntryId eid) const { return entry_id < eid; }
+    
+    /**
+     * Compares the entry ids of two pairs
+     * @param p
+     * @return true iff this entry id is lower than that of p
+     */
+    inline bool operator<(const IFPair &p) const 
+      { return entry_id < p.entry_id; }
   };
   
   /// Row of InvertedFile
-  typedef std::list<IFPair> IFRow;
+  typedef std::vector<IFPair> IFRow;
   // IFRows are sorted in ascending entry_id order
   
   /// Inverted index
   typedef std::vector<IFRow> InvertedFile; 
   // InvertedFile[word_id] --> inverted file of that word
   
-  /* Direct file declaration */
-
-  /// Direct index
-  typedef std::vector<FeatureVector> DirectFile;
-  // DirectFile[entry_id] --> [ directentry, ... ]
-
-protected:
-
-  /// Associated vocabulary
-  TemplatedVocabulary<TDescriptor, F> *m_voc;
+  /// Item of QIFRow: IFPair with a 16-bit fixed point weight
+  struct QIFPair
+  {
+    /// Entry id
+    EntryId entry_id;
+    
+    /// Quantized word weight in this entry
+    unsigned short word_weight;
+    
+    /**
+     * Creates an empty pair
+     */
+    QIFPair(){}
+    
+    /**
+     * Creates a quantized inverted file pair
+     * @param eid entry id
+     * @param wv quantized word weight
+     */
+    QIFPair(EntryId eid, unsigned short wv): entry_id(eid), word_weight(wv){}
+    
+    /**
+     * Compares the entry ids
+     * @param eid
+     * @return true iff this entry id is lower than eid
+     */
+    inline bool operator<(EntryId eid) const { return entry_id < eid; }
+  };
   
-  /// Flag to use direct index
-  bool m_use_di;
+  /// Row of QuantizedInvertedFile
+  typedef std::vector<QIFPair> QIFRow;
   
-  /// Levels to go up the vocabulary tree to select nodes to store
-  /// in the direct index
-  int m_dilevels;
+  /// Inverted index with quantized weights, parallel to InvertedFile
+  typedef std::vector<QIFRow> QuantizedInvertedFile;
   
-  /// Inverted file (must have size() == |words|)
-  InvertedFile m_ifile;
+  /* Score terms accumulated for each inverted file pair */
   
-  /// Direct file (resized for allocation)
+  /// Base of the terms computed on the inverted file with double values
+  struct DoubleTerm
+  {
+    typedef IFRow Row;
+    typedef WordValue QueryValue;
+    typedef double Accumulator;
+    
+    /// The sums of v_i and w_i are not needed
+    static const bool SUMS = false;
+    
+    static inline const Row& row(const TemplatedDatabase &db, WordId wid)
+      { return db.m_ifile[wid]; }
+    static inline QueryValue query(WordValue q) { return q; }
+    static inline double score(Accumulator a) { return a; }
+  };
+  
+  /// L1 norm term: |v_i - w_i| - |v_i| - |w_i|
+  struct L1Term: public DoubleTerm
+  {
+    static inline double value(WordValue q, WordValue d)
+      { return fabs(q - d) - fabs(q) - fabs(d); }
+  };
+  
+  /// L2 norm term: - v_i * w_i
+  struct L2Term: public DoubleTerm
+  {
+    static inline double value(WordValue q, WordValue d)
+      { return - q * d; }
+  };
+  
+  /// Chi square term: - v_i * w_i / (v_i + w_i). Sums of v_i and w_i
+  /// are also needed
+  struct ChiSquareTerm: public DoubleTerm
+  {
+    static const bool SUMS = true;
+    static inline double value(WordValue q, WordValue d)
+      { return (q + d != 0.0 ? - q * d / (q + d) : 0); }
+  };
+  
+  /// KL divergence term: v_i * log(v_i / w_i)
+  struct KLTerm: public DoubleTerm
+  {
+    static inline double value(WordValue q, WordValue d)
+      { return (q != 0 && d != 0 ? q * log(q/d) : 0); }
+  };
+  
+  /// Bhattacharyya term: sqrt(v_i * w_i)
+  struct BhattacharyyaTerm: public DoubleTerm
+  {
+    static inline double value(WordValue q, WordValue d)
+      { return sqrt(q * d); }
+  };
+  
+  /// Dot product term: v_i * w_i
+  struct DotProductTerm: public DoubleTerm
+  {
+    static inline double value(WordValue q, WordValue d)
+      { return q * d; }
+  };
+  
+  /// Dot product term with binary weighting: 1
+  struct BinaryDotProductTerm: public DoubleTerm
+  {
+    static inline double value(WordValue, WordValue)
+      { return 1; }
+  };
+  
+  /// Base of the terms computed on the quantized inverted file
+  struct QuantizedTerm
+  {
+    typedef QIFRow Row;
+    typedef unsigned short QueryValue;
+    typedef unsigned int Accumulator;
+    
+    static const bool SUMS = false;
+    
+    static inline const Row& row(const TemplatedDatabase &db, WordId wid)
+      { return db.m_qifile[wid]; }
+    static inline QueryValue query(WordValue q) 
+      { return quantizeWeight(q); }
+  };
+  
+  /// Quantized L1 norm term: |v_i - w_i| - |v_i| - |w_i| = -2 min(v_i, w_i)
+  /// for non-negative weights
+  struct QuantizedL1Term: public QuantizedTerm
+  {
+    static inline unsigned int value(unsigned short q, unsigned short d)
+      { return (q < d ? q : d); }
+    static inline double score(unsigned int a)
+      { return -2. * a / QUANTIZED_WEIGHT_SCALE; }
+  };
+  
+  /// Quantized L2 norm term: - v_i * w_i
+  struct QuantizedL2Term: public QuantizedTerm
+  {
+    static inline unsigned int value(unsigned short q, unsigned short d)
+      { return (unsigned int)q * d; }
+    static inline double score(unsigned int a)
+      { return -(double)a / 
+          ((double)QUANTIZED_WEIGHT_SCALE * QUANTIZED_WEIGHT_SCALE); }
+  };
+  
+  /// Term computed on the coarse inverted file, whose rows are those of 
+  /// the nodes of the coarse level
+  template<class TTerm>
+  struct CoarseTerm: public TTerm
+  {
+    static inline const IFRow& row(const TemplatedDatabase &db, NodeId nid)
+      { return db.m_cifile[nid]; }
+  };
+  
+  /* Direct file declaration */
+
+  /// Entries added with a former vocabulary (see updateVocabulary)
+  struct Generation
+  {
+    /// Id of the first entry added after this generation
+    EntryId end;
+    /// Number of words of the vocabulary of this generation
+    WordId nwords;
+    /// Word of this generation each newer word comes from: origin[i] is 
+    /// for word nwords + i. Older words did not change their id
+    std::vector<WordId> origin;
+    /// Weight of each word of this generation in its vocabulary (empty in
+    /// databases saved without them)
+    std::vector<WordValue> weights;
+    
+    /**
+     * Returns the word of this generation a current word comes from
+     * @param wid current word id
+     * @return word id of this generation
+     */
+    inline WordId word(WordId wid) const
+    {
+      return (wid < nwords ? wid : origin[wid - nwords]);
+    }
+  };
+  
+  /// Direct index. All the entries are stored in a single arena
+  typedef CompactDirectFile DirectFile;
+  // DirectFile[entry_id] --> [ directentry, ... ]
+
+protected:
+
+  /// Associated vocabulary
+  TemplatedVocabulary<TDescriptor, F> *m_voc;
+  
+  /// Flag to use direct index
+  bool m_use_di;
+  
+  /// Levels to go up the vocabulary tree to select nodes to store
+  /// in the direct index
+  int m_dilevels;
+  
+  /// Inverted file (must have size() == |words|)
+  InvertedFile m_ifile;
+  
+  /// Direct file (resized for allocation)
   DirectFile m_dfile;
   
   /// Number of valid entries in m_dfile
   int m_nentries;
   
+  /// Flag to use quantized scoring
+  bool m_quantized;
+  
+  /// Inverted file with quantized weights (empty if not m_quantized)
+  QuantizedInvertedFile m_qifile;
+  
+  /// Maximum number of inverted rows to scan per query (<= 0: no limit)
+  int m_word_budget;
+  
+  /// Criterion to select query words when applying the budget
+  QueryWordSelection m_word_selection;
+  
+  /// Minimum number of common words of chi square and Bhattacharyya queries
+  int m_min_common_words;
+  
+  /// Engine to accumulate scores in queries
+  QueryEngine m_query_engine;
+  
+  /// Number of entries per block of the ENTRY_BLOCKS engine
+  unsigned int m_block_size;
+  
+  /// Flag to weight queries with the idf of the database
+  bool m_database_idf;
+  
+  /// Maximum fraction of entries a query word can appear in
+  double m_stop_word_frequency;
+  
+  /// Minimum number of entries to remove stop words
+  unsigned int m_stop_word_min_entries;
+  
+  /// Generations of entries added before each vocabulary update, in 
+  /// ascending order of entry ids. Entries after the last one use the 
+  /// current words
+  std::vector<Generation> m_generations;
+  
+  /// Level of the nodes of the coarse inverted file (0: disabled)
+  int m_coarse_level;
+  
+  /// Inverted file of the nodes of the coarse level, indexed by node id
+  /// (empty if m_coarse_level is 0)
+  InvertedFile m_cifile;
+  
+  /// Number of times the entries were cleared or their words renumbered,
+  /// so that query sessions know when their accumulators are stale
+  unsigned int m_modifications;
+  
 };
 
 // --------------------------------------------------------------------------
@@ -324,7 +1173,12 @@ protected:
 template<class TDescriptor, class F>
 TemplatedDatabase<TDescriptor, F>::TemplatedDatabase
   (bool use_di, int di_levels)
-  : m_voc(NULL), m_use_di(use_di), m_dilevels(di_levels), m_nentries(0)
+  : m_voc(NULL), m_use_di(use_di), m_dilevels(di_levels), m_nentries(0),
+  m_quantized(false), m_word_budget(0),
+  m_word_selection(BY_WORD_WEIGHT),
+  m_min_common_words(MIN_COMMON_WORDS), m_query_engine(ROW_AT_A_TIME),
+  m_block_size(8192), m_database_idf(false), m_stop_word_frequency(1.),
+  m_stop_word_min_entries(100), m_coarse_level(0), m_modifications(0)
 {
 }
 
@@ -334,7 +1188,12 @@ template<class TDescriptor, class F>
 template<class T>
 TemplatedDatabase<TDescriptor, F>::TemplatedDatabase
   (const T &voc, bool use_di, int di_levels)
-  : m_voc(NULL), m_use_di(use_di), m_dilevels(di_levels)
+  : m_voc(NULL), m_use_di(use_di), m_dilevels(di_levels),
+  m_quantized(false), m_word_budget(0),
+  m_word_selection(BY_WORD_WEIGHT),
+  m_min_common_words(MIN_COMMON_WORDS), m_query_engine(ROW_AT_A_TIME),
+  m_block_size(8192), m_database_idf(false), m_stop_word_frequency(1.),
+  m_stop_word_min_entries(100), m_coarse_level(0), m_modifications(0)
 {
   setVocabulary(voc);
   clear();
@@ -345,7 +1204,11 @@ TemplatedDatabase<TDescriptor, F>::TemplatedDatabase
 template<class TDescriptor, class F>
 TemplatedDatabase<TDescriptor,F>::TemplatedDatabase
   (const TemplatedDatabase<TDescriptor,F> &db)
-  : m_voc(NULL)
+  : m_voc(NULL), m_quantized(false), m_word_budget(0),
+  m_word_selection(BY_WORD_WEIGHT),
+  m_min_common_words(MIN_COMMON_WORDS), m_query_engine(ROW_AT_A_TIME),
+  m_block_size(8192), m_database_idf(false), m_stop_word_frequency(1.),
+  m_stop_word_min_entries(100), m_coarse_level(0), m_modifications(0)
 {
   *this = db;
 }
@@ -355,7 +1218,11 @@ TemplatedDatabase<TDescriptor,F>::TemplatedDatabase
 template<class TDescriptor, class F>
 TemplatedDatabase<TDescriptor, F>::TemplatedDatabase
   (const std::string &filename)
-  : m_voc(NULL)
+  : m_voc(NULL), m_quantized(false), m_word_budget(0),
+  m_word_selection(BY_WORD_WEIGHT),
+  m_min_common_words(MIN_COMMON_WORDS), m_query_engine(ROW_AT_A_TIME),
+  m_block_size(8192), m_database_idf(false), m_stop_word_frequency(1.),
+  m_stop_word_min_entries(100), m_coarse_level(0), m_modifications(0)
 {
   load(filename);
 }
@@ -365,7 +1232,11 @@ TemplatedDatabase<TDescriptor, F>::TemplatedDatabase
 template<class TDescriptor, class F>
 TemplatedDatabase<TDescriptor, F>::TemplatedDatabase
   (const char *filename)
-  : m_voc(NULL)
+  : m_voc(NULL), m_quantized(false), m_word_budget(0),
+  m_word_selection(BY_WORD_WEIGHT),
+  m_min_common_words(MIN_COMMON_WORDS), m_query_engine(ROW_AT_A_TIME),
+  m_block_size(8192), m_database_idf(false), m_stop_word_frequency(1.),
+  m_stop_word_min_entries(100), m_coarse_level(0), m_modifications(0)
 {
   load(filename);
 }
@@ -389,8 +1260,21 @@ TemplatedDatabase<TDescriptor,F>& TemplatedDatabase<TDescriptor,F>::operator=
     m_dfile = db.m_dfile;
     m_dilevels = db.m_dilevels;
     m_ifile = db.m_ifile;
+    m_quantized = db.m_quantized;
+    m_qifile = db.m_qifile;
     m_nentries = db.m_nentries;
     m_use_di = db.m_use_di;
+    m_word_budget = db.m_word_budget;
+    m_word_selection = db.m_word_selection;
+    m_min_common_words = db.m_min_common_words;
+    m_query_engine = db.m_query_engine;
+    m_block_size = db.m_block_size;
+    m_database_idf = db.m_database_idf;
+    m_stop_word_frequency = db.m_stop_word_frequency;
+    m_stop_word_min_entries = db.m_stop_word_min_entries;
+    m_generations = db.m_generations;
+    m_coarse_level = db.m_coarse_level;
+    m_cifile = db.m_cifile;
     setVocabulary(*db.m_voc);
   }
   return *this;
@@ -413,9 +1297,9 @@ EntryId TemplatedDatabase<TDescriptor, F>::add(
   }
   else if(m_use_di)
   {
-    FeatureVector fv;
+    CompactFeatureVector fv;
     m_voc->transform(features, v, fv, m_dilevels); // with features
-    return add(v, fv);
+    return add(v, fv.view());
   }
   else if(fvec != NULL)
   {
@@ -434,23 +1318,28 @@ EntryId TemplatedDatabase<TDescriptor, F>::add(
 template<class TDescriptor, class F>
 EntryId TemplatedDatabase<TDescriptor, F>::add(const BowVector &v,
   const FeatureVector &fv)
+{
+  if(m_use_di)
+    return add(v, CompactFeatureVector(fv).view());
+  else
+    return add(v, FeatureVectorView());
+}
+
+// ---------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+EntryId TemplatedDatabase<TDescriptor, F>::add(const BowVector &v,
+  const FeatureVectorView &fv)
 {
   EntryId entry_id = m_nentries++;
 
   BowVector::const_iterator vit;
-  std::vector<unsigned int>::const_iterator iit;
 
   if(m_use_di)
   {
-    // update direct file
-    if(entry_id == m_dfile.size())
-    {
-      m_dfile.push_back(fv);
-    }
-    else
-    {
-      m_dfile[entry_id] = fv;
-    }
+    // update direct file (entries are always appended)
+    assert(entry_id == m_dfile.size());
+    m_dfile.push_back(fv);
   }
   
   // update inverted file
@@ -461,8 +1350,16 @@ EntryId TemplatedDatabase<TDescriptor, F>::add(const BowVector &v,
     
     IFRow& ifrow = m_ifile[word_id];
     ifrow.push_back(IFPair(entry_id, word_weight));
+    
+    if(m_quantized)
+    {
+      m_qifile[word_id].push_back(
+        QIFPair(entry_id, quantizeWeight(word_weight)));
+    }
   }
   
+  if(m_coarse_level > 0) addCoarseEntry(entry_id, v);
+  
   return entry_id;
 }
 
@@ -494,6 +1391,203 @@ inline void TemplatedDatabase<TDescriptor, F>::setVocabulary
 
 // --------------------------------------------------------------------------
 
+template<class TDescriptor, class F>
+template<class T>
+void TemplatedDatabase<TDescriptor, F>::updateVocabulary(const T &voc)
+{
+  if(m_voc == NULL)
+  {
+    setVocabulary(voc);
+    return;
+  }
+  
+  const WordId NOld = m_voc->size();
+  const WordId NNew = voc.size();
+  
+  if(NNew < NOld)
+    throw std::string("The new vocabulary has fewer words than the old one");
+  
+  // the words a new word comes from are under the first ancestor that 
+  // contains old words. Since the child closest to a split word keeps its
+  // id and new ids are greater, the old word is the minimum id there
+  std::vector<WordId> origin(NNew - NOld);
+  std::vector<WordId> words;
+  for(WordId wid = NOld; wid < NNew; ++wid)
+  {
+    WordId w = wid;
+    for(int levelsup = 1; w >= NOld; ++levelsup)
+    {
+      voc.getWordsFromNode(voc.getParentNode(wid, levelsup), words);
+      w = *std::min_element(words.begin(), words.end());
+    }
+    origin[wid - NOld] = w;
+  }
+  
+  // older generations map the new words through the words they come from
+  typename std::vector<Generation>::iterator git;
+  for(git = m_generations.begin(); git != m_generations.end(); ++git)
+  {
+    for(WordId wid = NOld; wid < NNew; ++wid)
+      git->origin.push_back(git->word(origin[wid - NOld]));
+  }
+  
+  const EntryId first = 
+    (m_generations.empty() ? 0 : m_generations.back().end);
+  if(NNew > NOld && (EntryId)m_nentries > first)
+  {
+    Generation g;
+    g.end = m_nentries;
+    g.nwords = NOld;
+    g.origin.swap(origin);
+    g.weights.resize(NOld);
+    for(WordId wid = 0; wid < NOld; ++wid)
+      g.weights[wid] = m_voc->getWordWeight(wid);
+    m_generations.push_back(g);
+  }
+  
+  delete m_voc;
+  m_voc = new T(voc);
+  
+  m_ifile.resize(m_voc->size());
+  if(m_quantized) m_qifile.resize(m_voc->size());
+  if(m_coarse_level > 0) buildCoarseFile();
+  
+  ++m_modifications;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+template<class T>
+void TemplatedDatabase<TDescriptor, F>::remapVocabulary(const T &voc,
+  const std::vector<WordId> &word_map, const std::vector<NodeId> &node_map)
+{
+  if(m_voc == NULL)
+  {
+    setVocabulary(voc);
+    return;
+  }
+  
+  if(word_map.size() != m_ifile.size())
+    throw std::string("The word map must have one item per word");
+  
+  // inverted file
+  InvertedFile ifile(voc.size());
+  std::vector<unsigned int> sources(voc.size(), 0);
+  for(WordId wid = 0; wid < m_ifile.size(); ++wid)
+  {
+    IFRow &row = ifile[word_map[wid]];
+    row.insert(row.end(), m_ifile[wid].begin(), m_ifile[wid].end());
+    sources[word_map[wid]]++;
+  }
+  
+  for(WordId wid = 0; wid < ifile.size(); ++wid)
+  {
+    if(sources[wid] < 2) continue;
+    
+    // keep the rows sorted, with one pair per entry
+    IFRow &row = ifile[wid];
+    std::stable_sort(row.begin(), row.end());
+    
+    typename IFRow::iterator rit, last = row.begin();
+    for(rit = row.begin(); rit != row.end(); ++rit)
+    {
+      if(rit == row.begin()) continue;
+      if(rit->entry_id == last->entry_id)
+        last->word_weight += rit->word_weight;
+      else
+        *(++last) = *rit;
+    }
+    if(!row.empty()) row.resize(last - row.begin() + 1);
+  }
+  
+  // summing the weights keeps the L1 norm of the entries, but not the L2 
+  // one, so the vectors of the entries are normalized again
+  if(m_voc->getScoringType() == L2_NORM)
+  {
+    std::vector<double> norms(m_nentries, 0);
+    
+    typename InvertedFile::iterator iit;
+    typename IFRow::iterator rit;
+    for(iit = ifile.begin(); iit != ifile.end(); ++iit)
+      for(rit = iit->begin(); rit != iit->end(); ++rit)
+        norms[rit->entry_id] += rit->word_weight * rit->word_weight;
+    
+    for(size_t eid = 0; eid < norms.size(); ++eid)
+      if(norms[eid] > 0) norms[eid] = 1. / sqrt(norms[eid]);
+    
+    for(iit = ifile.begin(); iit != ifile.end(); ++iit)
+      for(rit = iit->begin(); rit != iit->end(); ++rit)
+        rit->word_weight *= norms[rit->entry_id];
+  }
+  
+  m_ifile.swap(ifile);
+  if(m_quantized) buildQuantizedFile();
+  
+  // direct file
+  if(m_use_di)
+  {
+    if(node_map.empty()) 
+      throw std::string("The node map is needed to remap the direct index");
+    
+    DirectFile dfile;
+    dfile.reserve(m_dfile.size(), 0, 0);
+    
+    std::vector<std::pair<NodeId, unsigned int> > pairs;
+    CompactFeatureVector fv;
+    for(size_t eid = 0; eid < m_dfile.size(); ++eid)
+    {
+      const FeatureVectorView view = m_dfile[eid];
+      
+      pairs.resize(0);
+      for(size_t i = 0; i < view.size(); ++i)
+      {
+        const FeatureIndices f = view.features(i);
+        for(size_t j = 0; j < f.size(); ++j)
+          pairs.push_back(std::make_pair(node_map[view.nodeId(i)], f[j]));
+      }
+      
+      fv.assign(pairs);
+      dfile.push_back(fv.view());
+    }
+    
+    m_dfile = dfile;
+  }
+  
+  // generations map words through their former ids
+  typename std::vector<Generation>::iterator git;
+  for(git = m_generations.begin(); git != m_generations.end(); ++git)
+  {
+    Generation g;
+    g.end = git->end;
+    g.nwords = 0;
+    g.origin.resize(voc.size());
+    for(WordId wid = 0; wid < word_map.size(); ++wid)
+      g.origin[word_map[wid]] = word_map[git->word(wid)];
+    
+    // merged words keep the weight of one of them
+    if(!git->weights.empty())
+    {
+      g.weights.resize(voc.size(), 0);
+      for(WordId wid = 0; wid < word_map.size(); ++wid)
+      {
+        WordValue &w = g.weights[word_map[git->word(wid)]];
+        if(w == 0) w = git->weights[git->word(wid)];
+      }
+    }
+    *git = g;
+  }
+  
+  delete m_voc;
+  m_voc = new T(voc);
+  
+  if(m_coarse_level > 0) buildCoarseFile();
+  
+  ++m_modifications;
+}
+
+// --------------------------------------------------------------------------
+
 template<class TDescriptor, class F>
 inline const TemplatedVocabulary<TDescriptor,F>* 
 TemplatedDatabase<TDescriptor, F>::getVocabulary() const
@@ -509,8 +1603,14 @@ inline void TemplatedDatabase<TDescriptor, F>::clear()
   // resize vectors
   m_ifile.resize(0);
   m_ifile.resize(m_voc->size());
-  m_dfile.resize(0);
+  m_qifile.resize(0);
+  if(m_quantized && !hasQuantizedTerms()) m_quantized = false;
+  if(m_quantized) m_qifile.resize(m_voc->size());
+  m_dfile.clear();
   m_nentries = 0;
+  m_generations.clear();
+  m_cifile.resize(0);
+  ++m_modifications;
 }
 
 // --------------------------------------------------------------------------
@@ -524,18 +1624,13 @@ void TemplatedDatabase<TDescriptor, F>::allocate(int nd, int ni)
     typename std::vector<IFRow>::iterator rit;
     for(rit = m_ifile.begin(); rit != m_ifile.end(); ++rit)
     {
-      int n = (int)rit->size();
-      if(ni > n)
-      {
-        rit->resize(ni);
-        rit->resize(n);
-      }
+      rit->reserve(ni);
     }
   }
   
-  if(m_use_di && (int)m_dfile.size() < nd)
+  if(m_use_di && nd > 0)
   {
-    m_dfile.resize(nd);
+    m_dfile.reserve(nd);
   }
 }
 
@@ -566,65 +1661,894 @@ inline int TemplatedDatabase<TDescriptor, F>::getDirectIndexLevels() const
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-void TemplatedDatabase<TDescriptor, F>::query(
-  const std::vector<TDescriptor> &features,
-  QueryResults &ret, int max_results, int max_id) const
+void TemplatedDatabase<TDescriptor, F>::setQueryWordBudget(int max_words,
+  QueryWordSelection selection)
 {
-  BowVector vec;
-  m_voc->transform(features, vec);
-  query(vec, ret, max_results, max_id);
+  m_word_budget = max_words;
+  m_word_selection = selection;
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-void TemplatedDatabase<TDescriptor, F>::query(
-  const BowVector &vec, 
-  QueryResults &ret, int max_results, int max_id) const
+inline int TemplatedDatabase<TDescriptor, F>::getQueryWordBudget() const
 {
-  ret.resize(0);
+  return m_word_budget;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::setMinCommonWords(int n)
+{
+  m_min_common_words = std::min(std::max(n, 0), 255);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline int TemplatedDatabase<TDescriptor, F>::getMinCommonWords() const
+{
+  return m_min_common_words;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::setQuantizedScoring(bool quantized)
+{
+  if(quantized && m_query_engine != ENTRY_BLOCKS)
+    throw std::string("Quantized scoring needs the ENTRY_BLOCKS engine");
+  if(quantized && !hasQuantizedTerms())
+    throw std::string("Quantized scoring needs L1 or L2 scoring");
   
-  switch(m_voc->getScoringType())
-  {
-    case L1_NORM:
-      queryL1(vec, ret, max_results, max_id);
-      break;
-      
-    case L2_NORM:
-      queryL2(vec, ret, max_results, max_id);
-      break;
-      
-    case CHI_SQUARE:
-      queryChiSquare(vec, ret, max_results, max_id);
-      break;
-      
-    case KL:
-      queryKL(vec, ret, max_results, max_id);
-      break;
-      
-    case BHATTACHARYYA:
-      queryBhattacharyya(vec, ret, max_results, max_id);
-      break;
-      
-    case DOT_PRODUCT:
-      queryDotProduct(vec, ret, max_results, max_id);
-      break;
-  }
+  m_quantized = quantized;
+  
+  if(m_quantized) 
+    buildQuantizedFile();
+  else
+    QuantizedInvertedFile().swap(m_qifile);
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-void TemplatedDatabase<TDescriptor, F>::queryL1(const BowVector &vec, 
-  QueryResults &ret, int max_results, int max_id) const
+inline bool TemplatedDatabase<TDescriptor, F>::usingQuantizedScoring() const
 {
-  BowVector::const_iterator vit;
-  typename IFRow::const_iterator rit;
-    
-  std::map<EntryId, double> pairs;
-  std::map<EntryId, double>::iterator pit;
+  return m_quantized;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline bool TemplatedDatabase<TDescriptor, F>::hasQuantizedTerms() const
+{
+  return m_voc != NULL && (m_voc->getScoringType() == L1_NORM || 
+    m_voc->getScoringType() == L2_NORM);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline unsigned short TemplatedDatabase<TDescriptor, F>::quantizeWeight
+  (WordValue w)
+{
+  if(w <= 0) return 0;
+  else if(w >= 1) return (unsigned short)QUANTIZED_WEIGHT_SCALE;
+  else return (unsigned short)(w * QUANTIZED_WEIGHT_SCALE + 0.5);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::buildQuantizedFile()
+{
+  m_qifile.resize(0);
+  m_qifile.resize(m_ifile.size());
   
-  for(vit = vec.begin(); vit != vec.end(); ++vit)
+  for(size_t wid = 0; wid < m_ifile.size(); ++wid)
+  {
+    const IFRow& row = m_ifile[wid];
+    QIFRow& qrow = m_qifile[wid];
+    qrow.reserve(row.size());
+    
+    typename IFRow::const_iterator rit;
+    for(rit = row.begin(); rit != row.end(); ++rit)
+    {
+      qrow.push_back(QIFPair(rit->entry_id, quantizeWeight(rit->word_weight)));
+    }
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::setCoarseLevel(int level)
+{
+  m_coarse_level = std::max(level, 0);
+  
+  if(m_coarse_level > 0)
+    buildCoarseFile();
+  else
+    InvertedFile().swap(m_cifile);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::buildCoarseFile()
+{
+  m_cifile.resize(0);
+  
+  // the vector of each entry is recovered from the inverted file. Words
+  // are visited in ascending order, so they are appended to the vectors
+  std::vector<BowVector> entries(m_nentries);
+  for(size_t wid = 0; wid < m_ifile.size(); ++wid)
+  {
+    typename IFRow::const_iterator rit;
+    for(rit = m_ifile[wid].begin(); rit != m_ifile[wid].end(); ++rit)
+    {
+      BowVector &v = entries[rit->entry_id];
+      v.insert(v.end(), std::make_pair((WordId)wid, rit->word_weight));
+    }
+  }
+  
+  for(EntryId eid = 0; eid < entries.size(); ++eid)
+    addCoarseEntry(eid, entries[eid]);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::addCoarseEntry(EntryId entry_id,
+  const BowVector &v)
+{
+  BowVector cv;
+  m_voc->transformLevel(v, m_coarse_level, cv);
+  
+  BowVector::const_iterator vit;
+  for(vit = cv.begin(); vit != cv.end(); ++vit)
+  {
+    if(vit->first >= m_cifile.size()) m_cifile.resize(vit->first + 1);
+    m_cifile[vit->first].push_back(IFPair(entry_id, vit->second));
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::setQueryEngine(QueryEngine engine,
+  unsigned int block_size)
+{
+  if(m_quantized && engine != ENTRY_BLOCKS)
+    throw std::string("Quantized scoring needs the ENTRY_BLOCKS engine");
+  
+  m_query_engine = engine;
+  m_block_size = (block_size > 0 ? block_size : 1);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline QueryEngine TemplatedDatabase<TDescriptor, F>::getQueryEngine() const
+{
+  return m_query_engine;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::setDatabaseIdf(bool use)
+{
+  m_database_idf = use;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline bool TemplatedDatabase<TDescriptor, F>::usingDatabaseIdf() const
+{
+  return m_database_idf;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::setStopWords(double max_frequency,
+  unsigned int min_entries)
+{
+  m_stop_word_frequency = max_frequency;
+  m_stop_word_min_entries = min_entries;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline double TemplatedDatabase<TDescriptor, F>::getStopWordFrequency() const
+{
+  return m_stop_word_frequency;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline unsigned int TemplatedDatabase<TDescriptor, F>::getDocumentFrequency
+  (WordId wid) const
+{
+  return m_ifile[wid].size();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+double TemplatedDatabase<TDescriptor, F>::getDatabaseIdf(WordId wid) const
+{
+  const double N = std::max(m_nentries, 1);
+  const double Ni = std::max(m_ifile[wid].size(), (size_t)1);
+  return log(N / Ni);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::query(
+  const std::vector<TDescriptor> &features,
+  QueryResults &ret, int max_results, int max_id, QueryStats *stats) const
+{
+  BowVector vec;
+  m_voc->transform(features, vec);
+  query(vec, ret, max_results, max_id, stats);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::query(
+  const BowVector &vec, 
+  QueryResults &ret, int max_results, int max_id, QueryStats *stats) const
+{
+  queryFiltered(vec, ret, max_results, max_id, NULL, stats);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::query(
+  const std::vector<TDescriptor> &features, QueryResults &ret, 
+  int max_results, const EntryFilter &filter, QueryStats *stats) const
+{
+  BowVector vec;
+  m_voc->transform(features, vec);
+  queryFiltered(vec, ret, max_results, -1, &filter, stats);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::query(
+  const BowVector &vec, QueryResults &ret, 
+  int max_results, const EntryFilter &filter, QueryStats *stats) const
+{
+  queryFiltered(vec, ret, max_results, -1, &filter, stats);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::queryCoarse(
+  const std::vector<TDescriptor> &features, QueryResults &ret, 
+  int max_results, int max_id) const
+{
+  BowVector coarse_vec;
+  m_voc->transformLevel(features, m_coarse_level, coarse_vec);
+  queryCoarse(coarse_vec, ret, max_results, max_id);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::queryCoarse(
+  const BowVector &coarse_vec, QueryResults &ret, 
+  int max_results, int max_id) const
+{
+  if(m_coarse_level <= 0)
+    throw std::string("The coarse level of the database is not set");
+  
+  ret.resize(0);
+  
+  // nodes beyond the coarse file have no postings
+  BowVector vec;
+  BowVector::const_iterator vit;
+  for(vit = coarse_vec.begin(); vit != coarse_vec.end(); ++vit)
+  {
+    if(vit->first < m_cifile.size()) vec.insert(vec.end(), *vit);
+  }
+  
+  const EntryId end_id = getQueryEndId(max_id);
+  
+  switch(m_voc->getScoringType())
+  {
+    case L1_NORM:
+      accumulateBlocks<CoarseTerm<L1Term> >(vec, ret, 0, end_id, NULL);
+      break;
+      
+    case L2_NORM:
+      accumulateBlocks<CoarseTerm<L2Term> >(vec, ret, 0, end_id, NULL);
+      break;
+      
+    case CHI_SQUARE:
+      accumulateBlocks<CoarseTerm<ChiSquareTerm> >(vec, ret, 0, end_id, NULL);
+      break;
+      
+    case KL:
+      accumulateBlocks<CoarseTerm<KLTerm> >(vec, ret, 0, end_id, NULL);
+      break;
+      
+    case BHATTACHARYYA:
+      accumulateBlocks<CoarseTerm<BhattacharyyaTerm> >(vec, ret, 0, end_id, 
+        NULL);
+      break;
+      
+    case DOT_PRODUCT:
+      if(m_voc->getWeightingType() == BINARY)
+        accumulateBlocks<CoarseTerm<BinaryDotProductTerm> >(vec, ret, 
+          0, end_id, NULL);
+      else
+        accumulateBlocks<CoarseTerm<DotProductTerm> >(vec, ret, 0, end_id, 
+          NULL);
+      break;
+  }
+  
+  completeScores(coarse_vec, ret, max_results, true);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::queryTwoStage(
+  const std::vector<TDescriptor> &features, QueryResults &ret, 
+  int max_results, int coarse_results, int max_id, QueryStats *stats) const
+{
+  BowVector vec;
+  m_voc->transform(features, vec);
+  queryTwoStage(vec, ret, max_results, coarse_results, max_id, stats);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::queryTwoStage(
+  const BowVector &vec, QueryResults &ret, int max_results, 
+  int coarse_results, int max_id, QueryStats *stats) const
+{
+  // the coarse vector comes from the words, with no extra distances
+  BowVector coarse_vec;
+  m_voc->transformLevel(vec, m_coarse_level, coarse_vec);
+  
+  QueryResults candidates;
+  queryCoarse(coarse_vec, candidates, coarse_results, max_id);
+  
+  // only the candidates are scored with the words
+  EntryFilter filter(false);
+  QueryResults::const_iterator qit;
+  for(qit = candidates.begin(); qit != candidates.end(); ++qit)
+    filter.allow(qit->Id);
+  
+  queryFiltered(vec, ret, max_results, max_id, &filter, stats);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::queryFiltered(
+  const BowVector &vec, QueryResults &ret, int max_results, int max_id, 
+  const EntryFilter *filter, QueryStats *stats) const
+{
+  if(m_generations.empty())
+    queryEntries(vec, ret, max_results, max_id, filter, stats);
+  else
+    queryGenerations(vec, ret, max_results, max_id, filter, stats);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::queryGenerations(
+  const BowVector &vec, QueryResults &ret, int max_results, int max_id, 
+  const EntryFilter *filter, QueryStats *stats) const
+{
+  ret.resize(0);
+  
+  if(stats)
+  {
+    *stats = QueryStats();
+    stats->nQueryWords = vec.size();
+  }
+  
+  const EntryId end_id = getQueryEndId(max_id);
+  
+  BowVector gvec;
+  QueryResults gret;
+  QueryStats gstats;
+  
+  const bool tf = (m_voc->getWeightingType() == TF || 
+    m_voc->getWeightingType() == TF_IDF);
+  
+  for(size_t g = 0; g <= m_generations.size(); ++g)
+  {
+    const EntryId first = (g == 0 ? 0 : m_generations[g-1].end);
+    const EntryId last = (g < m_generations.size() ? 
+      std::min(m_generations[g].end, end_id) : end_id);
+    
+    if(first >= last) continue;
+    
+    // query words of the generation, summing those split from the same 
+    // one with the weight it had then, as transformLevel does with the 
+    // nodes. The sums change the norm, so the vector is normalized again
+    const BowVector *qvec = &vec;
+    if(g < m_generations.size())
+    {
+      const Generation &gen = m_generations[g];
+      
+      gvec.clear();
+      BowVector::const_iterator vit;
+      for(vit = vec.begin(); vit != vec.end(); ++vit)
+      {
+        const WordId gwid = gen.word(vit->first);
+        
+        if(gen.weights.empty())
+        {
+          gvec.addWeight(gwid, vit->second);
+          continue;
+        }
+        
+        const WordValue w = m_voc->getWordWeight(vit->first);
+        const WordValue gw = gen.weights[gwid];
+        if(w <= 0 || gw <= 0) continue; // stopped
+        
+        if(tf) gvec.addWeight(gwid, vit->second / w * gw);
+        else gvec.addIfNotExist(gwid, gw);
+      }
+      normalizeQuery(gvec);
+      qvec = &gvec;
+    }
+    
+    queryEntries(*qvec, gret, max_results, (int)last, filter, 
+      stats ? &gstats : NULL, first);
+    
+    ret.insert(ret.end(), gret.begin(), gret.end());
+    
+    if(stats)
+    {
+      stats->nScannedWords += gstats.nScannedWords;
+      stats->nScannedPostings += gstats.nScannedPostings;
+      stats->nSkippedPostings += gstats.nSkippedPostings;
+      stats->nStopWords += gstats.nStopWords;
+    }
+  }
+  
+  // KL scores are the lower the better
+  if(m_voc->getScoringType() == KL)
+    std::sort(ret.begin(), ret.end());
+  else
+    std::sort(ret.begin(), ret.end(), Result::gt);
+  
+  if(max_results > 0 && (int)ret.size() > max_results)
+    ret.resize(max_results);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::queryEntries(
+  const BowVector &in_vec, QueryResults &ret, int max_results, int max_id, 
+  const EntryFilter *filter, QueryStats *stats, EntryId min_id) const
+{
+  ret.resize(0);
+  
+  if(stats) *stats = QueryStats();
+  
+  BowVector idf_vec, budget_vec;
+  const BowVector &db_vec = 
+    (reweightQueryWords(in_vec, idf_vec, stats) ? idf_vec : in_vec);
+  const BowVector &vec = 
+    (selectQueryWords(db_vec, budget_vec, stats) ? budget_vec : db_vec);
+  
+  if(stats)
+  {
+    stats->nQueryWords = in_vec.size();
+    
+    // only the postings of the queried range of entries are counted
+    const EntryId end_id = getQueryEndId(max_id);
+    
+    BowVector::const_iterator vit;
+    for(vit = vec.begin(); vit != vec.end(); ++vit)
+    {
+      const IFRow& row = m_ifile[vit->first];
+      const size_t n = 
+        std::lower_bound(row.begin(), row.end(), end_id) -
+        std::lower_bound(row.begin(), row.end(), min_id);
+      if(n > 0)
+      {
+        stats->nScannedWords++;
+        stats->nScannedPostings += n;
+      }
+    }
+  }
+  
+  if(m_query_engine == ENTRY_BLOCKS)
+  {
+    queryBlocks(vec, ret, max_results, max_id, filter, min_id);
+    return;
+  }
+  
+  switch(m_voc->getScoringType())
+  {
+    case L1_NORM:
+      queryL1(vec, ret, max_results, max_id, filter, min_id);
+      break;
+      
+    case L2_NORM:
+      queryL2(vec, ret, max_results, max_id, filter, min_id);
+      break;
+      
+    case CHI_SQUARE:
+      queryChiSquare(vec, ret, max_results, max_id, filter, min_id);
+      break;
+      
+    case KL:
+      queryKL(vec, ret, max_results, max_id, filter, min_id);
+      break;
+      
+    case BHATTACHARYYA:
+      queryBhattacharyya(vec, ret, max_results, max_id, filter, min_id);
+      break;
+      
+    case DOT_PRODUCT:
+      queryDotProduct(vec, ret, max_results, max_id, filter, min_id);
+      break;
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+bool TemplatedDatabase<TDescriptor, F>::selectQueryWords(
+  const BowVector &vec, BowVector &budget_vec, QueryStats *stats) const
+{
+  if(m_word_budget <= 0 || (int)vec.size() <= m_word_budget) return false;
+  
+  // only words with postings count for the budget, since the rest 
+  // cost nothing to scan
+  std::vector<std::pair<double, WordId> > candidates; // <priority, word>
+  candidates.reserve(vec.size());
+  
+  BowVector::const_iterator vit;
+  for(vit = vec.begin(); vit != vec.end(); ++vit)
+  {
+    const IFRow& row = m_ifile[vit->first];
+    if(row.empty()) continue;
+    
+    double priority = fabs(vit->second);
+    if(m_word_selection == BY_WEIGHT_ROW_LENGTH)
+      priority /= (double)row.size();
+    
+    candidates.push_back(std::make_pair(priority, vit->first));
+  }
+  
+  if((int)candidates.size() <= m_word_budget) return false;
+  
+  // move the best words to the front
+  std::nth_element(candidates.begin(), candidates.begin() + m_word_budget,
+    candidates.end(), std::greater<std::pair<double, WordId> >());
+  
+  budget_vec.clear();
+  
+  // words without postings are kept to preserve the normalization
+  for(vit = vec.begin(); vit != vec.end(); ++vit)
+  {
+    if(m_ifile[vit->first].empty()) 
+      budget_vec.insert(budget_vec.end(), *vit);
+  }
+  
+  typename std::vector<std::pair<double, WordId> >::const_iterator cit;
+  for(cit = candidates.begin(); cit != candidates.begin() + m_word_budget; 
+    ++cit)
+  {
+    budget_vec.insert(*vec.find(cit->second));
+  }
+  
+  if(stats)
+  {
+    for(; cit != candidates.end(); ++cit)
+      stats->nSkippedPostings += m_ifile[cit->second].size();
+  }
+  
+  // the selected words must form a normalized vector again so that the
+  // scores keep their range
+  normalizeQuery(budget_vec);
+  
+  return true;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+bool TemplatedDatabase<TDescriptor, F>::reweightQueryWords(
+  const BowVector &vec, BowVector &idf_vec, QueryStats *stats) const
+{
+  const WeightingType weighting = m_voc->getWeightingType();
+  const bool reweight = m_database_idf && weighting != BINARY;
+  const bool stop = m_stop_word_frequency < 1. && 
+    (unsigned int)m_nentries >= m_stop_word_min_entries;
+  
+  if(!reweight && !stop) return false;
+  
+  const double max_rows = m_stop_word_frequency * m_nentries;
+  
+  idf_vec.clear();
+  
+  BowVector::const_iterator vit;
+  for(vit = vec.begin(); vit != vec.end(); ++vit)
+  {
+    const IFRow& row = m_ifile[vit->first];
+    
+    if(stop && (double)row.size() > max_rows)
+    {
+      if(stats)
+      {
+        stats->nStopWords++;
+        stats->nSkippedPostings += row.size();
+      }
+      continue;
+    }
+    
+    WordValue value = vit->second;
+    
+    if(reweight)
+    {
+      // the postings keep the vocabulary idf, only the query changes
+      const double voc_idf = (weighting == TF ? 1. : 
+        m_voc->getWordWeight(vit->first));
+      if(voc_idf > 0) value *= getDatabaseIdf(vit->first) / voc_idf;
+    }
+    
+    if(value > 0) idf_vec.insert(idf_vec.end(), 
+      BowVector::value_type(vit->first, value));
+  }
+  
+  normalizeQuery(idf_vec);
+  
+  return true;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::normalizeQuery(BowVector &vec) const
+{
+  switch(m_voc->getScoringType())
+  {
+    case L2_NORM:
+      vec.normalize(L2);
+      break;
+      
+    case DOT_PRODUCT:
+      break;
+      
+    default:
+      vec.normalize(L1);
+      break;
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::completeScores(const BowVector &vec,
+  QueryResults &ret, int max_results, bool coarse) const
+{
+  QueryResults::iterator qit;
+  
+  switch(m_voc->getScoringType())
+  {
+    case L1_NORM:
+    {
+      // resulting "scores" are now in [-2 best .. 0 worst]	
+      
+      // sort vector in ascending order of score
+      std::sort(ret.begin(), ret.end());
+      // (ret is inverted now --the lower the better--)
+
+      // cut vector
+      if(max_results > 0 && (int)ret.size() > max_results)
+        ret.resize(max_results);
+      
+      // complete and scale score to [0 worst .. 1 best]
+      // ||v - w||_{L1} = 2 + Sum(|v_i - w_i| - |v_i| - |w_i|) 
+      //		for all i | v_i != 0 and w_i != 0 
+      // (Nister, 2006)
+      // scaled_||v - w||_{L1} = 1 - 0.5 * ||v - w||_{L1}
+      for(qit = ret.begin(); qit != ret.end(); qit++) 
+        qit->Score = -qit->Score/2.0;
+      break;
+    }
+    
+    case L2_NORM:
+    {
+      // resulting "scores" are now in [-1 best .. 0 worst]	
+      
+      // sort vector in ascending order of score
+      std::sort(ret.begin(), ret.end());
+      // (ret is inverted now --the lower the better--)
+
+      // cut vector
+      if(max_results > 0 && (int)ret.size() > max_results)
+        ret.resize(max_results);
+
+      // complete and scale score to [0 worst .. 1 best]
+      // ||v - w||_{L2} = sqrt( 2 - 2 * Sum(v_i * w_i) 
+      //		for all i | v_i != 0 and w_i != 0 )
+      // (Nister, 2006)
+      for(qit = ret.begin(); qit != ret.end(); qit++) 
+      {
+        if(qit->Score <= -1.0) // rounding error
+          qit->Score = 1.0;
+        else
+          qit->Score = 1.0 - sqrt(1.0 + qit->Score); // [0..1]
+          // the + sign is ok, it is due to - sign in 
+          // value = - qvalue * dvalue
+      }
+      break;
+    }
+    
+    case CHI_SQUARE:
+    {
+      // remove the entries with too few words in common
+      QueryResults::iterator wit = ret.begin();
+      for(qit = ret.begin(); qit != ret.end(); ++qit)
+      {
+        if(qit->nWords >= m_min_common_words)
+        {
+          *wit = *qit;
+          wit->expectedChiScore = 
+            2 * wit->sumCommonWi / (1 + wit->sumCommonWi);
+          ++wit;
+        }
+      }
+      ret.resize(wit - ret.begin());
+      
+      // resulting "scores" are now in [-2 best .. 0 worst]	
+      // we have to add +2 to the scores to obtain the chi square score
+      
+      // sort vector in ascending order of score
+      std::sort(ret.begin(), ret.end());
+      // (ret is inverted now --the lower the better--)
+
+      // cut vector
+      if(max_results > 0 && (int)ret.size() > max_results)
+        ret.resize(max_results);
+
+      // complete and scale score to [0 worst .. 1 best]
+      for(qit = ret.begin(); qit != ret.end(); qit++)
+      {
+        // this takes the 4 into account
+        qit->Score = - 2. * qit->Score; // [0..1]
+        
+        qit->chiScore = qit->Score;
+      }
+      break;
+    }
+    
+    case KL:
+    {
+      // resulting "scores" are now in [-X worst .. 0 best .. X worst]
+      // but we cannot make sure which ones are better without calculating
+      // the complete score
+
+      // complete scores
+      const InvertedFile &ifile = (coarse ? m_cifile : m_ifile);
+      BowVector::const_iterator vit;
+      for(qit = ret.begin(); qit != ret.end(); ++qit)
+      {
+        EntryId eid = qit->Id;
+        double value = 0.0;
+
+        for(vit = vec.begin(); vit != vec.end(); ++vit)
+        {
+          const WordValue &vi = vit->second;
+
+          if(vi != 0 && vit->first >= ifile.size())
+          {
+            value += vi * (log(vi) - GeneralScoring::LOG_EPS);
+          }
+          else if(vi != 0)
+          {
+            const IFRow& row = ifile[vit->first];
+            
+            typename IFRow::const_iterator rit = 
+              std::lower_bound(row.begin(), row.end(), eid);
+            if(rit == row.end() || rit->entry_id != eid)
+            {
+              value += vi * (log(vi) - GeneralScoring::LOG_EPS);
+            }
+          }
+        }
+        
+        qit->Score += value;
+      }
+      
+      // real scores are now in [0 best .. X worst]
+
+      // sort vector in ascending order
+      // (scores are inverted now --the lower the better--)
+      std::sort(ret.begin(), ret.end());
+
+      // cut vector
+      if(max_results > 0 && (int)ret.size() > max_results)
+        ret.resize(max_results);
+
+      // cannot scale scores
+      break;
+    }
+    
+    case BHATTACHARYYA:
+    {
+      // remove the entries with too few words in common
+      QueryResults::iterator wit = ret.begin();
+      for(qit = ret.begin(); qit != ret.end(); ++qit)
+      {
+        if(qit->nWords >= m_min_common_words)
+        {
+          *wit = *qit;
+          wit->bhatScore = wit->Score;
+          ++wit;
+        }
+      }
+      ret.resize(wit - ret.begin());
+      
+      // scores are already in [0..1]
+
+      // sort vector in descending order
+      std::sort(ret.begin(), ret.end(), Result::gt);
+
+      // cut vector
+      if(max_results > 0 && (int)ret.size() > max_results)
+        ret.resize(max_results);
+      break;
+    }
+    
+    case DOT_PRODUCT:
+    {
+      // scores are the greater the better
+
+      // sort vector in descending order
+      std::sort(ret.begin(), ret.end(), Result::gt);
+
+      // cut vector
+      if(max_results > 0 && (int)ret.size() > max_results)
+        ret.resize(max_results);
+
+      // these scores cannot be scaled
+      break;
+    }
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::queryL1(const BowVector &vec, 
+  QueryResults &ret, int max_results, int max_id, 
+  const EntryFilter *filter, EntryId min_id) const
+{
+  BowVector::const_iterator vit;
+  typename IFRow::const_iterator rit;
+    
+  std::map<EntryId, double> pairs;
+  std::map<EntryId, double>::iterator pit;
+  
+  for(vit = vec.begin(); vit != vec.end(); ++vit)
   {
     const WordId word_id = vit->first;
     const WordValue& qvalue = vit->second;
@@ -633,14 +2557,16 @@ void TemplatedDatabase<TDescriptor, F>::queryL1(const BowVector &vec,
     
     // IFRows are sorted in ascending entry_id order
     
-    for(rit = row.begin(); rit != row.end(); ++rit)
+    for(rit = skipFiltered(std::lower_bound(row.begin(), row.end(), min_id),
+      row.end(), filter); rit != row.end();
+      rit = skipFiltered(rit + 1, row.end(), filter))
     {
       const EntryId entry_id = rit->entry_id;
       const WordValue& dvalue = rit->word_weight;
       
       if((int)entry_id < max_id || max_id == -1)
       {
-        double value = fabs(qvalue - dvalue) - fabs(qvalue) - fabs(dvalue);
+        double value = L1Term::value(qvalue, dvalue);
         
         pit = pairs.lower_bound(entry_id);
         if(pit != pairs.end() && !(pairs.key_comp()(entry_id, pit->first)))
@@ -663,32 +2589,16 @@ void TemplatedDatabase<TDescriptor, F>::queryL1(const BowVector &vec,
   {
     ret.push_back(Result(pit->first, pit->second));
   }
-	
-  // resulting "scores" are now in [-2 best .. 0 worst]	
   
-  // sort vector in ascending order of score
-  std::sort(ret.begin(), ret.end());
-  // (ret is inverted now --the lower the better--)
-
-  // cut vector
-  if(max_results > 0 && (int)ret.size() > max_results)
-    ret.resize(max_results);
-  
-  // complete and scale score to [0 worst .. 1 best]
-  // ||v - w||_{L1} = 2 + Sum(|v_i - w_i| - |v_i| - |w_i|) 
-  //		for all i | v_i != 0 and w_i != 0 
-  // (Nister, 2006)
-  // scaled_||v - w||_{L1} = 1 - 0.5 * ||v - w||_{L1}
-  QueryResults::iterator qit;
-  for(qit = ret.begin(); qit != ret.end(); qit++) 
-    qit->Score = -qit->Score/2.0;
+  completeScores(vec, ret, max_results);
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
 void TemplatedDatabase<TDescriptor, F>::queryL2(const BowVector &vec, 
-  QueryResults &ret, int max_results, int max_id) const
+  QueryResults &ret, int max_results, int max_id, 
+  const EntryFilter *filter, EntryId min_id) const
 {
   BowVector::const_iterator vit;
   typename IFRow::const_iterator rit;
@@ -696,9 +2606,6 @@ void TemplatedDatabase<TDescriptor, F>::queryL2(const BowVector &vec,
   std::map<EntryId, double> pairs;
   std::map<EntryId, double>::iterator pit;
   
-  //map<EntryId, int> counters;
-  //map<EntryId, int>::iterator cit;
-  
   for(vit = vec.begin(); vit != vec.end(); ++vit)
   {
     const WordId word_id = vit->first;
@@ -708,29 +2615,27 @@ void TemplatedDatabase<TDescriptor, F>::queryL2(const BowVector &vec,
     
     // IFRows are sorted in ascending entry_id order
     
-    for(rit = row.begin(); rit != row.end(); ++rit)
+    for(rit = skipFiltered(std::lower_bound(row.begin(), row.end(), min_id),
+      row.end(), filter); rit != row.end();
+      rit = skipFiltered(rit + 1, row.end(), filter))
     {
       const EntryId entry_id = rit->entry_id;
       const WordValue& dvalue = rit->word_weight;
       
       if((int)entry_id < max_id || max_id == -1)
       {
-        double value = - qvalue * dvalue; // minus sign for sorting trick
+        // minus sign for sorting trick
+        double value = L2Term::value(qvalue, dvalue);
         
         pit = pairs.lower_bound(entry_id);
-        //cit = counters.lower_bound(entry_id);
         if(pit != pairs.end() && !(pairs.key_comp()(entry_id, pit->first)))
         {
           pit->second += value; 
-          //cit->second += 1;
         }
         else
         {
           pairs.insert(pit, 
             std::map<EntryId, double>::value_type(entry_id, value));
-          
-          //counters.insert(cit, 
-          //  map<EntryId, int>::value_type(entry_id, 1));
         }
       }
       
@@ -739,44 +2644,20 @@ void TemplatedDatabase<TDescriptor, F>::queryL2(const BowVector &vec,
 	
   // move to vector
   ret.reserve(pairs.size());
-  //cit = counters.begin();
-  for(pit = pairs.begin(); pit != pairs.end(); ++pit)//, ++cit)
-  {
-    ret.push_back(Result(pit->first, pit->second));// / cit->second));
-  }
-	
-  // resulting "scores" are now in [-1 best .. 0 worst]	
-  
-  // sort vector in ascending order of score
-  std::sort(ret.begin(), ret.end());
-  // (ret is inverted now --the lower the better--)
-
-  // cut vector
-  if(max_results > 0 && (int)ret.size() > max_results)
-    ret.resize(max_results);
-
-  // complete and scale score to [0 worst .. 1 best]
-  // ||v - w||_{L2} = sqrt( 2 - 2 * Sum(v_i * w_i) 
-	//		for all i | v_i != 0 and w_i != 0 )
-	// (Nister, 2006)
-	QueryResults::iterator qit;
-  for(qit = ret.begin(); qit != ret.end(); qit++) 
+  for(pit = pairs.begin(); pit != pairs.end(); ++pit)
   {
-    if(qit->Score <= -1.0) // rounding error
-      qit->Score = 1.0;
-    else
-      qit->Score = 1.0 - sqrt(1.0 + qit->Score); // [0..1]
-      // the + sign is ok, it is due to - sign in 
-      // value = - qvalue * dvalue
+    ret.push_back(Result(pit->first, pit->second));
   }
   
+  completeScores(vec, ret, max_results);
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
 void TemplatedDatabase<TDescriptor, F>::queryChiSquare(const BowVector &vec, 
-  QueryResults &ret, int max_results, int max_id) const
+  QueryResults &ret, int max_results, int max_id, 
+  const EntryFilter *filter, EntryId min_id) const
 {
   BowVector::const_iterator vit;
   typename IFRow::const_iterator rit;
@@ -789,8 +2670,12 @@ void TemplatedDatabase<TDescriptor, F>::queryChiSquare(const BowVector &vec,
   
   // In the current implementation, we suppose vec is not normalized
   
-  //map<EntryId, double> expected;
-  //map<EntryId, double>::iterator eit;
+  // entries with few words in common are discarded before scoring them
+  std::vector<unsigned char> counts;
+  const unsigned char min_count = (unsigned char)m_min_common_words;
+  if(min_count > 1)
+    countCommonWords(vec, min_id, getQueryEndId(max_id), filter, 
+      counts);
   
   for(vit = vec.begin(); vit != vec.end(); ++vit)
   {
@@ -801,27 +2686,26 @@ void TemplatedDatabase<TDescriptor, F>::queryChiSquare(const BowVector &vec,
     
     // IFRows are sorted in ascending entry_id order
     
-    for(rit = row.begin(); rit != row.end(); ++rit)
+    for(rit = skipFiltered(std::lower_bound(row.begin(), row.end(), min_id),
+      row.end(), filter); rit != row.end();
+      rit = skipFiltered(rit + 1, row.end(), filter))
     {
       const EntryId entry_id = rit->entry_id;
       const WordValue& dvalue = rit->word_weight;
       
-      if((int)entry_id < max_id || max_id == -1)
+      if(((int)entry_id < max_id || max_id == -1) && 
+        (min_count <= 1 || counts[entry_id] >= min_count))
       {
         // (v-w)^2/(v+w) - v - w = -4 vw/(v+w)
         // we move the 4 out
-        double value = 0;
-        if(qvalue + dvalue != 0.0) // words may have weight zero
-          value = - qvalue * dvalue / (qvalue + dvalue);
+        double value = ChiSquareTerm::value(qvalue, dvalue);
         
         pit = pairs.lower_bound(entry_id);
         sit = sums.lower_bound(entry_id);
-        //eit = expected.lower_bound(entry_id);
         if(pit != pairs.end() && !(pairs.key_comp()(entry_id, pit->first)))
         {
           pit->second.first += value;
           pit->second.second += 1;
-          //eit->second += dvalue;
           sit->second.first += qvalue;
           sit->second.second += dvalue;
         }
@@ -830,8 +2714,6 @@ void TemplatedDatabase<TDescriptor, F>::queryChiSquare(const BowVector &vec,
           pairs.insert(pit, 
             std::map<EntryId, std::pair<double, int> >::value_type(entry_id,
               std::make_pair(value, 1) ));
-          //expected.insert(eit, 
-          //  map<EntryId, double>::value_type(entry_id, dvalue));
           
           sums.insert(sit, 
             std::map<EntryId, std::pair<double, double> >::value_type(entry_id,
@@ -847,47 +2729,21 @@ void TemplatedDatabase<TDescriptor, F>::queryChiSquare(const BowVector &vec,
   sit = sums.begin();
   for(pit = pairs.begin(); pit != pairs.end(); ++pit, ++sit)
   {
-    if(pit->second.second >= MIN_COMMON_WORDS)
-    {
-      ret.push_back(Result(pit->first, pit->second.first));
-      ret.back().nWords = pit->second.second;
-      ret.back().sumCommonVi = sit->second.first;
-      ret.back().sumCommonWi = sit->second.second;
-      ret.back().expectedChiScore = 
-        2 * sit->second.second / (1 + sit->second.second);
-    }
-  
-    //ret.push_back(Result(pit->first, pit->second));
-  }
-	
-  // resulting "scores" are now in [-2 best .. 0 worst]	
-  // we have to add +2 to the scores to obtain the chi square score
-  
-  // sort vector in ascending order of score
-  std::sort(ret.begin(), ret.end());
-  // (ret is inverted now --the lower the better--)
-
-  // cut vector
-  if(max_results > 0 && (int)ret.size() > max_results)
-    ret.resize(max_results);
-
-  // complete and scale score to [0 worst .. 1 best]
-  QueryResults::iterator qit;
-  for(qit = ret.begin(); qit != ret.end(); qit++)
-  {
-    // this takes the 4 into account
-    qit->Score = - 2. * qit->Score; // [0..1]
-    
-    qit->chiScore = qit->Score;
+    ret.push_back(Result(pit->first, pit->second.first));
+    ret.back().nWords = pit->second.second;
+    ret.back().sumCommonVi = sit->second.first;
+    ret.back().sumCommonWi = sit->second.second;
   }
   
+  completeScores(vec, ret, max_results);
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
 void TemplatedDatabase<TDescriptor, F>::queryKL(const BowVector &vec, 
-  QueryResults &ret, int max_results, int max_id) const
+  QueryResults &ret, int max_results, int max_id, 
+  const EntryFilter *filter, EntryId min_id) const
 {
   BowVector::const_iterator vit;
   typename IFRow::const_iterator rit;
@@ -904,15 +2760,16 @@ void TemplatedDatabase<TDescriptor, F>::queryKL(const BowVector &vec,
     
     // IFRows are sorted in ascending entry_id order
     
-    for(rit = row.begin(); rit != row.end(); ++rit)
+    for(rit = skipFiltered(std::lower_bound(row.begin(), row.end(), min_id),
+      row.end(), filter); rit != row.end();
+      rit = skipFiltered(rit + 1, row.end(), filter))
     {    
       const EntryId entry_id = rit->entry_id;
       const WordValue& wi = rit->word_weight;
       
       if((int)entry_id < max_id || max_id == -1)
       {
-        double value = 0;
-        if(vi != 0 && wi != 0) value = vi * log(vi/wi);
+        double value = KLTerm::value(vi, wi);
         
         pit = pairs.lower_bound(entry_id);
         if(pit != pairs.end() && !(pairs.key_comp()(entry_id, pit->first)))
@@ -929,66 +2786,36 @@ void TemplatedDatabase<TDescriptor, F>::queryKL(const BowVector &vec,
     } // for each inverted row
   } // for each query word
 	
-  // resulting "scores" are now in [-X worst .. 0 best .. X worst]
-  // but we cannot make sure which ones are better without calculating
-  // the complete score
-
-  // complete scores and move to vector
+  // move to vector
   ret.reserve(pairs.size());
   for(pit = pairs.begin(); pit != pairs.end(); ++pit)
   {
-    EntryId eid = pit->first;
-    double value = 0.0;
-
-    for(vit = vec.begin(); vit != vec.end(); ++vit)
-    {
-      const WordValue &vi = vit->second;
-      const IFRow& row = m_ifile[vit->first];
-
-      if(vi != 0)
-      {
-        if(row.end() == find(row.begin(), row.end(), eid ))
-        {
-          value += vi * (log(vi) - GeneralScoring::LOG_EPS);
-        }
-      }
-    }
-    
-    pit->second += value;
-    
-    // to vector
     ret.push_back(Result(pit->first, pit->second));
   }
   
-  // real scores are now in [0 best .. X worst]
-
-  // sort vector in ascending order
-  // (scores are inverted now --the lower the better--)
-  std::sort(ret.begin(), ret.end());
-
-  // cut vector
-  if(max_results > 0 && (int)ret.size() > max_results)
-    ret.resize(max_results);
-
-  // cannot scale scores
-    
+  completeScores(vec, ret, max_results);
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
 void TemplatedDatabase<TDescriptor, F>::queryBhattacharyya(
-  const BowVector &vec, QueryResults &ret, int max_results, int max_id) const
+  const BowVector &vec, QueryResults &ret, int max_results, int max_id,
+  const EntryFilter *filter, EntryId min_id) const
 {
   BowVector::const_iterator vit;
   typename IFRow::const_iterator rit;
   
-  //map<EntryId, double> pairs;
-  //map<EntryId, double>::iterator pit;
-  
   std::map<EntryId, std::pair<double, int> > pairs; // <eid, <score, counter> >
   std::map<EntryId, std::pair<double, int> >::iterator pit;
   
+  // entries with few words in common are discarded before scoring them
+  std::vector<unsigned char> counts;
+  const unsigned char min_count = (unsigned char)m_min_common_words;
+  if(min_count > 1)
+    countCommonWords(vec, min_id, getQueryEndId(max_id), filter, 
+      counts);
+  
   for(vit = vec.begin(); vit != vec.end(); ++vit)
   {
     const WordId word_id = vit->first;
@@ -998,14 +2825,17 @@ void TemplatedDatabase<TDescriptor, F>::queryBhattacharyya(
     
     // IFRows are sorted in ascending entry_id order
     
-    for(rit = row.begin(); rit != row.end(); ++rit)
+    for(rit = skipFiltered(std::lower_bound(row.begin(), row.end(), min_id),
+      row.end(), filter); rit != row.end();
+      rit = skipFiltered(rit + 1, row.end(), filter))
     {
       const EntryId entry_id = rit->entry_id;
       const WordValue& dvalue = rit->word_weight;
       
-      if((int)entry_id < max_id || max_id == -1)
+      if(((int)entry_id < max_id || max_id == -1) && 
+        (min_count <= 1 || counts[entry_id] >= min_count))
       {
-        double value = sqrt(qvalue * dvalue);
+        double value = BhattacharyyaTerm::value(qvalue, dvalue);
         
         pit = pairs.lower_bound(entry_id);
         if(pit != pairs.end() && !(pairs.key_comp()(entry_id, pit->first)))
@@ -1021,104 +2851,383 @@ void TemplatedDatabase<TDescriptor, F>::queryBhattacharyya(
         }
       }
       
-    } // for each inverted row
-  } // for each query word
-	
-  // move to vector
-  ret.reserve(pairs.size());
-  for(pit = pairs.begin(); pit != pairs.end(); ++pit)
-  {
-    if(pit->second.second >= MIN_COMMON_WORDS)
-    {
-      ret.push_back(Result(pit->first, pit->second.first));
-      ret.back().nWords = pit->second.second;
-      ret.back().bhatScore = pit->second.first;
-    }
+    } // for each inverted row
+  } // for each query word
+	
+  // move to vector
+  ret.reserve(pairs.size());
+  for(pit = pairs.begin(); pit != pairs.end(); ++pit)
+  {
+    ret.push_back(Result(pit->first, pit->second.first));
+    ret.back().nWords = pit->second.second;
+  }
+  
+  completeScores(vec, ret, max_results);
+}
+
+// ---------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::queryDotProduct(
+  const BowVector &vec, QueryResults &ret, int max_results, int max_id,
+  const EntryFilter *filter, EntryId min_id) const
+{
+  BowVector::const_iterator vit;
+  typename IFRow::const_iterator rit;
+  
+  std::map<EntryId, double> pairs;
+  std::map<EntryId, double>::iterator pit;
+  
+  for(vit = vec.begin(); vit != vec.end(); ++vit)
+  {
+    const WordId word_id = vit->first;
+    const WordValue& qvalue = vit->second;
+    
+    const IFRow& row = m_ifile[word_id];
+    
+    // IFRows are sorted in ascending entry_id order
+    
+    for(rit = skipFiltered(std::lower_bound(row.begin(), row.end(), min_id),
+      row.end(), filter); rit != row.end();
+      rit = skipFiltered(rit + 1, row.end(), filter))
+    {
+      const EntryId entry_id = rit->entry_id;
+      const WordValue& dvalue = rit->word_weight;
+      
+      if((int)entry_id < max_id || max_id == -1)
+      {
+        double value; 
+        if(this->m_voc->getWeightingType() == BINARY)
+          value = BinaryDotProductTerm::value(qvalue, dvalue);
+        else
+          value = DotProductTerm::value(qvalue, dvalue);
+        
+        pit = pairs.lower_bound(entry_id);
+        if(pit != pairs.end() && !(pairs.key_comp()(entry_id, pit->first)))
+        {
+          pit->second += value;
+        }
+        else
+        {
+          pairs.insert(pit, 
+            std::map<EntryId, double>::value_type(entry_id, value));
+        }
+      }
+      
+    } // for each inverted row
+  } // for each query word
+	
+  // move to vector
+  ret.reserve(pairs.size());
+  for(pit = pairs.begin(); pit != pairs.end(); ++pit)
+  {
+    ret.push_back(Result(pit->first, pit->second));
+  }
+  
+  completeScores(vec, ret, max_results);
+}
+
+// ---------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+template<class TIterator>
+inline TIterator TemplatedDatabase<TDescriptor, F>::skipFiltered(
+  TIterator rit, TIterator rend, const EntryFilter *filter)
+{
+  if(filter)
+  {
+    // IFRows are sorted in ascending entry_id order
+    while(rit != rend && !filter->isAllowed(rit->entry_id))
+      rit = std::lower_bound(rit, rend, filter->nextAllowed(rit->entry_id));
+  }
+  return rit;
+}
+
+// ---------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline EntryId TemplatedDatabase<TDescriptor, F>::getQueryEndId(int max_id) 
+  const
+{
+  // only entries with entry_id < max_id are scored. -1 means all
+  if(max_id == -1) return m_nentries;
+  else return std::min((EntryId)m_nentries, (EntryId)std::max(max_id, 0));
+}
+
+// ---------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::countCommonWords(const BowVector &vec,
+  EntryId begin_id, EntryId end_id, const EntryFilter *filter, 
+  std::vector<unsigned char> &counts) const
+{
+  counts.resize(0);
+  counts.resize(end_id + 1, 0); // +1 to allow &counts[0] when end_id == 0
+  
+  BowVector::const_iterator vit;
+  for(vit = vec.begin(); vit != vec.end(); ++vit)
+  {
+    const IFRow& row = m_ifile[vit->first];
+    
+    // IFRows are sorted in ascending entry_id order
+    typename IFRow::const_iterator rit;
+    const typename IFRow::const_iterator rend = 
+      std::lower_bound(row.begin(), row.end(), end_id);
+    
+    for(rit = skipFiltered(std::lower_bound(row.begin(), rend, begin_id), 
+      rend, filter); rit != rend; rit = skipFiltered(rit + 1, rend, filter))
+    {
+      unsigned char &c = counts[rit->entry_id];
+      c += (c != 255); // saturate
+    }
+  }
+}
+
+// ---------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::queryBlocks(const BowVector &vec, 
+  QueryResults &ret, int max_results, int max_id, 
+  const EntryFilter *filter, EntryId min_id) const
+{
+  // the max_id restriction is applied by not creating blocks beyond it
+  const EntryId end_id = getQueryEndId(max_id);
+  
+  // entries with few words in common are discarded before scoring them
+  std::vector<unsigned char> counts;
+  const unsigned char min_count = (unsigned char)m_min_common_words;
+  
+  switch(m_voc->getScoringType())
+  {
+    case L1_NORM:
+      if(m_quantized)
+        accumulateBlocks<QuantizedL1Term>(vec, ret, min_id, end_id, filter);
+      else
+        accumulateBlocks<L1Term>(vec, ret, min_id, end_id, filter);
+      break;
+      
+    case L2_NORM:
+      if(m_quantized)
+        accumulateBlocks<QuantizedL2Term>(vec, ret, min_id, end_id, filter);
+      else
+        accumulateBlocks<L2Term>(vec, ret, min_id, end_id, filter);
+      break;
+      
+    case CHI_SQUARE:
+      if(min_count > 1)
+      {
+        countCommonWords(vec, min_id, end_id, filter, counts);
+        accumulateBlocks<ChiSquareTerm>(vec, ret, min_id, end_id, filter, 
+          &counts[0], min_count);
+      }
+      else
+        accumulateBlocks<ChiSquareTerm>(vec, ret, min_id, end_id, filter);
+      break;
+      
+    case KL:
+      accumulateBlocks<KLTerm>(vec, ret, min_id, end_id, filter);
+      break;
+      
+    case BHATTACHARYYA:
+      if(min_count > 1)
+      {
+        countCommonWords(vec, min_id, end_id, filter, counts);
+        accumulateBlocks<BhattacharyyaTerm>(vec, ret, min_id, end_id, filter, 
+          &counts[0], min_count);
+      }
+      else
+        accumulateBlocks<BhattacharyyaTerm>(vec, ret, min_id, end_id, filter);
+      break;
+      
+    case DOT_PRODUCT:
+      if(m_voc->getWeightingType() == BINARY)
+        accumulateBlocks<BinaryDotProductTerm>(vec, ret, min_id, end_id, 
+          filter);
+      else
+        accumulateBlocks<DotProductTerm>(vec, ret, min_id, end_id, filter);
+      break;
   }
-	
-  // scores are already in [0..1]
-
-  // sort vector in descending order
-  std::sort(ret.begin(), ret.end(), Result::gt);
-
-  // cut vector
-  if(max_results > 0 && (int)ret.size() > max_results)
-    ret.resize(max_results);
-
+  
+  completeScores(vec, ret, max_results);
 }
 
 // ---------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-void TemplatedDatabase<TDescriptor, F>::queryDotProduct(
-  const BowVector &vec, QueryResults &ret, int max_results, int max_id) const
+template<class TTerm>
+void TemplatedDatabase<TDescriptor, F>::accumulateBlocks(const BowVector &vec,
+  QueryResults &ret, EntryId begin_id, EntryId end_id, 
+  const EntryFilter *filter, const unsigned char *counts, 
+  unsigned char min_count) const
 {
-  BowVector::const_iterator vit;
-  typename IFRow::const_iterator rit;
+  if(begin_id >= end_id) return;
   
-  std::map<EntryId, double> pairs;
-  std::map<EntryId, double>::iterator pit;
+  // blocks are aligned to B, so that the first one may start before 
+  // begin_id. The rows are scanned from begin_id on anyway
+  const EntryId B = std::max(m_block_size, 1u);
+  const int first_block = (int)(begin_id / B);
+  const int nblocks = (int)((end_id + B - 1) / B) - first_block;
+  
+  typedef typename TTerm::Row Row;
+  typedef typename TTerm::QueryValue QueryValue;
+  typedef typename TTerm::Accumulator Accumulator;
   
+  // non-empty rows of the query words
+  std::vector<const Row*> rows;
+  std::vector<QueryValue> qvalues;
+  rows.reserve(vec.size());
+  qvalues.reserve(vec.size());
+  
+  BowVector::const_iterator vit;
   for(vit = vec.begin(); vit != vec.end(); ++vit)
   {
-    const WordId word_id = vit->first;
-    const WordValue& qvalue = vit->second;
+    const Row& row = TTerm::row(*this, vit->first);
+    if(!row.empty())
+    {
+      rows.push_back(&row);
+      qvalues.push_back(TTerm::query(vit->second));
+    }
+  }
+  
+  if(rows.empty()) return;
+  
+  // each thread processes a contiguous range of blocks, so that the 
+  // results remain sorted by entry id when concatenated
+  int nthreads = 1;
+#ifdef _OPENMP
+  nthreads = std::min(omp_get_max_threads(), nblocks);
+#endif
+  
+  std::vector<QueryResults> partial(nthreads);
+  
+#ifdef _OPENMP
+  #pragma omp parallel num_threads(nthreads)
+#endif
+  {
+    int t = 0;
+#ifdef _OPENMP
+    t = omp_get_thread_num();
+#endif
     
-    const IFRow& row = m_ifile[word_id];
+    const int b_begin = first_block + (int)((long)nblocks * t / nthreads);
+    const int b_end = first_block + 
+      (int)((long)nblocks * (t + 1) / nthreads);
     
-    // IFRows are sorted in ascending entry_id order
+    QueryResults &tret = partial[t];
     
-    for(rit = row.begin(); rit != row.end(); ++rit)
+    // accumulators of the current block, indexed by entry_id - first_id
+    std::vector<Accumulator> scores(B, 0);
+    std::vector<int> nwords(B, 0);
+    std::vector<double> sumvi, sumwi;
+    if(TTerm::SUMS)
     {
-      const EntryId entry_id = rit->entry_id;
-      const WordValue& dvalue = rit->word_weight;
+      sumvi.resize(B, 0);
+      sumwi.resize(B, 0);
+    }
+    
+    // skip pointers: position in each row of the first pair of the 
+    // current block
+    std::vector<typename Row::const_iterator> cursors(rows.size());
+    for(size_t i = 0; i < rows.size(); ++i)
+    {
+      cursors[i] = std::lower_bound(rows[i]->begin(), rows[i]->end(), 
+        std::max((EntryId)b_begin * B, begin_id));
+    }
+    
+    for(int b = b_begin; b < b_end; ++b)
+    {
+      const EntryId first_id = (EntryId)b * B;
+      const EntryId last_id = std::min(first_id + B, end_id);
       
-      if((int)entry_id < max_id || max_id == -1)
+      // blocks without allowed entries are jumped over, and the filter is
+      // not checked per posting in the fully allowed ones
+      const EntryFilter *block_filter = filter;
+      if(filter)
       {
-        double value; 
-        if(this->m_voc->getWeightingType() == BINARY)
-          value = 1;
-        else
-          value = qvalue * dvalue;
+        const EntryId next_id = filter->nextAllowed(first_id);
+        if(next_id >= last_id)
+        {
+          const EntryId range_end = (EntryId)b_end * B;
+          const EntryId skip_id =
+            (next_id < std::min(end_id, range_end) ? next_id : range_end);
+          for(size_t i = 0; i < rows.size(); ++i)
+            cursors[i] = std::lower_bound(cursors[i], rows[i]->end(), skip_id);
+          
+          b = (int)(skip_id / B) - 1;
+          continue;
+        }
         
-        pit = pairs.lower_bound(entry_id);
-        if(pit != pairs.end() && !(pairs.key_comp()(entry_id, pit->first)))
+        if(next_id == first_id && filter->allAllowed(first_id, last_id))
+          block_filter = NULL;
+      }
+      
+      bool touched = false;
+      
+      for(size_t i = 0; i < rows.size(); ++i)
+      {
+        const QueryValue qvalue = qvalues[i];
+        typename Row::const_iterator rit = cursors[i];
+        const typename Row::const_iterator rend = rows[i]->end();
+        
+        for(; rit != rend && rit->entry_id < last_id; ++rit)
         {
-          pit->second += value;
+          if(counts && counts[rit->entry_id] < min_count) continue;
+          if(block_filter && !block_filter->isAllowed(rit->entry_id)) continue;
+          
+          const EntryId j = rit->entry_id - first_id;
+          scores[j] += TTerm::value(qvalue, rit->word_weight);
+          nwords[j]++;
+          
+          if(TTerm::SUMS)
+          {
+            sumvi[j] += qvalue;
+            sumwi[j] += rit->word_weight;
+          }
         }
-        else
+        
+        if(rit != cursors[i])
         {
-          pairs.insert(pit, 
-            std::map<EntryId, double>::value_type(entry_id, value));
+          touched = true;
+          cursors[i] = rit;
         }
       }
       
-    } // for each inverted row
-  } // for each query word
-	
-  // move to vector
-  ret.reserve(pairs.size());
-  for(pit = pairs.begin(); pit != pairs.end(); ++pit)
-  {
-    ret.push_back(Result(pit->first, pit->second));
-  }
-	
-  // scores are the greater the better
-
-  // sort vector in descending order
-  std::sort(ret.begin(), ret.end(), Result::gt);
-
-  // cut vector
-  if(max_results > 0 && (int)ret.size() > max_results)
-    ret.resize(max_results);
-
-  // these scores cannot be scaled
+      if(!touched) continue;
+      
+      // move the touched entries to the results and clear the block
+      for(EntryId j = 0; j < last_id - first_id; ++j)
+      {
+        if(nwords[j] > 0)
+        {
+          tret.push_back(Result(first_id + j, TTerm::score(scores[j])));
+          tret.back().nWords = nwords[j];
+          scores[j] = 0;
+          nwords[j] = 0;
+          
+          if(TTerm::SUMS)
+          {
+            tret.back().sumCommonVi = sumvi[j];
+            tret.back().sumCommonWi = sumwi[j];
+            sumvi[j] = 0;
+            sumwi[j] = 0;
+          }
+        }
+      }
+    } // for each block
+  } // omp parallel
+  
+  size_t n = 0;
+  for(int t = 0; t < nthreads; ++t) n += partial[t].size();
+  ret.reserve(n);
+  
+  for(int t = 0; t < nthreads; ++t)
+    ret.insert(ret.end(), partial[t].begin(), partial[t].end());
 }
 
 // ---------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-const FeatureVector& TemplatedDatabase<TDescriptor, F>::retrieveFeatures
+FeatureVectorView TemplatedDatabase<TDescriptor, F>::retrieveFeatures
   (EntryId id) const
 {
   assert(id < size());
@@ -1167,6 +3276,14 @@ void TemplatedDatabase<TDescriptor, F>::save(cv::FileStorage &fs,
   //        }
   //      ]
   //   ]
+  //   vocabularyUpdates (optional)
+  //   [
+  //     {
+  //       endEntry:
+  //       nWords:
+  //       origin: [ ]
+  //     }
+  //   ]
 
   // invertedIndex[i] is for the i-th word
   // directIndex[i] is for the i-th entry
@@ -1204,24 +3321,24 @@ void TemplatedDatabase<TDescriptor, F>::save(cv::FileStorage &fs,
   
   fs << "directIndex" << "[";
   
-  typename DirectFile::const_iterator dit;
-  typename FeatureVector::const_iterator drit;
-  for(dit = m_dfile.begin(); dit != m_dfile.end(); ++dit)
+  std::vector<int> features;
+  for(size_t eid = 0; eid < m_dfile.size(); ++eid)
   {
     fs << "["; // entry of DF
     
-    for(drit = dit->begin(); drit != dit->end(); ++drit)
+    const FeatureVectorView fv = m_dfile[eid];
+    for(size_t i = 0; i < fv.size(); ++i)
     {
-      NodeId nid = drit->first;
-      const std::vector<unsigned int>& features = drit->second;
+      NodeId nid = fv.nodeId(i);
+      const FeatureIndices f = fv.features(i);
       
       // save info of last_nid
       fs << "{";
       fs << "nodeId" << (int)nid;
       // msvc++ 2010 with opencv 2.3.1 does not allow FileStorage::operator<<
       // with vectors of unsigned int
-      fs << "features" << "[" 
-        << *(const std::vector<int>*)(&features) << "]";
+      features.assign(f.begin(), f.end());
+      fs << "features" << "[" << features << "]";
       fs << "}";
     }
     
@@ -1230,6 +3347,28 @@ void TemplatedDatabase<TDescriptor, F>::save(cv::FileStorage &fs,
   
   fs << "]"; // directIndex
   
+  // vocabularyUpdates is only written if the vocabulary has grown, and
+  // origin holds the word each word >= nWords comes from
+  if(!m_generations.empty())
+  {
+    fs << "vocabularyUpdates" << "[";
+    
+    typename std::vector<Generation>::const_iterator git;
+    for(git = m_generations.begin(); git != m_generations.end(); ++git)
+    {
+      fs << "{";
+      fs << "endEntry" << (int)git->end;
+      fs << "nWords" << (int)git->nwords;
+      features.assign(git->origin.begin(), git->origin.end());
+      fs << "origin" << "[" << features << "]";
+      std::vector<double> weights(git->weights.begin(), git->weights.end());
+      fs << "weights" << "[" << weights << "]";
+      fs << "}";
+    }
+    
+    fs << "]"; // vocabularyUpdates
+  }
+  
   fs << "}"; // database
 }
 
@@ -1279,25 +3418,26 @@ void TemplatedDatabase<TDescriptor, F>::load(const cv::FileStorage &fs,
     }
   }
   
+  if(m_quantized) buildQuantizedFile();
+  if(m_coarse_level > 0) buildCoarseFile();
+  
   if(m_use_di)
   {
     fn = fdb["directIndex"];
     
-    m_dfile.resize(fn.size());
+    m_dfile.reserve(fn.size());
     assert(m_nentries == (int)fn.size());
     
-    FeatureVector::iterator dit;
     for(EntryId eid = 0; eid < fn.size(); ++eid)
     {
       cv::FileNode fe = fn[eid];
       
-      m_dfile[eid].clear();
+      m_dfile.push_back();
       for(unsigned int i = 0; i < fe.size(); ++i)
       {
         NodeId nid = (int)fe[i]["nodeId"];
         
-        dit = m_dfile[eid].insert(m_dfile[eid].end(), 
-          make_pair(nid, std::vector<unsigned int>() ));
+        m_dfile.addNode(nid);
         
         // this failed to compile with some opencv versions (2.3.1)
         //fe[i]["features"] >> dit->second;
@@ -1309,17 +3449,340 @@ void TemplatedDatabase<TDescriptor, F>::load(const cv::FileStorage &fs,
         //std::copy(aux.begin(), aux.end(), dit->second.begin());
         
         cv::FileNode ff = fe[i]["features"][0];
-        dit->second.reserve(ff.size());
                 
         cv::FileNodeIterator ffit;
         for(ffit = ff.begin(); ffit != ff.end(); ++ffit)
         {
-          dit->second.push_back((int)*ffit); 
+          m_dfile.addFeature((int)*ffit); 
         }
       }
     } // for each entry
   } // if use_id
   
+  fn = fdb["vocabularyUpdates"];
+  for(unsigned int i = 0; i < fn.size(); ++i)
+  {
+    Generation g;
+    g.end = (int)fn[i]["endEntry"];
+    g.nwords = (int)fn[i]["nWords"];
+    
+    cv::FileNode fo = fn[i]["origin"][0];
+    
+    cv::FileNodeIterator foit;
+    for(foit = fo.begin(); foit != fo.end(); ++foit)
+    {
+      g.origin.push_back((int)*foit);
+    }
+    
+    cv::FileNode fw = fn[i]["weights"];
+    if(!fw.empty())
+    {
+      fw = fw[0];
+      for(foit = fw.begin(); foit != fw.end(); ++foit)
+      {
+        g.weights.push_back((double)*foit);
+      }
+    }
+    
+    m_generations.push_back(g);
+  }
+  
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+TemplatedDatabase<TDescriptor, F>::QuerySession::QuerySession(
+  const TemplatedDatabase &db, int refresh_period)
+  : m_db(&db), m_scale(1), m_nentries(0), 
+  m_modifications(db.m_modifications), m_scoring(L1_NORM), 
+  m_binary(false), m_updates(0), m_refresh_period(refresh_period)
+{
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::QuerySession::reset()
+{
+  m_vec.clear();
+  m_scale = 1;
+  m_scores.clear();
+  m_nwords.clear();
+  m_touched.clear();
+  m_listed.clear();
+  m_nentries = 0;
+  m_updates = 0;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::QuerySession::query(
+  const std::vector<TDescriptor> &features, QueryResults &ret, 
+  int max_results, QueryStats *stats)
+{
+  BowVector vec;
+  m_db->m_voc->transform(features, vec);
+  query(vec, ret, max_results, stats);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::QuerySession::query(
+  const BowVector &vec, QueryResults &ret, int max_results, 
+  QueryStats *stats)
+{
+  const ScoringType scoring = m_db->m_voc->getScoringType();
+  const bool binary = (m_db->m_voc->getWeightingType() == BINARY);
+  
+  if(scoring != L1_NORM && scoring != L2_NORM && scoring != DOT_PRODUCT)
+  {
+    m_db->query(vec, ret, max_results, -1, stats);
+    return;
+  }
+  
+  ret.resize(0);
+  
+  if(stats)
+  {
+    *stats = QueryStats();
+    stats->nQueryWords = vec.size();
+  }
+  
+  // start from scratch if the database was cleared, its words were 
+  // renumbered or the terms changed
+  const EntryId nentries = m_db->m_nentries;
+  if(m_modifications != m_db->m_modifications || nentries < m_nentries ||
+    scoring != m_scoring || binary != m_binary || 
+    m_updates >= m_refresh_period)
+  {
+    reset();
+    m_modifications = m_db->m_modifications;
+    m_scoring = scoring;
+    m_binary = binary;
+  }
+  
+  // new entries are scored with the words of the previous query
+  if(nentries > m_nentries)
+  {
+    m_scores.resize(nentries, 0);
+    m_nwords.resize(nentries, 0);
+    m_listed.resize(nentries, false);
+    
+    BowVector::const_iterator vit;
+    for(vit = m_vec.begin(); vit != m_vec.end(); ++vit)
+      scanRow(vit->first, NULL, &vit->second, m_nentries, stats);
+    
+    m_nentries = nentries;
+  }
+  
+  // L2 and dot product terms are linear in the query weights, so the
+  // query is stored in the scale of the previous one. Words only rescaled
+  // up to rounding are considered the same
+  const bool linear = (scoring == L2_NORM || 
+    (scoring == DOT_PRODUCT && !binary));
+  const double scale = (linear ? estimateScale(vec) : 1.0);
+  const double tolerance = (linear ? 1e-9 : 0);
+  
+  // find the words added, removed or changed, merging both sorted vectors
+  std::vector<std::pair<WordId, WordValue> > updated; // <word, new weight>
+  std::vector<WordId> removed;
+  unsigned long delta_postings = 0, full_postings = 0;
+  
+  BowVector::const_iterator oit = m_vec.begin();
+  BowVector::const_iterator nit = vec.begin();
+  
+  while(oit != m_vec.end() || nit != vec.end())
+  {
+    if(nit == vec.end() || (oit != m_vec.end() && oit->first < nit->first))
+    {
+      removed.push_back(oit->first);
+      delta_postings += m_db->m_ifile[oit->first].size();
+      ++oit;
+    }
+    else
+    {
+      const WordValue q = nit->second / scale;
+      if(oit == m_vec.end() || nit->first < oit->first || 
+        fabs(q - oit->second) > tolerance * fabs(oit->second))
+      {
+        updated.push_back(std::make_pair(nit->first, q));
+        delta_postings += m_db->m_ifile[nit->first].size();
+      }
+      full_postings += m_db->m_ifile[nit->first].size();
+      
+      if(oit != m_vec.end() && oit->first == nit->first) ++oit;
+      ++nit;
+    }
+  }
+  
+  if(delta_postings > full_postings)
+  {
+    // most words changed (e.g. L1 normalization), it is cheaper to 
+    // compute the scores from scratch
+    m_vec.clear();
+    std::vector<EntryId>::const_iterator eit;
+    for(eit = m_touched.begin(); eit != m_touched.end(); ++eit)
+    {
+      m_scores[*eit] = 0;
+      m_nwords[*eit] = 0;
+      m_listed[*eit] = false;
+    }
+    m_touched.clear();
+    m_updates = 0;
+    
+    removed.clear();
+    updated.clear();
+    for(nit = vec.begin(); nit != vec.end(); ++nit)
+      updated.push_back(std::make_pair(nit->first, nit->second / scale));
+  }
+  else
+    m_updates++;
+  
+  std::vector<WordId>::const_iterator wit;
+  for(wit = removed.begin(); wit != removed.end(); ++wit)
+  {
+    BowVector::iterator vit = m_vec.find(*wit);
+    scanRow(*wit, &vit->second, NULL, 0, stats);
+    m_vec.erase(vit);
+  }
+  
+  std::vector<std::pair<WordId, WordValue> >::const_iterator uit;
+  for(uit = updated.begin(); uit != updated.end(); ++uit)
+  {
+    BowVector::iterator vit = m_vec.lower_bound(uit->first);
+    if(vit != m_vec.end() && vit->first == uit->first)
+    {
+      scanRow(uit->first, &vit->second, &uit->second, 0, stats);
+      vit->second = uit->second;
+    }
+    else
+    {
+      scanRow(uit->first, NULL, &uit->second, 0, stats);
+      m_vec.insert(vit, *uit);
+    }
+  }
+  
+  m_scale = scale;
+  
+  // move the entries with words in common to the results, dropping from
+  // the touched list those that lost them, so that the work depends on
+  // the entries of the scanned rows instead of on the database size
+  std::vector<EntryId>::iterator eit, last = m_touched.begin();
+  for(eit = m_touched.begin(); eit != m_touched.end(); ++eit)
+  {
+    if(m_nwords[*eit] > 0) *last++ = *eit;
+    else m_listed[*eit] = false;
+  }
+  m_touched.resize(last - m_touched.begin());
+  std::sort(m_touched.begin(), m_touched.end());
+  
+  for(eit = m_touched.begin(); eit != m_touched.end(); ++eit)
+  {
+    ret.push_back(Result(*eit, m_scale * m_scores[*eit]));
+    ret.back().nWords = m_nwords[*eit];
+  }
+  
+  m_db->completeScores(vec, ret, max_results);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline double TemplatedDatabase<TDescriptor, F>::QuerySession::value(
+  WordValue q, WordValue d) const
+{
+  switch(m_scoring)
+  {
+    case L1_NORM:
+      return L1Term::value(q, d);
+      
+    case L2_NORM:
+      return L2Term::value(q, d);
+      
+    default: // DOT_PRODUCT
+      if(m_binary) return BinaryDotProductTerm::value(q, d);
+      else return DotProductTerm::value(q, d);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedDatabase<TDescriptor, F>::QuerySession::scanRow(WordId wid,
+  const WordValue *old_q, const WordValue *new_q, EntryId first_id, 
+  QueryStats *stats)
+{
+  const IFRow& row = m_db->m_ifile[wid];
+  
+  // IFRows are sorted in ascending entry_id order
+  typename IFRow::const_iterator rit = 
+    std::lower_bound(row.begin(), row.end(), first_id);
+  
+  if(stats && rit != row.end())
+  {
+    stats->nScannedWords++;
+    stats->nScannedPostings += row.end() - rit;
+  }
+  
+  const int dn = (new_q ? 1 : 0) - (old_q ? 1 : 0);
+  
+  for(; rit != row.end(); ++rit)
+  {
+    const EntryId entry_id = rit->entry_id;
+    
+    double v = 0;
+    if(new_q) v += value(*new_q, rit->word_weight);
+    if(old_q) v -= value(*old_q, rit->word_weight);
+    
+    m_nwords[entry_id] += dn;
+    
+    // entries without common words restart from 0, dropping the drift
+    if(m_nwords[entry_id] > 0)
+    {
+      m_scores[entry_id] += v;
+      
+      if(!m_listed[entry_id])
+      {
+        m_listed[entry_id] = true;
+        m_touched.push_back(entry_id);
+      }
+    }
+    else m_scores[entry_id] = 0;
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+double TemplatedDatabase<TDescriptor, F>::QuerySession::estimateScale(
+  const BowVector &vec) const
+{
+  // ratios of the common words
+  std::vector<double> ratios;
+  
+  BowVector::const_iterator oit = m_vec.begin();
+  BowVector::const_iterator nit = vec.begin();
+  while(oit != m_vec.end() && nit != vec.end())
+  {
+    if(oit->first < nit->first) ++oit;
+    else if(nit->first < oit->first) ++nit;
+    else
+    {
+      if(oit->second > 0 && nit->second > 0)
+        ratios.push_back(nit->second / oit->second);
+      ++oit;
+      ++nit;
+    }
+  }
+  
+  if(ratios.empty()) return m_scale;
+  
+  std::nth_element(ratios.begin(), ratios.begin() + ratios.size() / 2, 
+    ratios.end());
+  return ratios[ratios.size() / 2];
 }
 
 // --------------------------------------------------------------------------
@@ -0,0 +1,442 @@
+/**
+ * File: TemplatedMatcher.h
+ * Date: October 2026
+ * Description: matching of local features between two images restricted
+ *   to the vocabulary nodes they share (direct index)
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#ifndef __D_T_TEMPLATED_MATCHER__
+#define __D_T_TEMPLATED_MATCHER__
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <limits>
+#include <iostream>
+
+#include "FClass.h"
+#include "FeatureVector.h"
+#include "CompactFeatureVector.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace DBoW2 {
+
+/// Correspondence between two local features
+struct FeatureMatch
+{
+  /// Index of the feature in the query image
+  unsigned int QueryIdx;
+
+  /// Index of the feature in the train image
+  unsigned int TrainIdx;
+
+  /// Distance between the descriptors
+  double Distance;
+
+  /**
+   * Empty constructor
+   */
+  inline FeatureMatch(){}
+
+  /**
+   * Creates a match with the given data
+   * @param query_idx index of the query feature
+   * @param train_idx index of the train feature
+   * @param distance distance between the descriptors
+   */
+  inline FeatureMatch(unsigned int query_idx, unsigned int train_idx,
+    double distance): QueryIdx(query_idx), TrainIdx(train_idx),
+    Distance(distance){}
+
+  /**
+   * Returns true iff a.QueryIdx < b.QueryIdx
+   * @param a
+   * @param b
+   */
+  static inline bool ltQuery(const FeatureMatch &a, const FeatureMatch &b)
+  {
+    return a.QueryIdx < b.QueryIdx;
+  }
+
+  /**
+   * Orders by train index and then by distance
+   * @param a
+   * @param b
+   */
+  static inline bool ltTrain(const FeatureMatch &a, const FeatureMatch &b)
+  {
+    return a.TrainIdx < b.TrainIdx ||
+      (a.TrainIdx == b.TrainIdx && (a.Distance < b.Distance ||
+      (a.Distance == b.Distance && a.QueryIdx < b.QueryIdx)));
+  }
+
+  /**
+   * Prints a string version of the match
+   * @param os ostream
+   * @param m match to print
+   */
+  friend inline std::ostream & operator<<(std::ostream& os,
+    const FeatureMatch& m)
+  {
+    os << "<" << m.QueryIdx << " -> " << m.TrainIdx << ", Distance: "
+      << m.Distance << ">";
+    return os;
+  }
+};
+
+/// @param TDescriptor class of descriptor
+/// @param F class of descriptor functions
+template<class TDescriptor, class F>
+/// Matcher of local features by vocabulary nodes
+/**
+ * Features are only compared with the features of the other image that
+ * fall in the same node of the direct index (see TemplatedDatabase), so
+ * that the cost is much lower than that of brute force matching. For each
+ * query feature, the best and second best train features of its node are
+ * found and the match is accepted if it passes the ratio test and the
+ * distance threshold. Distances are bounded by the second best one, so
+ * that descriptor classes with a bounded distance stop computing them as
+ * soon as they cannot change the result. Nodes are processed in parallel
+ * when OpenMP is available.
+ */
+class TemplatedMatcher
+{
+public:
+
+  /**
+   * Creates a matcher
+   * @param ratio a match is accepted if best < ratio * second best
+   *   distance. <= 0 disables the test. The test uses the distances of F,
+   *   which are squared for some descriptors (e.g. FSurf64)
+   * @param max_distance a match is accepted if its distance is <=
+   *   max_distance. < 0 disables the check
+   * @param unique if true, each train feature is matched at most once,
+   *   keeping its closest query feature
+   */
+  TemplatedMatcher(double ratio = 0.8, double max_distance = -1,
+    bool unique = true);
+
+  /**
+   * Sets the ratio of the ratio test
+   * @param ratio (<= 0 disables the test)
+   */
+  inline void setRatio(double ratio);
+
+  /**
+   * Returns the ratio of the ratio test
+   * @return ratio
+   */
+  inline double getRatio() const;
+
+  /**
+   * Sets the maximum distance of the matches
+   * @param max_distance (< 0 disables the check)
+   */
+  inline void setMaxDistance(double max_distance);
+
+  /**
+   * Returns the maximum distance of the matches
+   * @return max distance
+   */
+  inline double getMaxDistance() const;
+
+  /**
+   * Sets whether train features can only be matched once
+   * @param unique
+   */
+  inline void setUnique(bool unique);
+
+  /**
+   * Returns whether train features can only be matched once
+   * @return unique
+   */
+  inline bool isUnique() const;
+
+  /**
+   * Matches the features of two images by the nodes they share
+   * @param TFeatureVectorA FeatureVector, FeatureVectorView...
+   * @param TFeatureVectorB FeatureVector, FeatureVectorView...
+   * @param query_descriptors descriptors of the query image
+   * @param query_fv feature vector of the query image
+   * @param train_descriptors descriptors of the train image
+   * @param train_fv feature vector of the train image, obtained at the
+   *   same levelsup as query_fv
+   * @param matches (out) matches in ascending order of query index
+   */
+  template<class TFeatureVectorA, class TFeatureVectorB>
+  void match(const std::vector<TDescriptor> &query_descriptors,
+    const TFeatureVectorA &query_fv,
+    const std::vector<TDescriptor> &train_descriptors,
+    const TFeatureVectorB &train_fv,
+    std::vector<FeatureMatch> &matches) const;
+
+protected:
+
+  /// Features of the query and train images in a common node
+  typedef std::pair<FeatureIndices, FeatureIndices> NodePair;
+
+  /**
+   * Returns the feature indexes of a node of a FeatureVector
+   * @param f feature indexes
+   */
+  static inline FeatureIndices indices(const std::vector<unsigned int> &f);
+
+  /**
+   * Returns the feature indexes of a node of a FeatureVectorView
+   * @param f feature indexes
+   */
+  static inline FeatureIndices indices(const FeatureIndices &f);
+
+  /**
+   * Matches the features of a node
+   * @param query_descriptors descriptors of the query image
+   * @param train_descriptors descriptors of the train image
+   * @param node features of both images in the node
+   * @param matches (out) matches found are appended here
+   */
+  void matchNode(const std::vector<TDescriptor> &query_descriptors,
+    const std::vector<TDescriptor> &train_descriptors,
+    const NodePair &node, std::vector<FeatureMatch> &matches) const;
+
+  /**
+   * Keeps the closest match of each train feature
+   * @param matches (in/out) matches, sorted by query index on return
+   */
+  static void removeRepeatedTrain(std::vector<FeatureMatch> &matches);
+
+protected:
+
+  /// Ratio of the ratio test
+  double m_ratio;
+
+  /// Max distance of matches
+  double m_max_distance;
+
+  /// Train features can be matched only once
+  bool m_unique;
+
+};
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+TemplatedMatcher<TDescriptor, F>::TemplatedMatcher(double ratio,
+  double max_distance, bool unique)
+  : m_ratio(ratio), m_max_distance(max_distance), m_unique(unique)
+{
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline void TemplatedMatcher<TDescriptor, F>::setRatio(double ratio)
+{
+  m_ratio = ratio;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline double TemplatedMatcher<TDescriptor, F>::getRatio() const
+{
+  return m_ratio;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline void TemplatedMatcher<TDescriptor, F>::setMaxDistance(
+  double max_distance)
+{
+  m_max_distance = max_distance;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline double TemplatedMatcher<TDescriptor, F>::getMaxDistance() const
+{
+  return m_max_distance;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline void TemplatedMatcher<TDescriptor, F>::setUnique(bool unique)
+{
+  m_unique = unique;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline bool TemplatedMatcher<TDescriptor, F>::isUnique() const
+{
+  return m_unique;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline FeatureIndices TemplatedMatcher<TDescriptor, F>::indices(
+  const std::vector<unsigned int> &f)
+{
+  if(f.empty()) return FeatureIndices();
+  return FeatureIndices(&f[0], &f[0] + f.size());
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline FeatureIndices TemplatedMatcher<TDescriptor, F>::indices(
+  const FeatureIndices &f)
+{
+  return f;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+template<class TFeatureVectorA, class TFeatureVectorB>
+void TemplatedMatcher<TDescriptor, F>::match(
+  const std::vector<TDescriptor> &query_descriptors,
+  const TFeatureVectorA &query_fv,
+  const std::vector<TDescriptor> &train_descriptors,
+  const TFeatureVectorB &train_fv,
+  std::vector<FeatureMatch> &matches) const
+{
+  matches.resize(0);
+
+  // nodes in common, merging both vectors (sorted by node id)
+  std::vector<NodePair> nodes;
+
+  typename TFeatureVectorA::const_iterator ait = query_fv.begin();
+  typename TFeatureVectorB::const_iterator bit = train_fv.begin();
+
+  while(ait != query_fv.end() && bit != train_fv.end())
+  {
+    if(ait->first < bit->first) ++ait;
+    else if(bit->first < ait->first) ++bit;
+    else
+    {
+      nodes.push_back(NodePair(indices(ait->second), indices(bit->second)));
+      ++ait;
+      ++bit;
+    }
+  }
+
+  if(nodes.empty()) return;
+
+  // each feature belongs to a single node, so that nodes are independent
+  int nthreads = 1;
+#ifdef _OPENMP
+  nthreads = std::min(omp_get_max_threads(), (int)nodes.size());
+#endif
+
+  if(nthreads <= 1)
+  {
+    for(size_t i = 0; i < nodes.size(); ++i)
+      matchNode(query_descriptors, train_descriptors, nodes[i], matches);
+  }
+  else
+  {
+    std::vector<std::vector<FeatureMatch> > partial(nthreads);
+
+#ifdef _OPENMP
+    #pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+#endif
+    for(int i = 0; i < (int)nodes.size(); ++i)
+    {
+      int t = 0;
+#ifdef _OPENMP
+      t = omp_get_thread_num();
+#endif
+      matchNode(query_descriptors, train_descriptors, nodes[i], partial[t]);
+    }
+
+    for(int t = 0; t < nthreads; ++t)
+      matches.insert(matches.end(), partial[t].begin(), partial[t].end());
+  }
+
+  if(m_unique)
+    removeRepeatedTrain(matches);
+  else
+    std::sort(matches.begin(), matches.end(), FeatureMatch::ltQuery);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedMatcher<TDescriptor, F>::matchNode(
+  const std::vector<TDescriptor> &query_descriptors,
+  const std::vector<TDescriptor> &train_descriptors,
+  const NodePair &node, std::vector<FeatureMatch> &matches) const
+{
+  const FeatureIndices &qf = node.first;
+  const FeatureIndices &tf = node.second;
+
+  if(tf.empty()) return;
+
+  for(size_t i = 0; i < qf.size(); ++i)
+  {
+    const TDescriptor &q = query_descriptors[qf[i]];
+
+    double best = std::numeric_limits<double>::max();
+    double second = best;
+    unsigned int best_idx = 0;
+
+    for(size_t j = 0; j < tf.size(); ++j)
+    {
+      // distances >= second change neither the best nor the second best
+      const double d = 
+        BoundedDistance<F>::distance(q, train_descriptors[tf[j]], second);
+      if(d < best)
+      {
+        second = best;
+        best = d;
+        best_idx = tf[j];
+      }
+      else if(d < second)
+      {
+        second = d;
+      }
+    }
+
+    if(m_max_distance >= 0 && best > m_max_distance) continue;
+    if(m_ratio > 0 && tf.size() > 1 && !(best < m_ratio * second)) continue;
+
+    matches.push_back(FeatureMatch(qf[i], best_idx, best));
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedMatcher<TDescriptor, F>::removeRepeatedTrain(
+  std::vector<FeatureMatch> &matches)
+{
+  std::sort(matches.begin(), matches.end(), FeatureMatch::ltTrain);
+
+  // keep the first (closest) match of each train feature
+  std::vector<FeatureMatch>::iterator wit = matches.begin();
+  std::vector<FeatureMatch>::const_iterator mit;
+  for(mit = matches.begin(); mit != matches.end(); ++mit)
+  {
+    if(wit == matches.begin() || (wit - 1)->TrainIdx != mit->TrainIdx)
+      *wit++ = *mit;
+  }
+  matches.resize(wit - matches.begin());
+
+  std::sort(matches.begin(), matches.end(), FeatureMatch::ltQuery);
+}
+
+// --------------------------------------------------------------------------
+
+} // namespace DBoW2
+
+#endif
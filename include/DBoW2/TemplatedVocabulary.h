@@ -18,6 +18,7 @@
 #define __D_T_TEMPLATED_VOCABULARY__
 
 #include <cassert>
+#include <cmath>
 
 #include <vector>
 #include <numeric>
@@ -26,8 +27,11 @@
 #include <algorithm>
 #include <opencv2/core/core.hpp>
 #include <limits>
+#include <stdint.h>
 
+#include "FClass.h"
 #include "FeatureVector.h"
+#include "CompactFeatureVector.h"
 #include "BowVector.h"
 #include "ScoringObject.h"
 
@@ -37,6 +41,45 @@ using namespace std;
 
 namespace DBoW2 {
 
+/// Strategy to propagate the features down the tree when transforming them
+enum TransformEngine
+{
+  /// Descends the tree with one feature after another
+  FEATURE_AT_A_TIME,
+  /// Descends the tree with groups of features in lockstep, prefetching the
+  /// children of the node reached by a feature while computing the 
+  /// distances of the other features of the group, so that the latency of
+  /// the cache misses is hidden
+  INTERLEAVED
+};
+
+/// Algorithm to run k-means when creating the vocabulary
+enum KMeansAlgorithm
+{
+  /// Computes the distances from every descriptor to every cluster in each
+  /// iteration
+  LLOYD,
+  /// Keeps, for each descriptor, an upper bound of the distance to its 
+  /// cluster and a lower bound of the distance to the others, updated with
+  /// the triangle inequality as the clusters move, so that most of the 
+  /// distances are skipped in the later iterations (Hamerly, 2010). It 
+  /// obtains the same clusters as LLOYD
+  HAMERLY
+};
+
+/// Algorithm to choose the initial clusters of k-means
+enum KMeansSeeding
+{
+  /// k-means++: chooses the clusters one after another, with probability
+  /// proportional to the distance to the closest cluster chosen before
+  KMEANS_PP,
+  /// k-means|| (Bahmani et al., 2012): samples many candidates at once in 
+  /// a few rounds, and chooses the clusters by running k-means++ on the 
+  /// candidates weighted by the number of descriptors closest to them. 
+  /// It needs fewer passes over the descriptors than k-means++
+  KMEANS_PARALLEL
+};
+
 /// @param TDescriptor class of descriptor
 /// @param F class of descriptor functions
 template<class TDescriptor, class F>
@@ -114,6 +157,69 @@ public:
   virtual void create
     (const std::vector<std::vector<TDescriptor> > &training_features,
       int k, int L, WeightingType weighting, ScoringType scoring);
+  
+  /**
+   * Grows the vocabulary with new descriptors, without creating it again.
+   * The descriptors are quantized, and the words that receive more than 
+   * max_occupancy descriptors, or whose mean distance to them is greater
+   * than max_distortion, are split by running kmeans on their descriptors,
+   * so that their leaves get up to k children. Words with k descriptors or
+   * less are not split.
+   *
+   * The child closest to a split word keeps its word id, and the other
+   * children get new ids after the existing ones, so that the node and 
+   * word ids stored by databases remain valid (see 
+   * TemplatedDatabase::updateVocabulary). The idf of a child is the one of
+   * its word plus ln(Ni_word / Ni_child), with the numbers of images 
+   * estimated from the new features
+   * @param features new features of each image
+   * @param max_occupancy words with more descriptors than this are split
+   * @param max_distortion words whose mean distance to their descriptors
+   *   is greater than this are split
+   * @param split_words (out) if given, ids of the words that were split
+   * @return number of words added
+   */
+  unsigned int grow(const std::vector<std::vector<TDescriptor> > &features,
+    unsigned int max_occupancy, 
+    double max_distortion = std::numeric_limits<double>::max(),
+    std::vector<WordId> *split_words = NULL);
+  
+  /**
+   * Counts the descriptors that reach each word
+   * @param features features of each image
+   * @param occupancy (out) number of descriptors of each word
+   * @param Ni (out) if given, number of images where each word is present
+   */
+  void getOccupancy(const std::vector<std::vector<TDescriptor> > &features,
+    std::vector<unsigned int> &occupancy, 
+    std::vector<unsigned int> *Ni = NULL) const;
+  
+  /**
+   * Shrinks the vocabulary by removing the words that are rarely used. 
+   * The leaves with less than min_occupancy descriptors are removed, so 
+   * that their descriptors reach the closest sibling. If all the leaves of
+   * a node are rare, they are merged into it, and the node becomes a word
+   * that can be removed later at its own level. Nodes left with a single
+   * child are collapsed with it, since the child is always chosen. The 
+   * remaining nodes and words get consecutive ids in their former order.
+   *
+   * Each former word maps to the word whose node contains it now, or, if
+   * it was removed, to the word its descriptor reaches. Each former node 
+   * maps to itself or to its closest ancestor that remains. The maps can 
+   * be applied to databases with TemplatedDatabase::remapVocabulary. 
+   * Merged and collapsed nodes keep their own weight, since they are 
+   * reached by the same features as before, or take the minimum weight 
+   * of their words if the inner nodes have no weights
+   * @param occupancy number of descriptors of each word in representative
+   *   data (see getOccupancy)
+   * @param min_occupancy words with fewer descriptors are removed
+   * @param word_map (out) new id of each former word
+   * @param node_map (out) if given, new id of each former node
+   * @return number of words removed
+   */
+  unsigned int prune(const std::vector<unsigned int> &occupancy,
+    unsigned int min_occupancy, std::vector<WordId> &word_map,
+    std::vector<NodeId> *node_map = NULL);
 
   /**
    * Returns the number of words in the vocabulary
@@ -145,12 +251,79 @@ public:
   virtual void transform(const std::vector<TDescriptor>& features,
     BowVector &v, FeatureVector &fv, int levelsup) const;
 
+  /**
+   * Transform a set of descriptors into a bow vector and a feature vector
+   * stored in contiguous arrays, avoiding an allocation per node
+   * @param features
+   * @param v (out) bow vector
+   * @param fv (out) feature vector of nodes and feature indexes
+   * @param levelsup levels to go up the vocabulary tree to get the node index
+   */
+  virtual void transform(const std::vector<TDescriptor>& features,
+    BowVector &v, CompactFeatureVector &fv, int levelsup) const;
+
   /**
    * Transforms a single feature into a word (without weight)
    * @param feature
    * @return word id
    */
   virtual WordId transform(const TDescriptor& feature) const;
+
+  /**
+   * Transforms a single feature into a word, starting from a word that is
+   * expected to be close to the result (e.g. that of the feature it was
+   * tracked from). The descent restarts at the ancestor of the hint 
+   * "levelsup" levels up, after checking that the feature is closer to 
+   * each node of the path from the root to it than to their siblings. If 
+   * any check fails, the feature is transformed from the root, so the 
+   * result is always that of transform. Vocabularies with beam searches 
+   * always transform from the root
+   * @param feature
+   * @param hint expected word. If it is not a valid word id, the feature
+   *   is transformed from the root
+   * @param levelsup levels to go up from the hint to restart the descent
+   * @param weight (out) if given, word weight
+   * @return word id
+   */
+  WordId transformFromHint(const TDescriptor& feature, WordId hint, 
+    int levelsup = 1, WordValue *weight = NULL) const;
+
+  /**
+   * Transforms a set of features into a bow vector of the nodes of a
+   * level of the tree, descending only down to that level. The ids of the
+   * vector are node ids, weighted with the idf of the nodes (see
+   * setLevelWeights) as words are. Leaves above the level are used as
+   * they are. Beam searches and soft assignment are not used
+   * @param features
+   * @param level level of the nodes (the root is at level 0)
+   * @param v (out) bow vector of node ids
+   */
+  void transformLevel(const std::vector<TDescriptor>& features, int level,
+    BowVector &v) const;
+
+  /**
+   * Converts a bow vector of words into the bow vector of the nodes of a
+   * level that contain them, without the features. The result is the
+   * same as that of transformLevel with the features of the words (up to
+   * a scale factor if the scoring does not normalize vectors), provided
+   * that no feature was given to a stopped word
+   * @param words bow vector of words obtained with this vocabulary,
+   *   without soft assignment
+   * @param level level of the nodes (the root is at level 0)
+   * @param v (out) bow vector of node ids
+   */
+  void transformLevel(const BowVector &words, int level, BowVector &v) const;
+
+  /**
+   * Sets the weights of the nodes that are not words from the given
+   * images, so that they can be used by transformLevel. Vocabularies
+   * created by create already have them; others, created by older
+   * versions, have null weights there. The weights of the words do not
+   * change
+   * @param features features of each image
+   */
+  void setLevelWeights(
+    const std::vector<std::vector<TDescriptor> > &features);
   
   /**
    * Returns the score of two vectors
@@ -178,6 +351,17 @@ public:
    */
   void getWordsFromNode(NodeId nid, std::vector<WordId> &words) const;
   
+  /**
+   * Returns the range of word ids under the given node, if the words of 
+   * the node have consecutive ids. This is the case for all the nodes of
+   * vocabularies built by create whose leaves are all at the same level
+   * @param nid node id
+   * @param first (out) first word id
+   * @param last (out) word id after the last one
+   * @return true iff the words of the node are [first, last)
+   */
+  bool getWordRange(NodeId nid, WordId &first, WordId &last) const;
+  
   /**
    * Returns the branching factor of the tree (k)
    * @return k
@@ -233,6 +417,101 @@ public:
    * @param type new scoring type
    */
   void setScoringType(ScoringType type);
+  
+  /**
+   * Sets the strategy to propagate the features down the tree when 
+   * transforming sets of features. Both engines return the same words
+   * @param engine transform engine
+   * @param group_size number of features that descend in lockstep when
+   *   using INTERLEAVED (1..MAX_GROUP_SIZE)
+   */
+  void setTransformEngine(TransformEngine engine, int group_size = 8);
+  
+  /// Maximum number of features that descend in lockstep
+  static const int MAX_GROUP_SIZE = 64;
+  
+  /**
+   * Returns the transform engine in use
+   * @return transform engine
+   */
+  inline TransformEngine getTransformEngine() const 
+    { return m_transform_engine; }
+  
+  /**
+   * Sets the number of nodes expanded at each level when transforming 
+   * features. With a width of 1, features follow the closest child at each
+   * level. With wider beams, the beam_width closest nodes of each level 
+   * are expanded, and features get the closest leaf found, so that the 
+   * near-ties of the upper levels cause fewer wrong words. The distances
+   * computed grow linearly with the width. Beam searches are done feature
+   * by feature, whatever the transform engine
+   * @param beam_width nodes kept at each level (1..MAX_BEAM_WIDTH)
+   */
+  void setBeamWidth(int beam_width);
+  
+  /// Maximum number of nodes kept at each level by beam searches, and of 
+  /// words given to a feature by soft assignment
+  static const int MAX_BEAM_WIDTH = 64;
+  
+  /**
+   * Returns the number of nodes expanded at each level
+   * @return beam width
+   */
+  inline int getBeamWidth() const { return m_beam_width; }
+  
+  /**
+   * Sets the soft assignment of features to words. Each feature is given 
+   * to the nwords closest words found by the beam search, with weights
+   * proportional to exp(-d^2 / (2 sigma^2)) that add up to 1, where d is 
+   * the metric distance to each word (the square root of squared L2 
+   * distances). It only changes the vectors weighted with TF or TF_IDF;
+   * IDF and BINARY only record the presence of the closest word. Feature
+   * vectors get the node of the closest word
+   * @param nwords words per feature (1..MAX_BEAM_WIDTH); 1 disables soft 
+   *   assignment
+   * @param sigma scale of the distances, > 0
+   */
+  void setSoftAssignment(int nwords, double sigma = 1.);
+  
+  /**
+   * Returns the number of words given to each feature
+   * @return words per feature
+   */
+  inline int getSoftWords() const { return m_soft_words; }
+  
+  /**
+   * Returns the scale of the distances of the soft assignment
+   * @return sigma
+   */
+  inline double getSoftSigma() const { return m_soft_sigma; }
+  
+  /**
+   * Sets the k-means algorithm used by create
+   * @param algorithm k-means algorithm
+   */
+  inline void setKMeansAlgorithm(KMeansAlgorithm algorithm)
+    { m_kmeans_algorithm = algorithm; }
+  
+  /**
+   * Returns the k-means algorithm used by create
+   * @return k-means algorithm
+   */
+  inline KMeansAlgorithm getKMeansAlgorithm() const 
+    { return m_kmeans_algorithm; }
+  
+  /**
+   * Sets the algorithm to choose the initial clusters of k-means in create
+   * @param seeding seeding algorithm
+   */
+  inline void setKMeansSeeding(KMeansSeeding seeding)
+    { m_kmeans_seeding = seeding; }
+  
+  /**
+   * Returns the algorithm to choose the initial clusters of k-means
+   * @return seeding algorithm
+   */
+  inline KMeansSeeding getKMeansSeeding() const 
+    { return m_kmeans_seeding; }
 
   /**
    * Loads the vocabulary from a text file
@@ -288,6 +567,138 @@ public:
    */
   virtual int stopWords(double minWeight);
 
+  /// Memory of the words of the features of a sequence of images
+  /**
+   * Features tracked from an image to the next one often keep identical
+   * descriptors. The cache stores the word of each transformed descriptor
+   * in a table of fixed size indexed by its hash (see DescriptorHash), so
+   * that those descriptors are not quantized again. The rest can be 
+   * transformed from the word of the feature they were tracked from (see
+   * transformFromHint), if the caller gives it.
+   * 
+   * The words are the same that the vocabulary returns. Only the words 
+   * found from the root are cached, so that a cached word never depends 
+   * on a hint. The cache is not thread safe, and must be cleared if the
+   * vocabulary is modified. If the 
+   * vocabulary uses soft assignment, the bow vectors are obtained without
+   * the cache
+   */
+  class TransformCache
+  {
+  public:
+    
+    /**
+     * Creates a cache for a vocabulary, which must outlive the cache
+     * @param voc vocabulary
+     * @param capacity number of slots of the table
+     * @param hint_levelsup levels to go up from the hints
+     */
+    TransformCache(const TemplatedVocabulary &voc, 
+      unsigned int capacity = 4096, int hint_levelsup = 1);
+    
+    /**
+     * Transforms a single feature into a word, using the cache
+     * @param feature
+     * @param hint if a valid word id, expected word of the feature
+     * @param weight (out) if given, word weight
+     * @return word id
+     */
+    WordId transform(const TDescriptor &feature, 
+      WordId hint = std::numeric_limits<WordId>::max(), 
+      WordValue *weight = NULL);
+    
+    /**
+     * Transforms a set of features into a bow vector, as the transform 
+     * function of the vocabulary does
+     * @param features
+     * @param v (out) bow vector
+     * @param hints if given, expected word of each feature. Ids that are
+     *   not valid words mean no hint
+     * @param words (out) if given, word of each feature, which can be 
+     *   used as hints for the features tracked in the next image
+     */
+    void transform(const std::vector<TDescriptor> &features, BowVector &v,
+      const std::vector<WordId> *hints = NULL, 
+      std::vector<WordId> *words = NULL);
+    
+    /**
+     * Transforms a set of features into a bow vector and a feature vector
+     * @param features
+     * @param v (out) bow vector
+     * @param fv (out) feature vector of nodes and feature indexes
+     * @param levelsup levels to go up the vocabulary tree to get the node
+     *   index
+     * @param hints if given, expected word of each feature
+     * @param words (out) if given, word of each feature
+     */
+    void transform(const std::vector<TDescriptor> &features, BowVector &v,
+      FeatureVector &fv, int levelsup, 
+      const std::vector<WordId> *hints = NULL, 
+      std::vector<WordId> *words = NULL);
+    
+    /**
+     * Forgets the cached words and resets the counters
+     */
+    void clear();
+    
+    /**
+     * Returns the number of features found in the cache
+     * @return hits
+     */
+    inline unsigned int getHits() const { return m_hits; }
+    
+    /**
+     * Returns the number of features that were quantized
+     * @return misses
+     */
+    inline unsigned int getMisses() const { return m_misses; }
+    
+  protected:
+    
+    /**
+     * Transforms the features into words
+     * @param features
+     * @param hints if given, expected word of each feature
+     * @param ids (out) word of each feature
+     * @param weights (out) weight of the word of each feature
+     */
+    void transformFeatures(const std::vector<TDescriptor> &features, 
+      const std::vector<WordId> *hints, std::vector<WordId> &ids, 
+      std::vector<WordValue> &weights);
+    
+  protected:
+    
+    /// Slot of the table
+    struct Slot
+    {
+      /// Copy of the descriptor
+      TDescriptor descriptor;
+      /// Hash of the descriptor
+      size_t hash;
+      /// Word of the descriptor
+      WordId word_id;
+      /// Whether the slot holds a descriptor
+      bool used;
+      
+      Slot(): hash(0), word_id(0), used(false){}
+    };
+    
+    /// Vocabulary
+    const TemplatedVocabulary *m_voc;
+    
+    /// Table of descriptors, indexed by hash % size
+    std::vector<Slot> m_slots;
+    
+    /// Levels to go up from the hints
+    int m_hint_levelsup;
+    
+    /// Features found in the cache
+    unsigned int m_hits;
+    
+    /// Features quantized
+    unsigned int m_misses;
+  };
+
 protected:
 
   /// Pointer to descriptor
@@ -298,7 +709,9 @@ protected:
   {
     /// Node id
     NodeId id;
-    /// Weight if the node is a word
+    /// Weight of the node: its idf with IDF and TF_IDF, 1 otherwise. Inner
+    /// nodes have it since they were created or since setLevelWeights was
+    /// called, and 0 before (e.g. if loaded from an older vocabulary)
     WordValue weight;
     /// Children 
     vector<NodeId> children;
@@ -327,6 +740,24 @@ protected:
      */
     inline bool isLeaf() const { return children.empty(); }
   };
+  
+  /// Buffers reused by all the k-means steps when creating the tree, so 
+  /// that they do not allocate memory once they reach the size of the root
+  struct KMeansBuffers
+  {
+    /// Descriptors of a range or of a cluster
+    vector<pDescriptor> descriptors;
+    /// Descriptors of a range sorted by cluster
+    vector<pDescriptor> sorted;
+    /// Cluster of each descriptor of the range in this and the last 
+    /// iteration
+    vector<unsigned int> association, last_association;
+    /// Bounds of Hamerly's algorithm
+    vector<double> upper, lower;
+    /// Range [first, last) of the partitioned descriptors that reached 
+    /// each node
+    vector<std::pair<size_t, size_t> > ranges;
+  };
 
 protected:
 
@@ -361,21 +792,178 @@ protected:
    * @param id (out) word id
    */
   virtual void transform(const TDescriptor &feature, WordId &id) const;
-      
+
+  /**
+   * Transforms a set of descriptors into a bow vector and the nodes
+   * "levelsup" levels up of their words
+   * @param features
+   * @param v (out) bow vector
+   * @param nodes (out) <node id, feature index> of the features that were
+   *   not stopped, in feature order
+   * @param levelsup
+   */
+  void transformNodes(const std::vector<TDescriptor>& features,
+    BowVector &v, std::vector<std::pair<NodeId, unsigned int> > &nodes,
+    int levelsup) const;
+
+  /**
+   * Fills a bow vector with the words given to some features, weighting
+   * and normalizing it as transform does
+   * @param ids word of each feature
+   * @param weights weight of the word of each feature
+   * @param v (out) bow vector
+   * @param nids if given, node of each feature
+   * @param nodes (out) if given, <node id, feature index> of the features
+   *   that were not stopped, in feature order. nids must be given
+   */
+  void makeBowVector(const vector<WordId> &ids, 
+    const vector<WordValue> &weights, BowVector &v, 
+    const vector<NodeId> *nids = NULL, 
+    std::vector<std::pair<NodeId, unsigned int> > *nodes = NULL) const;
+  
+  /**
+   * Returns the word ids associated to a set of features, with the 
+   * transform engine in use
+   * @param features
+   * @param ids (out) word id of each feature
+   * @param weights (out) word weight of each feature
+   * @param nids (out) if given, id of the node "levelsup" levels up of 
+   *   each feature
+   * @param levelsup
+   */
+  void transformFeatures(const std::vector<TDescriptor>& features,
+    std::vector<WordId> &ids, std::vector<WordValue> &weights, 
+    std::vector<NodeId> *nids = NULL, int levelsup = 0) const;
+  
+  /**
+   * Returns the word ids associated to a group of features by descending
+   * the tree with all of them in lockstep
+   * @param features first feature of the group
+   * @param n number of features in the group (<= m_group_size)
+   * @param ids (out) n word ids
+   * @param weights (out) n word weights
+   * @param nids (out) if given, n ids of the nodes "levelsup" levels up
+   * @param levelsup
+   */
+  void transformGroup(const TDescriptor *features, int n, WordId *ids, 
+    WordValue *weights, NodeId *nids, int levelsup) const;
+  
+  /**
+   * Returns the closest words to a feature found by a beam search that
+   * expands the m_beam_width closest nodes of each level
+   * @param feature
+   * @param n max number of words to return (1..MAX_BEAM_WIDTH)
+   * @param ids (out) ids of the closest words found, the closest first
+   * @param weights (out) weights of those words
+   * @param distances (out) distances from the feature to those words
+   * @param nid (out) if given, id of the node "levelsup" levels up of the
+   *   closest word
+   * @param levelsup
+   * @return number of words returned (1..n)
+   */
+  int transformBeam(const TDescriptor &feature, int n, WordId *ids, 
+    WordValue *weights, double *distances, NodeId *nid = NULL, 
+    int levelsup = 0) const;
+  
+  /**
+   * Adds the soft assignment of a feature to a bow vector
+   * @param feature
+   * @param v (in/out) bow vector
+   * @param nid (out) if given, id of the node "levelsup" levels up of the
+   *   closest word
+   * @param levelsup
+   * @return weight of the closest word (0 if it is stopped)
+   */
+  WordValue addSoftWords(const TDescriptor &feature, BowVector &v,
+    NodeId *nid = NULL, int levelsup = 0) const;
+  
+  /**
+   * Prefetches the children of a node and their descriptors
+   * @param nid node id
+   */
+  inline void prefetchChildren(NodeId nid) const;
+  
+  /**
+   * Prefetches the data of a descriptor
+   * @param d descriptor
+   */
+  template<class T>
+  static inline void prefetch(const T &d);
+  template<class T>
+  static inline void prefetch(const std::vector<T> &d);
+  static inline void prefetch(const cv::Mat &d);
+  
+  /**
+   * Prefetches a memory region for reading, if the compiler supports it
+   * @param p address
+   * @param bytes size of the region
+   */
+  static inline void prefetch(const void *p, size_t bytes);
+
   /**
    * Creates a level in the tree, under the parent, by running kmeans with
-   * a descriptor set, and recursively creates the subsequent levels too
+   * a descriptor set, and recursively creates the subsequent levels too.
+   * The range of descriptors is partitioned in place so that the 
+   * descriptors of each child become contiguous
    * @param parent_id id of parent node
-   * @param descriptors descriptors to run the kmeans on
+   * @param descriptors (in/out) all the training descriptors
+   * @param begin first descriptor to run the kmeans on
+   * @param end descriptor after the last one to run the kmeans on
    * @param current_level current level in the tree
+   * @param buffers buffers shared by all the steps
+   */
+  void HKmeansStep(NodeId parent_id, vector<pDescriptor> &descriptors, 
+    size_t begin, size_t end, int current_level, KMeansBuffers &buffers);
+  
+  /**
+   * Sorts descriptors by cluster, keeping their order within each cluster
+   * @param descriptors descriptors
+   * @param n number of descriptors
+   * @param k number of clusters
+   * @param association cluster of each descriptor
+   * @param sorted (out) descriptors sorted by cluster
+   * @param offsets (out) the descriptors of cluster c are 
+   *   sorted[offsets[c] .. offsets[c+1]-1]
+   */
+  static void partition(const pDescriptor *descriptors, size_t n, 
+    unsigned int k, const vector<unsigned int> &association, 
+    vector<pDescriptor> &sorted, vector<size_t> &offsets);
+  
+  /**
+   * Associates the descriptors with their closest clusters by updating the
+   * bounds of their distances (Hamerly's algorithm) and computing only the
+   * distances that the bounds cannot discard
+   * @param descriptors descriptors to associate
+   * @param n number of descriptors
+   * @param clusters current clusters
+   * @param last_clusters clusters of the previous iteration, or empty if
+   *   this is the first one
+   * @param association (in/out) cluster of each descriptor
+   * @param upper (in/out) upper bound of the distance from each descriptor
+   *   to its cluster
+   * @param lower (in/out) lower bound of the distance from each descriptor
+   *   to the other clusters
    */
-  void HKmeansStep(NodeId parent_id, const vector<pDescriptor> &descriptors, 
-    int current_level);
+  void associateHamerly(const pDescriptor *descriptors, size_t n,
+    const vector<TDescriptor> &clusters, 
+    const vector<TDescriptor> &last_clusters,
+    vector<unsigned int> &association, 
+    vector<double> &upper, vector<double> &lower) const;
+  
+  /**
+   * Converts a distance given by F into a metric, for which the triangle 
+   * inequality holds (squared L2 distances are square-rooted)
+   * @param distance distance given by F
+   * @return metric distance
+   */
+  static inline double metric(double distance)
+    { return (IsDenseL2<F>::value ? std::sqrt(distance) : distance); }
 
   /**
    * Creates k clusters from the given descriptors with some seeding algorithm.
-   * @note In this class, kmeans++ is used, but this function should be
-   *   overriden by inherited classes.
+   * @note In this class, kmeans++ or k-means|| is used, according to 
+   *   m_kmeans_seeding, but this function should be overriden by inherited 
+   *   classes.
    */
   virtual void initiateClusters(const vector<pDescriptor> &descriptors,
     vector<TDescriptor> &clusters) const;
@@ -389,19 +977,104 @@ protected:
   void initiateClustersKMpp(const vector<pDescriptor> &descriptors, 
     vector<TDescriptor> &clusters) const;
   
+  /**
+   * Creates k clusters from the given descriptor sets with the k-means||
+   * seeding algorithm
+   * @param descriptors 
+   * @param clusters resulting clusters
+   */
+  void initiateClustersKMParallel(const vector<pDescriptor> &descriptors, 
+    vector<TDescriptor> &clusters) const;
+  
+  /**
+   * Updates the distance from each descriptor to its closest center with
+   * some new centers, in parallel if OpenMP is available. The descriptors
+   * are split into blocks of SEEDING_BLOCK items, whose sums of distances
+   * are returned too
+   * @param descriptors
+   * @param centers new centers
+   * @param ncenters number of new centers
+   * @param first_center index of the first new center
+   * @param min_dists (in/out) distance from each descriptor to its closest
+   *   center
+   * @param closest (in/out) if given, index of the closest center of each 
+   *   descriptor
+   * @param block_sums (out) sum of min_dists in each block
+   */
+  void updateSeedingDistances(const vector<pDescriptor> &descriptors,
+    const pDescriptor *centers, unsigned int ncenters, 
+    unsigned int first_center, vector<double> &min_dists, 
+    vector<unsigned int> *closest, vector<double> &block_sums) const;
+  
+  /**
+   * Samples a descriptor with probability proportional to its distance
+   * @param min_dists distance of each descriptor
+   * @param block_sums sum of min_dists in each block of SEEDING_BLOCK items
+   * @param cut_d value in (0, sum of distances]
+   * @return index of the first descriptor whose accumulated distance 
+   *   reaches cut_d
+   */
+  static size_t sampleSeed(const vector<double> &min_dists, 
+    const vector<double> &block_sums, double cut_d);
+  
   /**
    * Create the words of the vocabulary once the tree has been built
    */
   void createWords();
   
+  /**
+   * Links the words to their leaves according to the word ids stored in 
+   * the nodes, which are not in node order if the vocabulary has grown
+   */
+  void linkWords();
+  
+  /**
+   * Creates the tables of words in depth-first order and of the paths from
+   * the root to each word, once the nodes and the words are created. Node 
+   * and word ids are not modified, since databases store them
+   */
+  void createNodeTables();
+  
   /**
    * Sets the weights of the nodes of tree according to the given features.
    * Before calling this function, the nodes and the words must be already
-   * created (by calling HKmeansStep and createWords)
+   * created (by calling HKmeansStep and createWords). The features are 
+   * transformed again (see countNodeImages)
    * @param features
    */
   void setNodeWeights(const vector<vector<TDescriptor> > &features);
   
+  /**
+   * Sets the weights of the nodes of tree according to the words the 
+   * training features reached when the tree was created by HKmeansStep,
+   * without transforming them again
+   * @param features training features of each image
+   * @param descriptors training descriptors, as partitioned by HKmeansStep
+   * @param ranges range of descriptors of each node
+   */
+  void setNodeWeights(const vector<vector<TDescriptor> > &features,
+    const vector<pDescriptor> &descriptors, 
+    const vector<std::pair<size_t, size_t> > &ranges);
+  
+  /**
+   * Counts the images that reach each node of the tree by transforming
+   * their features, in parallel if OpenMP is available
+   * @param features features of each image
+   * @param Ni (out) number of images of each node, by node id
+   */
+  void countNodeImages(const vector<vector<TDescriptor> > &features,
+    vector<unsigned int> &Ni) const;
+
+  /**
+   * Sets the weights of the nodes from their document frequencies
+   * @param Ni number of images in which each node appears, by node id.
+   *   Not used if the weighting does not need idf
+   * @param NDocs number of images
+   * @param words whether the weights of the words are set too
+   */
+  void setWeights(const vector<unsigned int> &Ni, unsigned int NDocs,
+    bool words = true);
+  
 protected:
 
   /// Branching factor
@@ -419,6 +1092,24 @@ protected:
   /// Object for computing scores
   GeneralScoring* m_scoring_object;
   
+  /// Strategy to transform sets of features
+  TransformEngine m_transform_engine;
+  
+  /// Number of features that descend together with INTERLEAVED
+  int m_group_size;
+  
+  /// Nodes expanded at each level when transforming features
+  int m_beam_width;
+  
+  /// Words given to each feature by soft assignment
+  int m_soft_words;
+  
+  /// Scale of the distances of the soft assignment
+  double m_soft_sigma;
+  
+  /// K-means algorithm used by create
+  KMeansAlgorithm m_kmeans_algorithm;
+  
   /// Tree nodes
   std::vector<Node> m_nodes;
   
@@ -426,6 +1117,34 @@ protected:
   /// this condition holds: m_words[wid]->word_id == wid
   std::vector<Node*> m_words;
   
+  /// Word ids in depth-first order of the tree
+  std::vector<WordId> m_dfs_words;
+  
+  /// Words under each node: m_dfs_words[first .. last-1]
+  std::vector<std::pair<unsigned int, unsigned int> > m_node_words;
+  
+  /// Whether the words under each node have consecutive ids
+  std::vector<bool> m_node_contiguous;
+  
+  /// K-means seeding algorithm used by create
+  KMeansSeeding m_kmeans_seeding;
+  
+  /// Number of descriptors per block when seeding the clusters
+  static const unsigned int SEEDING_BLOCK = 4096;
+  
+  /// Number of sampling rounds of k-means||
+  static const int SEEDING_ROUNDS = 5;
+  
+  /// Node ids from the root to each word, m_path_length items per word.
+  /// m_word_paths[wid * m_path_length + d] is the node at depth d
+  std::vector<NodeId> m_word_paths;
+  
+  /// Depth of each word
+  std::vector<unsigned char> m_word_depths;
+  
+  /// Max depth of the words + 1
+  int m_path_length;
+  
 };
 
 // --------------------------------------------------------------------------
@@ -434,7 +1153,9 @@ template<class TDescriptor, class F>
 TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
   (int k, int L, WeightingType weighting, ScoringType scoring)
   : m_k(k), m_L(L), m_weighting(weighting), m_scoring(scoring),
-  m_scoring_object(NULL)
+  m_scoring_object(NULL), m_transform_engine(FEATURE_AT_A_TIME),
+  m_group_size(8), m_beam_width(1), m_soft_words(1), m_soft_sigma(1.),
+  m_kmeans_algorithm(LLOYD), m_kmeans_seeding(KMEANS_PP), m_path_length(0)
 {
   createScoringObject();
 }
@@ -443,7 +1164,11 @@ TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
 
 template<class TDescriptor, class F>
 TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
-  (const std::string &filename): m_scoring_object(NULL)
+  (const std::string &filename): m_scoring_object(NULL),
+  m_transform_engine(FEATURE_AT_A_TIME), m_group_size(8), 
+  m_beam_width(1), m_soft_words(1), m_soft_sigma(1.),
+  m_kmeans_algorithm(LLOYD), 
+  m_kmeans_seeding(KMEANS_PP), m_path_length(0)
 {
   load(filename);
 }
@@ -452,7 +1177,11 @@ TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
 
 template<class TDescriptor, class F>
 TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary
-  (const char *filename): m_scoring_object(NULL)
+  (const char *filename): m_scoring_object(NULL),
+  m_transform_engine(FEATURE_AT_A_TIME), m_group_size(8), 
+  m_beam_width(1), m_soft_words(1), m_soft_sigma(1.),
+  m_kmeans_algorithm(LLOYD), 
+  m_kmeans_seeding(KMEANS_PP), m_path_length(0)
 {
   load(filename);
 }
@@ -513,10 +1242,43 @@ void TemplatedVocabulary<TDescriptor,F>::setWeightingType(WeightingType type)
 
 // --------------------------------------------------------------------------
 
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::setTransformEngine
+  (TransformEngine engine, int group_size)
+{
+  m_transform_engine = engine;
+  m_group_size = std::max(1, std::min(group_size, (int)MAX_GROUP_SIZE));
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::setBeamWidth(int beam_width)
+{
+  m_beam_width = std::max(1, std::min(beam_width, (int)MAX_BEAM_WIDTH));
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::setSoftAssignment(int nwords, 
+  double sigma)
+{
+  if(sigma <= 0) 
+    throw std::string("The sigma of the soft assignment must be positive");
+  
+  m_soft_words = std::max(1, std::min(nwords, (int)MAX_BEAM_WIDTH));
+  m_soft_sigma = sigma;
+}
+
+// --------------------------------------------------------------------------
+
 template<class TDescriptor, class F>
 TemplatedVocabulary<TDescriptor,F>::TemplatedVocabulary(
   const TemplatedVocabulary<TDescriptor, F> &voc)
-  : m_scoring_object(NULL)
+  : m_scoring_object(NULL), m_transform_engine(FEATURE_AT_A_TIME),
+  m_group_size(8), m_beam_width(1), m_soft_words(1), m_soft_sigma(1.),
+  m_kmeans_algorithm(LLOYD), m_kmeans_seeding(KMEANS_PP), m_path_length(0)
 {
   *this = voc;
 }
@@ -540,6 +1302,13 @@ TemplatedVocabulary<TDescriptor,F>::operator=
   this->m_L = voc.m_L;
   this->m_scoring = voc.m_scoring;
   this->m_weighting = voc.m_weighting;
+  this->m_transform_engine = voc.m_transform_engine;
+  this->m_group_size = voc.m_group_size;
+  this->m_beam_width = voc.m_beam_width;
+  this->m_soft_words = voc.m_soft_words;
+  this->m_soft_sigma = voc.m_soft_sigma;
+  this->m_kmeans_algorithm = voc.m_kmeans_algorithm;
+  this->m_kmeans_seeding = voc.m_kmeans_seeding;
 
   this->createScoringObject();
   
@@ -547,7 +1316,8 @@ TemplatedVocabulary<TDescriptor,F>::operator=
   this->m_words.clear();
   
   this->m_nodes = voc.m_nodes;
-  this->createWords();
+  this->linkWords();
+  this->createNodeTables();
   
   return *this;
 }
@@ -576,13 +1346,17 @@ void TemplatedVocabulary<TDescriptor,F>::create(
   m_nodes.push_back(Node(0)); // root
   
   // create the tree
-  HKmeansStep(0, features, 1);
+  KMeansBuffers buffers;
+  buffers.ranges.push_back(std::make_pair((size_t)0, features.size()));
+  HKmeansStep(0, features, 0, features.size(), 1, buffers);
 
   // create the words
   createWords();
+  createNodeTables();
 
-  // and set the weight of each node of the tree
-  setNodeWeights(training_features);
+  // and set the weight of each node of the tree with the words reached by
+  // the training features
+  setNodeWeights(training_features, features, buffers.ranges);
   
 }
 
@@ -618,55 +1392,392 @@ void TemplatedVocabulary<TDescriptor,F>::create(
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-void TemplatedVocabulary<TDescriptor,F>::getFeatures(
-  const vector<vector<TDescriptor> > &training_features, 
-  vector<pDescriptor> &features) const
+unsigned int TemplatedVocabulary<TDescriptor,F>::grow(
+  const std::vector<std::vector<TDescriptor> > &features,
+  unsigned int max_occupancy, double max_distortion, 
+  std::vector<WordId> *split_words)
 {
-  features.resize(0);
+  if(split_words) split_words->clear();
+  
+  const WordId NWords = m_words.size();
+  if(NWords == 0) return 0;
+  
+  // 1. quantize the new descriptors, measuring the occupancy, distortion
+  // and number of images of each word
+  vector<pDescriptor> descriptors;
+  vector<unsigned int> words;
+  vector<unsigned int> occupancy(NWords, 0), Ni(NWords, 0);
+  vector<double> distortion(NWords, 0.);
+  vector<WordId> ids;
+  vector<WordValue> weights;
   
   typename vector<vector<TDescriptor> >::const_iterator vvit;
-  typename vector<TDescriptor>::const_iterator vit;
-  for(vvit = training_features.begin(); vvit != training_features.end(); ++vvit)
+  for(vvit = features.begin(); vvit != features.end(); ++vvit)
   {
-    features.reserve(features.size() + vvit->size());
-    for(vit = vvit->begin(); vit != vvit->end(); ++vit)
+    transformFeatures(*vvit, ids, weights);
+    
+    for(size_t i = 0; i < ids.size(); ++i)
     {
-      features.push_back(&(*vit));
+      const WordId wid = ids[i];
+      descriptors.push_back(&(*vvit)[i]);
+      words.push_back(wid);
+      occupancy[wid]++;
+      distortion[wid] += F::distance((*vvit)[i], m_words[wid]->descriptor);
     }
+    
+    std::sort(ids.begin(), ids.end());
+    vector<WordId>::const_iterator wit, wend = 
+      std::unique(ids.begin(), ids.end());
+    for(wit = ids.begin(); wit != wend; ++wit) Ni[*wit]++;
   }
-}
-
-// --------------------------------------------------------------------------
-
-template<class TDescriptor, class F>
-void TemplatedVocabulary<TDescriptor,F>::HKmeansStep(NodeId parent_id, 
-  const vector<pDescriptor> &descriptors, int current_level)
-{
-  if(descriptors.empty()) return;
-        
-  // features associated to each cluster
-  vector<TDescriptor> clusters;
-	vector<vector<unsigned int> > groups; // groups[i] = [j1, j2, ...]
-	// j1, j2, ... indices of descriptors associated to cluster i
-
-  clusters.reserve(m_k);
-	groups.reserve(m_k);
   
-  //const int msizes[] = { m_k, descriptors.size() };
-  //cv::SparseMat assoc(2, msizes, CV_8U);
-  //cv::SparseMat last_assoc(2, msizes, CV_8U);  
-  //// assoc.row(cluster_idx).col(descriptor_idx) = 1 iif associated
+  if(descriptors.empty()) return 0;
   
-  if((int)descriptors.size() <= m_k)
+  // 2. make the descriptors of each word contiguous
+  vector<pDescriptor> sorted;
+  vector<size_t> offsets;
+  partition(&descriptors[0], descriptors.size(), NWords, words, sorted, 
+    offsets);
+  
+  // the leaves are found by id, since adding nodes invalidates m_words
+  vector<NodeId> leaves(NWords);
+  for(WordId w = 0; w < NWords; ++w) leaves[w] = m_words[w]->id;
+  
+  // 3. split the leaves with kmeans, without going further down
+  KMeansBuffers buffers;
+  vector<WordId> split;
+  WordId next_id = NWords;
+  
+  for(WordId w = 0; w < NWords; ++w)
   {
-    // trivial case: one cluster per feature
-    groups.resize(descriptors.size());
+    const unsigned int n = occupancy[w];
+    if((int)n <= m_k || 
+      (n <= max_occupancy && distortion[w] / n <= max_distortion)) continue;
+    
+    const NodeId nid = leaves[w];
+    const size_t nnodes = m_nodes.size();
+    
+    HKmeansStep(nid, sorted, offsets[w], offsets[w+1], m_L, buffers);
+    
+    const vector<NodeId> &children = m_nodes[nid].children;
+    
+    // all the descriptors may be equal
+    if(children.size() < 2)
+    {
+      m_nodes.resize(nnodes);
+      m_nodes[nid].children.clear();
+      continue;
+    }
+    
+    NodeId heir = children[0];
+    double best_d = F::distance(m_nodes[heir].descriptor, 
+      m_nodes[nid].descriptor);
+    for(size_t c = 1; c < children.size(); ++c)
+    {
+      double d = BoundedDistance<F>::distance(m_nodes[children[c]].descriptor,
+        m_nodes[nid].descriptor, best_d);
+      if(d < best_d)
+      {
+        best_d = d;
+        heir = children[c];
+      }
+    }
+    
+    for(size_t c = 0; c < children.size(); ++c)
+    {
+      m_nodes[children[c]].word_id = (children[c] == heir ? w : next_id++);
+    }
+    
+    split.push_back(w);
+  }
+  
+  if(split.empty()) return 0;
+  
+  linkWords();
+  createNodeTables();
+  
+  // 4. weight the new words
+  vector<unsigned int> Ni_new;
+  if(m_weighting == IDF || m_weighting == TF_IDF)
+  {
+    Ni_new.resize(m_words.size(), 0);
+    for(vvit = features.begin(); vvit != features.end(); ++vvit)
+    {
+      transformFeatures(*vvit, ids, weights);
+      
+      std::sort(ids.begin(), ids.end());
+      vector<WordId>::const_iterator wit, wend = 
+        std::unique(ids.begin(), ids.end());
+      for(wit = ids.begin(); wit != wend; ++wit) Ni_new[*wit]++;
+    }
+  }
+  
+  vector<WordId>::const_iterator sit;
+  for(sit = split.begin(); sit != split.end(); ++sit)
+  {
+    const Node &parent = m_nodes[leaves[*sit]];
+    
+    vector<NodeId>::const_iterator cit;
+    for(cit = parent.children.begin(); cit != parent.children.end(); ++cit)
+    {
+      Node &child = m_nodes[*cit];
+      
+      if(m_weighting == IDF || m_weighting == TF_IDF)
+      {
+        // ln(N/Ni_child) = ln(N/Ni_word) + ln(Ni_word/Ni_child)
+        child.weight = parent.weight + log((double)Ni[*sit] / 
+          (double)std::max(Ni_new[child.word_id], 1u));
+      }
+      else
+        child.weight = 1;
+    }
+  }
+  
+  if(split_words) *split_words = split;
+  
+  return next_id - NWords;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::getOccupancy(
+  const std::vector<std::vector<TDescriptor> > &features,
+  std::vector<unsigned int> &occupancy, std::vector<unsigned int> *Ni) const
+{
+  occupancy.assign(m_words.size(), 0);
+  if(Ni) Ni->assign(m_words.size(), 0);
+  
+  if(empty()) return;
+  
+  vector<WordId> ids;
+  vector<WordValue> weights;
+  
+  typename vector<vector<TDescriptor> >::const_iterator vvit;
+  for(vvit = features.begin(); vvit != features.end(); ++vvit)
+  {
+    transformFeatures(*vvit, ids, weights);
+    
+    vector<WordId>::const_iterator wit;
+    for(wit = ids.begin(); wit != ids.end(); ++wit) occupancy[*wit]++;
+    
+    if(Ni)
+    {
+      std::sort(ids.begin(), ids.end());
+      vector<WordId>::const_iterator wend = std::unique(ids.begin(), ids.end());
+      for(wit = ids.begin(); wit != wend; ++wit) (*Ni)[*wit]++;
+    }
+  }
+}
 
-    for(unsigned int i = 0; i < descriptors.size(); i++)
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+unsigned int TemplatedVocabulary<TDescriptor,F>::prune(
+  const std::vector<unsigned int> &occupancy, unsigned int min_occupancy,
+  std::vector<WordId> &word_map, std::vector<NodeId> *node_map)
+{
+  const WordId NWords = m_words.size();
+  const NodeId NNodes = m_nodes.size();
+  
+  word_map.resize(0);
+  if(node_map) node_map->resize(0);
+  
+  if(NWords == 0) return 0;
+  if(occupancy.size() != NWords)
+    throw std::string("The occupancy must have one item per word");
+  
+  vector<NodeId> word_nodes(NWords);
+  vector<NodeId> parents(NNodes, 0);
+  vector<unsigned int> occ(NNodes, 0);
+  vector<bool> kept(NNodes, true);
+  
+  for(WordId w = 0; w < NWords; ++w)
+  {
+    word_nodes[w] = m_words[w]->id;
+    occ[word_nodes[w]] = occupancy[w];
+  }
+  for(NodeId nid = 1; nid < NNodes; ++nid) parents[nid] = m_nodes[nid].parent;
+  
+  // inner nodes have no weights in vocabularies saved before they were 
+  // computed, and all of them are 0 then (a single one can be 0 if all
+  // the images reach it)
+  bool node_weights = false;
+  for(NodeId nid = 1; nid < NNodes && !node_weights; ++nid)
+    node_weights = (!m_nodes[nid].isLeaf() && m_nodes[nid].weight > 0);
+  
+  // 1. nodes are created after their parents, so that going through the 
+  // ids backwards visits the children of a node before the node
+  vector<NodeId> remaining;
+  for(NodeId nid = NNodes; nid-- > 0; )
+  {
+    Node &node = m_nodes[nid];
+    if(node.isLeaf()) continue;
+    
+    remaining.resize(0);
+    vector<NodeId>::const_iterator cit;
+    for(cit = node.children.begin(); cit != node.children.end(); ++cit)
     {
-      groups[i].push_back(i);
-      clusters.push_back(*descriptors[i]);
+      occ[nid] += occ[*cit];
+      if(!m_nodes[*cit].isLeaf() || occ[*cit] >= min_occupancy)
+        remaining.push_back(*cit);
     }
+    
+    if(remaining.empty() && nid != 0)
+    {
+      // merge the words into this node, which keeps its own weight since
+      // it is reached by the features of all of them. Without one, it 
+      // takes the lowest weight of the words
+      if(!node_weights) node.weight = m_nodes[node.children[0]].weight;
+      node.word_id = m_nodes[node.children[0]].word_id;
+      for(cit = node.children.begin(); cit != node.children.end(); ++cit)
+      {
+        if(!node_weights) 
+          node.weight = std::min(node.weight, m_nodes[*cit].weight);
+        node.word_id = std::min(node.word_id, m_nodes[*cit].word_id);
+        kept[*cit] = false;
+      }
+      node.children.clear();
+      continue;
+    }
+    
+    if(remaining.empty())
+    {
+      // the root keeps its most used word
+      NodeId best = node.children[0];
+      for(cit = node.children.begin(); cit != node.children.end(); ++cit)
+        if(occ[*cit] > occ[best]) best = *cit;
+      remaining.push_back(best);
+    }
+    
+    for(cit = node.children.begin(); cit != node.children.end(); ++cit)
+      if(std::find(remaining.begin(), remaining.end(), *cit) == 
+        remaining.end()) kept[*cit] = false;
+    
+    node.children = remaining;
+    
+    if(node.children.size() == 1 && nid != 0)
+    {
+      // collapse the chain, keeping the descriptor and the weight of this
+      // node, since the child now gets all its features
+      Node &child = m_nodes[node.children[0]];
+      kept[child.id] = false;
+      if(!node_weights) node.weight = child.weight;
+      node.word_id = child.word_id;
+      node.children.swap(child.children);
+      for(cit = node.children.begin(); cit != node.children.end(); ++cit)
+        m_nodes[*cit].parent = nid;
+    }
+  }
+  
+  // 2. new ids of the nodes, and of the words in their former order
+  vector<NodeId> nmap(NNodes, 0);
+  vector<std::pair<WordId, NodeId> > leaves;
+  NodeId next_id = 0;
+  for(NodeId nid = 0; nid < NNodes; ++nid)
+  {
+    if(kept[nid])
+    {
+      nmap[nid] = next_id++;
+      if(nid != 0 && m_nodes[nid].isLeaf()) 
+        leaves.push_back(std::make_pair(m_nodes[nid].word_id, nid));
+    }
+    else
+      nmap[nid] = nmap[parents[nid]];
+  }
+  
+  std::sort(leaves.begin(), leaves.end());
+  for(WordId w = 0; w < leaves.size(); ++w)
+    m_nodes[leaves[w].second].word_id = w;
+  
+  // 3. move the nodes that remain
+  vector<Node> nodes;
+  nodes.swap(m_nodes);
+  m_nodes.reserve(next_id);
+  
+  for(NodeId nid = 0; nid < NNodes; ++nid)
+  {
+    if(!kept[nid]) continue;
+    
+    m_nodes.push_back(nodes[nid]);
+    Node &node = m_nodes.back();
+    node.id = nmap[nid];
+    node.parent = nmap[node.parent];
+    
+    vector<NodeId>::iterator cit;
+    for(cit = node.children.begin(); cit != node.children.end(); ++cit)
+      *cit = nmap[*cit];
+  }
+  
+  linkWords();
+  createNodeTables();
+  
+  // 4. removed words map to the word their descriptor reaches now
+  word_map.resize(NWords);
+  for(WordId w = 0; w < NWords; ++w)
+  {
+    const Node &node = m_nodes[nmap[word_nodes[w]]];
+    if(node.isLeaf()) 
+      word_map[w] = node.word_id;
+    else
+      transform(nodes[word_nodes[w]].descriptor, word_map[w]);
+  }
+  
+  if(node_map) node_map->swap(nmap);
+  
+  return NWords - m_words.size();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::getFeatures(
+  const vector<vector<TDescriptor> > &training_features, 
+  vector<pDescriptor> &features) const
+{
+  features.resize(0);
+  
+  typename vector<vector<TDescriptor> >::const_iterator vvit;
+  typename vector<TDescriptor>::const_iterator vit;
+  for(vvit = training_features.begin(); vvit != training_features.end(); ++vvit)
+  {
+    features.reserve(features.size() + vvit->size());
+    for(vit = vvit->begin(); vit != vvit->end(); ++vit)
+    {
+      features.push_back(&(*vit));
+    }
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::HKmeansStep(NodeId parent_id, 
+  vector<pDescriptor> &descriptors, size_t begin, size_t end, 
+  int current_level, KMeansBuffers &buffers)
+{
+  if(begin >= end) return;
+  
+  const size_t n = end - begin;
+  const pDescriptor *range = &descriptors[begin];
+        
+  // cluster centres. Once the range is partitioned, the descriptors of 
+  // cluster i are descriptors[begin + offsets[i] .. begin + offsets[i+1]-1]
+  vector<TDescriptor> clusters;
+  vector<size_t> offsets;
+
+  clusters.reserve(m_k);
+  offsets.reserve(m_k + 1);
+  
+  if((int)n <= m_k)
+  {
+    // trivial case: one cluster per feature
+    for(size_t i = 0; i < n; i++)
+    {
+      clusters.push_back(*range[i]);
+      offsets.push_back(i);
+    }
+    offsets.push_back(n);
   }
   else
   {
@@ -676,78 +1787,75 @@ void TemplatedVocabulary<TDescriptor,F>::HKmeansStep(NodeId parent_id,
     bool goon = true;
     
     // to check if clusters move after iterations
-    vector<int> last_association, current_association;
+    vector<unsigned int> &association = buffers.association;
+    vector<unsigned int> &last_association = buffers.last_association;
+    association.resize(n);
+    
+    // Hamerly's algorithm
+    vector<TDescriptor> last_clusters;
 
     while(goon)
     {
       // 1. Calculate clusters
 
-			if(first_time)
-			{
+      if(first_time)
+      {
         // random sample 
-        initiateClusters(descriptors, clusters);
+        buffers.descriptors.assign(range, range + n);
+        initiateClusters(buffers.descriptors, clusters);
       }
       else
       {
         // calculate cluster centres
 
+        if(m_kmeans_algorithm == HAMERLY) last_clusters = clusters;
+        
+        partition(range, n, clusters.size(), association, buffers.sorted, 
+          offsets);
+
         for(unsigned int c = 0; c < clusters.size(); ++c)
         {
-          vector<pDescriptor> cluster_descriptors;
-          cluster_descriptors.reserve(groups[c].size());
-          
-          /*
-          for(unsigned int d = 0; d < descriptors.size(); ++d)
-          {
-            if( assoc.find<unsigned char>(c, d) )
-            {
-              cluster_descriptors.push_back(descriptors[d]);
-            }
-          }
-          */
-          
-          vector<unsigned int>::const_iterator vit;
-          for(vit = groups[c].begin(); vit != groups[c].end(); ++vit)
+          // a cluster may lose all its descriptors if it coincides with 
+          // another one; it keeps its centre then
+          if(offsets[c] < offsets[c+1])
           {
-            cluster_descriptors.push_back(descriptors[*vit]);
+            buffers.descriptors.assign(buffers.sorted.begin() + offsets[c],
+              buffers.sorted.begin() + offsets[c+1]);
+            F::meanValue(buffers.descriptors, clusters[c]);
           }
-          
-          
-          F::meanValue(cluster_descriptors, clusters[c]);
         }
         
       } // if(!first_time)
 
       // 2. Associate features with clusters
 
-      // calculate distances to cluster centers
-      groups.clear();
-      groups.resize(clusters.size(), vector<unsigned int>());
-      current_association.resize(descriptors.size());
-
-      //assoc.clear();
-
-      typename vector<pDescriptor>::const_iterator fit;
-      //unsigned int d = 0;
-      for(fit = descriptors.begin(); fit != descriptors.end(); ++fit)//, ++d)
+      if(m_kmeans_algorithm == HAMERLY)
       {
-        double best_dist = F::distance(*(*fit), clusters[0]);
-        unsigned int icluster = 0;
-        
-        for(unsigned int c = 1; c < clusters.size(); ++c)
+        associateHamerly(range, n, clusters, last_clusters, association,
+          buffers.upper, buffers.lower);
+      }
+      else
+      {
+        // calculate distances to cluster centers
+        for(size_t i = 0; i < n; ++i)
         {
-          double dist = F::distance(*(*fit), clusters[c]);
-          if(dist < best_dist)
+          double best_dist = F::distance(*range[i], clusters[0]);
+          unsigned int icluster = 0;
+          
+          for(unsigned int c = 1; c < clusters.size(); ++c)
           {
-            best_dist = dist;
-            icluster = c;
+            // the distance is only needed if it is lower than the best one
+            double dist = 
+              BoundedDistance<F>::distance(*range[i], clusters[c], best_dist);
+            if(dist < best_dist)
+            {
+              best_dist = dist;
+              icluster = c;
+            }
           }
+          
+          association[i] = icluster;
         }
-
-        //assoc.ref<unsigned char>(icluster, d) = 1;
-
-        groups[icluster].push_back(fit - descriptors.begin());
-        current_association[ fit - descriptors.begin() ] = icluster;
       }
       
       // kmeans++ ensures all the clusters has any feature associated with them
@@ -759,26 +1867,22 @@ void TemplatedVocabulary<TDescriptor,F>::HKmeansStep(NodeId parent_id,
       }
       else
       {
-        //goon = !eqUChar(last_assoc, assoc);
-        
-        goon = false;
-        for(unsigned int i = 0; i < current_association.size(); i++)
-        {
-          if(current_association[i] != last_association[i]){
-            goon = true;
-            break;
-          }
-        }
+        goon = (association != last_association);
       }
 
-			if(goon)
-			{
-				// copy last feature-cluster association
-				last_association = current_association;
-				//last_assoc = assoc.clone();
-			}
-			
-		} // while(goon)
+      if(goon)
+      {
+        // copy last feature-cluster association
+        last_association = association;
+      }
+      
+    } // while(goon)
+    
+    // make the descriptors of each cluster contiguous in the range
+    partition(range, n, clusters.size(), association, buffers.sorted, 
+      offsets);
+    std::copy(buffers.sorted.begin(), buffers.sorted.begin() + n, 
+      descriptors.begin() + begin);
     
   } // if must run kmeans
   
@@ -790,31 +1894,146 @@ void TemplatedVocabulary<TDescriptor,F>::HKmeansStep(NodeId parent_id,
     m_nodes.back().descriptor = clusters[i];
     m_nodes.back().parent = parent_id;
     m_nodes[parent_id].children.push_back(id);
+    
+    buffers.ranges.push_back(
+      std::make_pair(begin + offsets[i], begin + offsets[i+1]));
   }
   
   // go on with the next level
   if(current_level < m_L)
   {
     // iterate again with the resulting clusters
-    const vector<NodeId> &children_ids = m_nodes[parent_id].children;
     for(unsigned int i = 0; i < clusters.size(); ++i)
     {
-      NodeId id = children_ids[i];
+      NodeId id = m_nodes[parent_id].children[i];
 
-      vector<pDescriptor> child_features;
-      child_features.reserve(groups[i].size());
-
-      vector<unsigned int>::const_iterator vit;
-      for(vit = groups[i].begin(); vit != groups[i].end(); ++vit)
+      if(offsets[i+1] - offsets[i] > 1)
       {
-        child_features.push_back(descriptors[*vit]);
+        HKmeansStep(id, descriptors, begin + offsets[i], begin + offsets[i+1],
+          current_level + 1, buffers);
       }
+    }
+  }
+}
+
+// --------------------------------------------------------------------------
 
-      if(child_features.size() > 1)
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::partition(
+  const pDescriptor *descriptors, size_t n, unsigned int k, 
+  const vector<unsigned int> &association, vector<pDescriptor> &sorted, 
+  vector<size_t> &offsets)
+{
+  // counting sort: offsets[c+1] starts as the size of cluster c
+  offsets.assign(k + 1, 0);
+  for(size_t i = 0; i < n; ++i) ++offsets[association[i] + 1];
+  for(unsigned int c = 1; c <= k; ++c) offsets[c] += offsets[c-1];
+  
+  // offsets[c] is used as the position to insert in cluster c, so that it
+  // ends as the start of cluster c+1
+  sorted.resize(n);
+  for(size_t i = 0; i < n; ++i) 
+    sorted[offsets[association[i]]++] = descriptors[i];
+  
+  for(unsigned int c = k; c > 0; --c) offsets[c] = offsets[c-1];
+  offsets[0] = 0;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::associateHamerly(
+  const pDescriptor *descriptors, size_t n, 
+  const vector<TDescriptor> &clusters,
+  const vector<TDescriptor> &last_clusters, vector<unsigned int> &association,
+  vector<double> &upper, vector<double> &lower) const
+{
+  const unsigned int k = clusters.size();
+  const bool first_time = last_clusters.empty();
+  
+  // distance that each cluster moved, and the greatest two of them
+  vector<double> moved(k, 0.);
+  unsigned int max_moved_c = 0;
+  double max_moved = 0., second_moved = 0.;
+  
+  // half the distance from each cluster to its closest one
+  vector<double> half(k, std::numeric_limits<double>::max());
+  
+  if(first_time)
+  {
+    association.resize(n);
+    upper.resize(n);
+    lower.resize(n);
+  }
+  else
+  {
+    for(unsigned int c = 0; c < k; ++c)
+    {
+      moved[c] = metric(F::distance(clusters[c], last_clusters[c]));
+      if(moved[c] > max_moved)
       {
-        HKmeansStep(id, child_features, current_level + 1);
+        second_moved = max_moved;
+        max_moved = moved[c];
+        max_moved_c = c;
+      }
+      else if(moved[c] > second_moved)
+      {
+        second_moved = moved[c];
       }
     }
+    
+    for(unsigned int c1 = 0; c1 < k; ++c1)
+      for(unsigned int c2 = c1 + 1; c2 < k; ++c2)
+      {
+        const double d = metric(F::distance(clusters[c1], clusters[c2])) / 2;
+        half[c1] = std::min(half[c1], d);
+        half[c2] = std::min(half[c2], d);
+      }
+  }
+  
+  for(size_t i = 0; i < n; ++i)
+  {
+    const TDescriptor &descriptor = *descriptors[i];
+    
+    if(!first_time)
+    {
+      const unsigned int a = association[i];
+      upper[i] += moved[a];
+      lower[i] -= (a == max_moved_c ? second_moved : max_moved);
+      
+      // the cluster is strictly the closest one, as LLOYD would find
+      const double bound = std::max(half[a], lower[i]);
+      if(upper[i] < bound) continue;
+      
+      upper[i] = metric(F::distance(descriptor, clusters[a]));
+      if(upper[i] < bound) continue;
+    }
+    
+    // closest and second closest clusters, with the ties solved in favour
+    // of the first cluster, as LLOYD does
+    unsigned int best_c = 0;
+    double best_d = F::distance(descriptor, clusters[0]);
+    double second_d = std::numeric_limits<double>::max();
+    
+    for(unsigned int c = 1; c < k; ++c)
+    {
+      const double d = 
+        BoundedDistance<F>::distance(descriptor, clusters[c], second_d);
+      if(d < best_d)
+      {
+        second_d = best_d;
+        best_d = d;
+        best_c = c;
+      }
+      else if(d < second_d)
+      {
+        second_d = d;
+      }
+    }
+    
+    association[i] = best_c;
+    upper[i] = metric(best_d);
+    lower[i] = (k > 1 ? metric(second_d) : std::numeric_limits<double>::max());
   }
 }
 
@@ -824,7 +2043,10 @@ template<class TDescriptor, class F>
 void TemplatedVocabulary<TDescriptor, F>::initiateClusters
   (const vector<pDescriptor> &descriptors, vector<TDescriptor> &clusters) const
 {
-  initiateClustersKMpp(descriptors, clusters);  
+  if(m_kmeans_seeding == KMEANS_PARALLEL)
+    initiateClustersKMParallel(descriptors, clusters);
+  else
+    initiateClustersKMpp(descriptors, clusters);
 }
 
 // --------------------------------------------------------------------------
@@ -849,6 +2071,7 @@ void TemplatedVocabulary<TDescriptor,F>::initiateClustersKMpp(
   clusters.resize(0);
   clusters.reserve(m_k);
   vector<double> min_dists(pfeatures.size(), std::numeric_limits<double>::max());
+  vector<double> block_sums;
   
   // 1.
   
@@ -857,83 +2080,448 @@ void TemplatedVocabulary<TDescriptor,F>::initiateClustersKMpp(
   // create first cluster
   clusters.push_back(*pfeatures[ifeature]);
 
-  // compute the initial distances
-  typename vector<pDescriptor>::const_iterator fit;
-  vector<double>::iterator dit;
-  dit = min_dists.begin();
-  for(fit = pfeatures.begin(); fit != pfeatures.end(); ++fit, ++dit)
+  while(true)
+  {
+    // 2.
+    const pDescriptor center = &clusters.back();
+    updateSeedingDistances(pfeatures, &center, 1, clusters.size() - 1, 
+      min_dists, NULL, block_sums);
+    
+    if((int)clusters.size() >= m_k) break;
+    
+    // 3.
+    double dist_sum = std::accumulate(block_sums.begin(), block_sums.end(), 
+      0.0);
+
+    if(dist_sum > 0)
+    {
+      double cut_d;
+      do
+      {
+        cut_d = DUtils::Random::RandomValue<double>(0, dist_sum);
+      } while(cut_d == 0.0);
+
+      ifeature = sampleSeed(min_dists, block_sums, cut_d);
+      
+      clusters.push_back(*pfeatures[ifeature]);
+
+    } // if dist_sum > 0
+    else
+      break;
+      
+  } // while(used_clusters < m_k)
+
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::initiateClustersKMParallel(
+  const vector<pDescriptor> &pfeatures, vector<TDescriptor> &clusters) const
+{
+  // Implements k-means|| seeding algorithm
+  // Algorithm:
+  // 1. Choose one candidate uniformly at random from among the data points.
+  // 2. For some rounds, sample each point x independently with probability
+  //    l * D(x) / sum(D), where D(x) is the distance to the nearest 
+  //    candidate and l = 2k is the oversampling factor.
+  // 3. Weight each candidate by the number of points closest to it.
+  // 4. Choose k clusters among the weighted candidates with kmeans++.
+
+  DUtils::Random::SeedRandOnce();
+
+  clusters.resize(0);
+  clusters.reserve(m_k);
+  
+  const size_t n = pfeatures.size();
+  vector<double> min_dists(n, std::numeric_limits<double>::max());
+  vector<unsigned int> closest(n, 0);
+  vector<double> block_sums;
+  
+  // 1.
+  vector<pDescriptor> candidates;
+  candidates.push_back(pfeatures[DUtils::Random::RandomInt(0, n-1)]);
+  updateSeedingDistances(pfeatures, &candidates[0], 1, 0, min_dists, 
+    &closest, block_sums);
+  
+  // 2.
+  const double l = 2. * m_k;
+  for(int round = 0; round < SEEDING_ROUNDS; ++round)
+  {
+    const double dist_sum = 
+      std::accumulate(block_sums.begin(), block_sums.end(), 0.0);
+    if(dist_sum <= 0) break;
+    
+    const size_t first = candidates.size();
+    for(size_t i = 0; i < n; ++i)
+    {
+      if(min_dists[i] > 0 && 
+        DUtils::Random::RandomValue<double>(0, dist_sum) < l * min_dists[i])
+      {
+        candidates.push_back(pfeatures[i]);
+      }
+    }
+    
+    if(candidates.size() > first)
+    {
+      updateSeedingDistances(pfeatures, &candidates[first], 
+        candidates.size() - first, first, min_dists, &closest, block_sums);
+    }
+  }
+  
+  // 3.
+  const size_t m = candidates.size();
+  vector<double> weights(m, 0.);
+  for(size_t i = 0; i < n; ++i) weights[closest[i]] += 1.;
+  
+  if((int)m <= m_k)
+  {
+    for(size_t j = 0; j < m; ++j) clusters.push_back(*candidates[j]);
+    return;
+  }
+  
+  // 4. (the candidates are few, so this is serial)
+  vector<double> cand_dists(m, std::numeric_limits<double>::max());
+  
+  double cut_d = DUtils::Random::RandomValue<double>(0, (double)n);
+  size_t icand = 0;
+  for(double acc = weights[0]; acc < cut_d && icand + 1 < m; ) 
+    acc += weights[++icand];
+  
+  while(true)
+  {
+    clusters.push_back(*candidates[icand]);
+    if((int)clusters.size() >= m_k) break;
+    
+    double dist_sum = 0.;
+    for(size_t j = 0; j < m; ++j)
+    {
+      if(cand_dists[j] > 0)
+      {
+        double dist = BoundedDistance<F>::distance(*candidates[j], 
+          clusters.back(), cand_dists[j]);
+        if(dist < cand_dists[j]) cand_dists[j] = dist;
+      }
+      dist_sum += weights[j] * cand_dists[j];
+    }
+    
+    if(dist_sum <= 0) break;
+    
+    do
+    {
+      cut_d = DUtils::Random::RandomValue<double>(0, dist_sum);
+    } while(cut_d == 0.0);
+    
+    double d_up_now = 0.;
+    for(icand = 0; icand < m; ++icand)
+    {
+      d_up_now += weights[icand] * cand_dists[icand];
+      if(d_up_now >= cut_d) break;
+    }
+    if(icand == m) icand = m - 1;
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::updateSeedingDistances(
+  const vector<pDescriptor> &descriptors, const pDescriptor *centers, 
+  unsigned int ncenters, unsigned int first_center, 
+  vector<double> &min_dists, vector<unsigned int> *closest, 
+  vector<double> &block_sums) const
+{
+  // the blocks do not depend on the number of threads, so that the sums 
+  // and the sampled seeds do not either
+  const int nblocks = 
+    (int)((descriptors.size() + SEEDING_BLOCK - 1) / SEEDING_BLOCK);
+  block_sums.resize(nblocks);
+  
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
+  for(int b = 0; b < nblocks; ++b)
+  {
+    const size_t first = (size_t)b * SEEDING_BLOCK;
+    const size_t last = 
+      std::min(descriptors.size(), first + SEEDING_BLOCK);
+    
+    double sum = 0.;
+    for(size_t i = first; i < last; ++i)
+    {
+      for(unsigned int c = 0; c < ncenters && min_dists[i] > 0; ++c)
+      {
+        // the distance is only needed if it is lower than the current one
+        double dist = BoundedDistance<F>::distance(*descriptors[i], 
+          *centers[c], min_dists[i]);
+        if(dist < min_dists[i]) 
+        {
+          min_dists[i] = dist;
+          if(closest != NULL) (*closest)[i] = first_center + c;
+        }
+      }
+      sum += min_dists[i];
+    }
+    block_sums[b] = sum;
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+size_t TemplatedVocabulary<TDescriptor,F>::sampleSeed(
+  const vector<double> &min_dists, const vector<double> &block_sums, 
+  double cut_d)
+{
+  // find the block where the accumulated distance reaches cut_d, and then
+  // the descriptor in that block
+  double d_up_now = 0;
+  size_t b = 0;
+  for(; b + 1 < block_sums.size(); ++b)
+  {
+    if(d_up_now + block_sums[b] >= cut_d) break;
+    d_up_now += block_sums[b];
+  }
+  
+  const size_t first = b * SEEDING_BLOCK;
+  const size_t last = std::min(min_dists.size(), first + SEEDING_BLOCK);
+  
+  for(size_t i = first; i < last; ++i)
+  {
+    d_up_now += min_dists[i];
+    if(d_up_now >= cut_d) return i;
+  }
+  
+  return last - 1;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::createWords()
+{
+  m_words.resize(0);
+  
+  if(!m_nodes.empty())
+  {
+    m_words.reserve( (int)pow((double)m_k, (double)m_L) );
+
+    typename vector<Node>::iterator nit;
+    
+    nit = m_nodes.begin(); // ignore root
+    for(++nit; nit != m_nodes.end(); ++nit)
+    {
+      if(nit->isLeaf())
+      {
+        nit->word_id = m_words.size();
+        m_words.push_back( &(*nit) );
+      }
+    }
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::linkWords()
+{
+  m_words.resize(0);
+  
+  if(!m_nodes.empty())
+  {
+    typename vector<Node>::iterator nit;
+    
+    nit = m_nodes.begin(); // ignore root
+    for(++nit; nit != m_nodes.end(); ++nit)
+    {
+      if(nit->isLeaf())
+      {
+        if(nit->word_id >= m_words.size()) 
+          m_words.resize(nit->word_id + 1, NULL);
+        m_words[nit->word_id] = &(*nit);
+      }
+    }
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::createNodeTables()
+{
+  m_dfs_words.resize(0);
+  m_node_words.assign(m_nodes.size(), std::make_pair(0u, 0u));
+  m_word_depths.assign(m_words.size(), 0);
+  m_word_paths.resize(0);
+  m_node_contiguous.assign(m_nodes.size(), true);
+  m_path_length = 0;
+  
+  if(m_nodes.empty()) return;
+  
+  m_dfs_words.reserve(m_words.size());
+  
+  // depth-first traversal with an explicit stack of <node, depth>, 
+  // visiting the children in order. path holds the current branch
+  vector<NodeId> path;
+  vector<std::pair<NodeId, int> > stack;
+  stack.push_back(std::make_pair(0, 0));
+  
+  // preorder of the nodes, to compute the ranges bottom-up afterwards
+  vector<NodeId> preorder;
+  preorder.reserve(m_nodes.size());
+  
+  while(!stack.empty())
+  {
+    const NodeId nid = stack.back().first;
+    const int depth = stack.back().second;
+    stack.pop_back();
+    
+    preorder.push_back(nid);
+    path.resize(depth);
+    path.push_back(nid);
+    
+    const Node &node = m_nodes[nid];
+    
+    if(node.isLeaf())
+    {
+      // skip the root of an empty tree and leaves that are not words
+      if(node.word_id >= m_words.size() || m_words[node.word_id] != &node)
+        continue;
+      
+      m_node_words[nid] = 
+        std::make_pair((unsigned int)m_dfs_words.size(), 
+          (unsigned int)m_dfs_words.size() + 1);
+      m_dfs_words.push_back(node.word_id);
+      
+      m_word_depths[node.word_id] = (unsigned char)depth;
+      m_path_length = std::max(m_path_length, depth + 1);
+    }
+    else
+    {
+      vector<NodeId>::const_reverse_iterator cit;
+      for(cit = node.children.rbegin(); cit != node.children.rend(); ++cit)
+        stack.push_back(std::make_pair(*cit, depth + 1));
+    }
+  }
+  
+  // ranges of the inner nodes span from their first to their last child.
+  // Their word ids are consecutive if those of the children are and the
+  // children follow one another
+  vector<NodeId>::const_reverse_iterator pit;
+  for(pit = preorder.rbegin(); pit != preorder.rend(); ++pit)
   {
-    *dit = F::distance(*(*fit), clusters.back());
-  }  
-
-  while((int)clusters.size() < m_k)
+    const Node &node = m_nodes[*pit];
+    if(node.isLeaf()) continue;
+    
+    m_node_words[*pit] = std::make_pair(
+      m_node_words[node.children.front()].first,
+      m_node_words[node.children.back()].second);
+    
+    bool contiguous = true;
+    for(size_t i = 0; contiguous && i < node.children.size(); ++i)
+    {
+      const std::pair<unsigned int, unsigned int> &r = 
+        m_node_words[node.children[i]];
+      
+      contiguous = m_node_contiguous[node.children[i]] && 
+        (r.first == r.second || r.first == m_node_words[*pit].first ||
+         m_dfs_words[r.first] == m_dfs_words[r.first - 1] + 1);
+    }
+    m_node_contiguous[*pit] = contiguous;
+  }
+  
+  // paths from the root to each word, walking up the parents once
+  m_word_paths.resize(m_words.size() * m_path_length, 0);
+  for(WordId wid = 0; wid < m_words.size(); ++wid)
   {
-    // 2.
-    dit = min_dists.begin();
-    for(fit = pfeatures.begin(); fit != pfeatures.end(); ++fit, ++dit)
+    NodeId nid = m_words[wid]->id;
+    for(int d = m_word_depths[wid]; d > 0; --d)
     {
-      if(*dit > 0)
-      {
-        double dist = F::distance(*(*fit), clusters.back());
-        if(dist < *dit) *dit = dist;
-      }
+      m_word_paths[wid * m_path_length + d] = nid;
+      nid = m_nodes[nid].parent;
     }
-    
-    // 3.
-    double dist_sum = std::accumulate(min_dists.begin(), min_dists.end(), 0.0);
+  }
+}
 
-    if(dist_sum > 0)
-    {
-      double cut_d;
-      do
-      {
-        cut_d = DUtils::Random::RandomValue<double>(0, dist_sum);
-      } while(cut_d == 0.0);
+// --------------------------------------------------------------------------
 
-      double d_up_now = 0;
-      for(dit = min_dists.begin(); dit != min_dists.end(); ++dit)
-      {
-        d_up_now += *dit;
-        if(d_up_now >= cut_d) break;
-      }
-      
-      if(dit == min_dists.end()) 
-        ifeature = pfeatures.size()-1;
-      else
-        ifeature = dit - min_dists.begin();
-      
-      clusters.push_back(*pfeatures[ifeature]);
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::setNodeWeights
+  (const vector<vector<TDescriptor> > &training_features)
+{
+  vector<unsigned int> Ni;
 
-    } // if dist_sum > 0
-    else
-      break;
-      
-  } // while(used_clusters < m_k)
+  if(m_weighting == IDF || m_weighting == TF_IDF)
+    countNodeImages(training_features, Ni);
 
+  setWeights(Ni, training_features.size());
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-void TemplatedVocabulary<TDescriptor,F>::createWords()
+void TemplatedVocabulary<TDescriptor,F>::setLevelWeights
+  (const std::vector<std::vector<TDescriptor> > &features)
 {
-  m_words.resize(0);
-  
-  if(!m_nodes.empty())
+  vector<unsigned int> Ni;
+
+  if(m_weighting == IDF || m_weighting == TF_IDF)
+    countNodeImages(features, Ni);
+
+  setWeights(Ni, features.size(), false);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::countNodeImages
+  (const vector<vector<TDescriptor> > &features,
+   vector<unsigned int> &Ni) const
+{
+  const NodeId NNodes = m_nodes.size();
+  const int NDocs = (int)features.size();
+
+  Ni.assign(NNodes, 0);
+
+  // each thread counts the nodes of some images, and the counts are
+  // added at the end
+#ifdef _OPENMP
+  #pragma omp parallel
+#endif
   {
-    m_words.reserve( (int)pow((double)m_k, (double)m_L) );
+    vector<unsigned int> thread_Ni(NNodes, 0);
+    vector<int> last_image(NNodes, -1);
+    vector<WordId> ids;
+    vector<WordValue> weights;
 
-    typename vector<Node>::iterator nit;
-    
-    nit = m_nodes.begin(); // ignore root
-    for(++nit; nit != m_nodes.end(); ++nit)
+#ifdef _OPENMP
+    #pragma omp for schedule(dynamic)
+#endif
+    for(int i = 0; i < NDocs; ++i)
     {
-      if(nit->isLeaf())
+      transformFeatures(features[i], ids, weights);
+
+      // count each node once per image, going up the path of each word
+      // until a node counted before, whose ancestors are counted too
+      vector<WordId>::const_iterator wit;
+      for(wit = ids.begin(); wit != ids.end(); ++wit)
       {
-        nit->word_id = m_words.size();
-        m_words.push_back( &(*nit) );
+        const NodeId *path = &m_word_paths[*wit * m_path_length];
+        for(int d = m_word_depths[*wit]; d > 0; --d)
+        {
+          if(last_image[path[d]] == i) break;
+          last_image[path[d]] = i;
+          thread_Ni[path[d]]++;
+        }
       }
     }
+
+#ifdef _OPENMP
+    #pragma omp critical
+#endif
+    {
+      for(NodeId nid = 0; nid < NNodes; ++nid) Ni[nid] += thread_Ni[nid];
+    }
   }
 }
 
@@ -941,58 +2529,83 @@ void TemplatedVocabulary<TDescriptor,F>::createWords()
 
 template<class TDescriptor, class F>
 void TemplatedVocabulary<TDescriptor,F>::setNodeWeights
-  (const vector<vector<TDescriptor> > &training_features)
+  (const vector<vector<TDescriptor> > &training_features,
+   const vector<pDescriptor> &descriptors, 
+   const vector<std::pair<size_t, size_t> > &ranges)
 {
-  const unsigned int NWords = m_words.size();
+  const NodeId NNodes = m_nodes.size();
   const unsigned int NDocs = training_features.size();
 
-  if(m_weighting == TF || m_weighting == BINARY)
-  {
-    // idf part must be 1 always
-    for(unsigned int i = 0; i < NWords; i++)
-      m_words[i]->weight = 1;
-  }
-  else if(m_weighting == IDF || m_weighting == TF_IDF)
-  {
-    // IDF and TF-IDF: we calculte the idf path now
-
-    // Note: this actually calculates the idf part of the tf-idf score.
-    // The complete tf-idf score is calculated in ::transform
+  vector<unsigned int> Ni(NNodes, 0);
 
-    vector<unsigned int> Ni(NWords, 0);
-    vector<bool> counted(NWords, false);
+  if(m_weighting == IDF || m_weighting == TF_IDF)
+  {
+    // the image of a descriptor is found by its address, since the 
+    // descriptors are pointers to the training features
+    vector<std::pair<uintptr_t, unsigned int> > starts;
+    starts.reserve(NDocs);
+    for(unsigned int i = 0; i < NDocs; ++i)
+    {
+      if(!training_features[i].empty())
+        starts.push_back(std::make_pair(
+          (uintptr_t)&training_features[i][0], i));
+    }
+    std::sort(starts.begin(), starts.end());
     
-    typename vector<vector<TDescriptor> >::const_iterator mit;
-    typename vector<TDescriptor>::const_iterator fit;
+    vector<unsigned int> images(descriptors.size());
+    for(size_t j = 0; j < descriptors.size(); ++j)
+    {
+      vector<std::pair<uintptr_t, unsigned int> >::const_iterator it =
+        std::upper_bound(starts.begin(), starts.end(), std::make_pair(
+          (uintptr_t)descriptors[j],
+          std::numeric_limits<unsigned int>::max()));
+      images[j] = (it - 1)->second;
+    }
+
+    // last node counted in each image
+    vector<NodeId> last_node(NDocs, std::numeric_limits<NodeId>::max());
 
-    for(mit = training_features.begin(); mit != training_features.end(); ++mit)
+    for(NodeId nid = 1; nid < NNodes; ++nid)
     {
-      fill(counted.begin(), counted.end(), false);
+      const std::pair<size_t, size_t> &range = ranges[nid];
 
-      for(fit = mit->begin(); fit < mit->end(); ++fit)
+      for(size_t j = range.first; j < range.second; ++j)
       {
-        WordId word_id;
-        transform(*fit, word_id);
-
-        if(!counted[word_id])
+        if(last_node[images[j]] != nid)
         {
-          Ni[word_id]++;
-          counted[word_id] = true;
+          Ni[nid]++;
+          last_node[images[j]] = nid;
         }
       }
     }
+  }
+
+  setWeights(Ni, NDocs);
+}
+
+// --------------------------------------------------------------------------
 
-    // set ln(N/Ni)
-    for(unsigned int i = 0; i < NWords; i++)
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::setWeights
+  (const vector<unsigned int> &Ni, unsigned int NDocs, bool words)
+{
+  for(NodeId nid = 1; nid < m_nodes.size(); ++nid)
+  {
+    Node &node = m_nodes[nid];
+    if(!words && node.isLeaf()) continue;
+
+    if(m_weighting == TF || m_weighting == BINARY)
     {
-      if(Ni[i] > 0)
-      {
-        m_words[i]->weight = log((double)NDocs / (double)Ni[i]);
-      }// else // This cannot occur if using kmeans++
+      // idf part must be 1 always
+      node.weight = 1;
     }
-  
+    else if(Ni[nid] > 0)
+    {
+      // IDF and TF-IDF: this is the idf part of the tf-idf score, ln(N/Ni).
+      // The complete tf-idf score is calculated in ::transform
+      node.weight = log((double)NDocs / (double)Ni[nid]);
+    } // else // This cannot occur if using kmeans++
   }
-
 }
 
 // --------------------------------------------------------------------------
@@ -1062,6 +2675,96 @@ WordId TemplatedVocabulary<TDescriptor, F>::transform
 
 // --------------------------------------------------------------------------
 
+template<class TDescriptor, class F>
+WordId TemplatedVocabulary<TDescriptor, F>::transformFromHint
+  (const TDescriptor& feature, WordId hint, int levelsup, 
+   WordValue *weight) const
+{
+  if(empty())
+  {
+    if(weight) *weight = 0;
+    return 0;
+  }
+  
+  if(hint >= m_words.size() || m_beam_width > 1)
+  {
+    WordId wid;
+    WordValue w;
+    transform(feature, wid, w);
+    if(weight) *weight = w;
+    return wid;
+  }
+  
+  const NodeId *path = &m_word_paths[hint * m_path_length];
+  const int start = 
+    std::max(0, (int)m_word_depths[hint] - std::max(levelsup, 0));
+  
+  // the greedy descent reaches the node if the feature is closer to it 
+  // than to its siblings, with ties going to the first child, and so do 
+  // all its ancestors. The deepest nodes are checked first, since they are
+  // the most likely to fail
+  for(int depth = start; depth > 0; --depth)
+  {
+    const NodeId nid = path[depth];
+    const vector<NodeId> &siblings = m_nodes[path[depth-1]].children;
+    const double d = F::distance(feature, m_nodes[nid].descriptor);
+    
+    bool closest = true;
+    bool before = true;
+    vector<NodeId>::const_iterator sit;
+    for(sit = siblings.begin(); sit != siblings.end() && closest; ++sit)
+    {
+      if(*sit == nid)
+      {
+        before = false;
+        continue;
+      }
+      
+      // siblings before the node win the ties. A bounded distance that 
+      // stops at d is taken as a tie, which only costs a full transform
+      const double sd = BoundedDistance<F>::distance(feature, 
+        m_nodes[*sit].descriptor, d);
+      closest = (before ? sd > d : sd >= d);
+    }
+    
+    if(!closest)
+    {
+      WordId wid;
+      WordValue w;
+      transform(feature, wid, w);
+      if(weight) *weight = w;
+      return wid;
+    }
+  }
+  
+  // descend from there
+  NodeId final_id = path[start];
+  while(!m_nodes[final_id].isLeaf())
+  {
+    const vector<NodeId> &children = m_nodes[final_id].children;
+    vector<NodeId>::const_iterator cit = children.begin();
+    
+    final_id = *cit;
+    double best_d = F::distance(feature, m_nodes[final_id].descriptor);
+    
+    for(++cit; cit != children.end(); ++cit)
+    {
+      double d = BoundedDistance<F>::distance(feature, 
+        m_nodes[*cit].descriptor, best_d);
+      if(d < best_d)
+      {
+        best_d = d;
+        final_id = *cit;
+      }
+    }
+  }
+  
+  if(weight) *weight = m_nodes[final_id].weight;
+  return m_nodes[final_id].word_id;
+}
+
+// --------------------------------------------------------------------------
+
 template<class TDescriptor, class F>
 void TemplatedVocabulary<TDescriptor,F>::transform(
   const std::vector<TDescriptor>& features, BowVector &v) const
@@ -1077,20 +2780,143 @@ void TemplatedVocabulary<TDescriptor,F>::transform(
   LNorm norm;
   bool must = m_scoring_object->mustNormalize(norm);
 
-	typename vector<TDescriptor>::const_iterator fit;
+  const bool soft = (m_soft_words > 1 && 
+    (m_weighting == TF || m_weighting == TF_IDF));
+  
+  if(!soft)
+  {
+    vector<WordId> ids;
+    vector<WordValue> weights;
+    transformFeatures(features, ids, weights);
+    makeBowVector(ids, weights, v);
+    return;
+  }
+  
+  for(size_t i = 0; i < features.size(); ++i)
+    addSoftWords(features[i], v);
+  
+  if(!v.empty() && !must)
+  {
+    // unnecessary when normalizing
+    const double nd = v.size();
+    for(BowVector::iterator vit = v.begin(); vit != v.end(); vit++) 
+      vit->second /= nd;
+  }
+  
+  if(must) v.normalize(norm);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F> 
+void TemplatedVocabulary<TDescriptor,F>::transform(
+  const std::vector<TDescriptor>& features,
+  BowVector &v, FeatureVector &fv, int levelsup) const
+{
+  std::vector<std::pair<NodeId, unsigned int> > nodes;
+  transformNodes(features, v, nodes, levelsup);
+  
+  fv.clear();
+  std::vector<std::pair<NodeId, unsigned int> >::const_iterator nit;
+  for(nit = nodes.begin(); nit != nodes.end(); ++nit)
+    fv.addFeature(nit->first, nit->second);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F> 
+void TemplatedVocabulary<TDescriptor,F>::transform(
+  const std::vector<TDescriptor>& features,
+  BowVector &v, CompactFeatureVector &fv, int levelsup) const
+{
+  std::vector<std::pair<NodeId, unsigned int> > nodes;
+  transformNodes(features, v, nodes, levelsup);
+  fv.assign(nodes);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F> 
+void TemplatedVocabulary<TDescriptor,F>::transformNodes(
+  const std::vector<TDescriptor>& features, BowVector &v, 
+  std::vector<std::pair<NodeId, unsigned int> > &nodes, int levelsup) const
+{
+  v.clear();
+  nodes.resize(0);
+  
+  if(empty()) // safe for subclasses
+  {
+    return;
+  }
+  
+  // normalize 
+  LNorm norm;
+  bool must = m_scoring_object->mustNormalize(norm);
+  
+  const bool soft = (m_soft_words > 1 && 
+    (m_weighting == TF || m_weighting == TF_IDF));
+  
+  if(!soft)
+  {
+    vector<WordId> ids;
+    vector<WordValue> weights;
+    vector<NodeId> nids;
+    transformFeatures(features, ids, weights, &nids, levelsup);
+    makeBowVector(ids, weights, v, &nids, &nodes);
+    return;
+  }
+  
+  nodes.reserve(features.size());
+  
+  for(unsigned int i_feature = 0; i_feature < features.size(); ++i_feature)
+  {
+    NodeId nid;
+    if(addSoftWords(features[i_feature], v, &nid, levelsup) > 0)
+      nodes.push_back(std::make_pair(nid, i_feature));
+  }
+  
+  if(!v.empty() && !must)
+  {
+    // unnecessary when normalizing
+    const double nd = v.size();
+    for(BowVector::iterator vit = v.begin(); vit != v.end(); vit++) 
+      vit->second /= nd;
+  }
+  
+  if(must) v.normalize(norm);
+}
+
+// --------------------------------------------------------------------------
 
+template<class TDescriptor, class F> 
+void TemplatedVocabulary<TDescriptor,F>::makeBowVector(
+  const vector<WordId> &ids, const vector<WordValue> &weights, 
+  BowVector &v, const vector<NodeId> *nids, 
+  std::vector<std::pair<NodeId, unsigned int> > *nodes) const
+{
+  v.clear();
+  if(nodes != NULL)
+  {
+    nodes->resize(0);
+    nodes->reserve(ids.size());
+  }
+  
+  // normalize 
+  LNorm norm;
+  bool must = m_scoring_object->mustNormalize(norm);
+  
   if(m_weighting == TF || m_weighting == TF_IDF)
   {
-    for(fit = features.begin(); fit < features.end(); ++fit)
+    for(unsigned int i_feature = 0; i_feature < ids.size(); ++i_feature)
     {
-      WordId id;
-      WordValue w; 
-      // w is the idf value if TF_IDF, 1 if TF
+      // weights[i_feature] is the idf value if TF_IDF, 1 if TF
       
-      transform(*fit, id, w);
-      
-      // not stopped
-      if(w > 0) v.addWeight(id, w);
+      if(weights[i_feature] > 0) // not stopped
+      { 
+        v.addWeight(ids[i_feature], weights[i_feature]);
+        if(nodes != NULL)
+          nodes->push_back(std::make_pair((*nids)[i_feature], i_feature));
+      }
     }
     
     if(!v.empty() && !must)
@@ -1100,22 +2926,21 @@ void TemplatedVocabulary<TDescriptor,F>::transform(
       for(BowVector::iterator vit = v.begin(); vit != v.end(); vit++) 
         vit->second /= nd;
     }
-    
+  
   }
   else // IDF || BINARY
   {
-    for(fit = features.begin(); fit < features.end(); ++fit)
+    for(unsigned int i_feature = 0; i_feature < ids.size(); ++i_feature)
     {
-      WordId id;
-      WordValue w;
-      // w is idf if IDF, or 1 if BINARY
-      
-      transform(*fit, id, w);
-      
-      // not stopped
-      if(w > 0) v.addIfNotExist(id, w);
+      // weights[i_feature] is idf if IDF, or 1 if BINARY
       
-    } // if add_features
+      if(weights[i_feature] > 0) // not stopped
+      {
+        v.addIfNotExist(ids[i_feature], weights[i_feature]);
+        if(nodes != NULL)
+          nodes->push_back(std::make_pair((*nids)[i_feature], i_feature));
+      }
+    }
   } // if m_weighting == ...
   
   if(must) v.normalize(norm);
@@ -1123,73 +2948,107 @@ void TemplatedVocabulary<TDescriptor,F>::transform(
 
 // --------------------------------------------------------------------------
 
-template<class TDescriptor, class F> 
-void TemplatedVocabulary<TDescriptor,F>::transform(
-  const std::vector<TDescriptor>& features,
-  BowVector &v, FeatureVector &fv, int levelsup) const
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::transformLevel(
+  const std::vector<TDescriptor>& features, int level, BowVector &v) const
 {
   v.clear();
-  fv.clear();
-  
-  if(empty()) // safe for subclasses
+
+  if(empty()) return;
+
+  LNorm norm;
+  bool must = m_scoring_object->mustNormalize(norm);
+
+  typename vector<TDescriptor>::const_iterator fit;
+  for(fit = features.begin(); fit != features.end(); ++fit)
   {
-    return;
+    // descend until the level or a leaf
+    NodeId nid = 0;
+    for(int l = 0; l < level && !m_nodes[nid].isLeaf(); ++l)
+    {
+      const vector<NodeId> &children = m_nodes[nid].children;
+      vector<NodeId>::const_iterator cit = children.begin();
+
+      nid = *cit;
+      double best_d = F::distance(*fit, m_nodes[nid].descriptor);
+
+      for(++cit; cit != children.end(); ++cit)
+      {
+        double d = BoundedDistance<F>::distance(*fit,
+          m_nodes[*cit].descriptor, best_d);
+        if(d < best_d)
+        {
+          best_d = d;
+          nid = *cit;
+        }
+      }
+    }
+
+    const WordValue weight = m_nodes[nid].weight;
+
+    // not stopped
+    if(weight > 0)
+    {
+      if(m_weighting == TF || m_weighting == TF_IDF)
+        v.addWeight(nid, weight);
+      else
+        v.addIfNotExist(nid, weight);
+    }
   }
-  
-  // normalize 
+
+  if(!v.empty() && !must && (m_weighting == TF || m_weighting == TF_IDF))
+  {
+    // unnecessary when normalizing
+    const double nd = v.size();
+    for(BowVector::iterator vit = v.begin(); vit != v.end(); vit++)
+      vit->second /= nd;
+  }
+
+  if(must) v.normalize(norm);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::transformLevel(
+  const BowVector &words, int level, BowVector &v) const
+{
+  v.clear();
+
+  if(empty()) return;
+
   LNorm norm;
   bool must = m_scoring_object->mustNormalize(norm);
-  
-  typename vector<TDescriptor>::const_iterator fit;
-  
-  if(m_weighting == TF || m_weighting == TF_IDF)
+
+  BowVector::const_iterator wit;
+  for(wit = words.begin(); wit != words.end(); ++wit)
   {
-    unsigned int i_feature = 0;
-    for(fit = features.begin(); fit < features.end(); ++fit, ++i_feature)
-    {
-      WordId id;
-      NodeId nid;
-      WordValue w; 
-      // w is the idf value if TF_IDF, 1 if TF
-      
-      transform(*fit, id, w, &nid, levelsup);
-      
-      if(w > 0) // not stopped
-      { 
-        v.addWeight(id, w);
-        fv.addFeature(nid, i_feature);
-      }
-    }
-    
-    if(!v.empty() && !must)
+    const WordId wid = wit->first;
+    const int depth = std::max(0, std::min(level, (int)m_word_depths[wid]));
+    const Node &node = m_nodes[m_word_paths[wid * m_path_length + depth]];
+
+    // not stopped
+    if(node.weight <= 0 || m_words[wid]->weight <= 0) continue;
+
+    if(m_weighting == TF || m_weighting == TF_IDF)
     {
-      // unnecessary when normalizing
-      const double nd = v.size();
-      for(BowVector::iterator vit = v.begin(); vit != v.end(); vit++) 
-        vit->second /= nd;
+      // the term frequency of the word is its weight without the idf,
+      // up to the normalization of the vector
+      v.addWeight(node.id, wit->second / m_words[wid]->weight *
+        node.weight);
     }
-  
+    else
+      v.addIfNotExist(node.id, node.weight);
   }
-  else // IDF || BINARY
+
+  if(!v.empty() && !must && (m_weighting == TF || m_weighting == TF_IDF))
   {
-    unsigned int i_feature = 0;
-    for(fit = features.begin(); fit < features.end(); ++fit, ++i_feature)
-    {
-      WordId id;
-      NodeId nid;
-      WordValue w;
-      // w is idf if IDF, or 1 if BINARY
-      
-      transform(*fit, id, w, &nid, levelsup);
-      
-      if(w > 0) // not stopped
-      {
-        v.addIfNotExist(id, w);
-        fv.addFeature(nid, i_feature);
-      }
-    }
-  } // if m_weighting == ...
-  
+    // unnecessary when normalizing
+    const double nd = v.size();
+    for(BowVector::iterator vit = v.begin(); vit != v.end(); vit++)
+      vit->second /= nd;
+  }
+
   if(must) v.normalize(norm);
 }
 
@@ -1218,6 +3077,13 @@ template<class TDescriptor, class F>
 void TemplatedVocabulary<TDescriptor,F>::transform(const TDescriptor &feature, 
   WordId &word_id, WordValue &weight, NodeId *nid, int levelsup) const
 { 
+  if(m_beam_width > 1)
+  {
+    double distance;
+    transformBeam(feature, 1, &word_id, &weight, &distance, nid, levelsup);
+    return;
+  }
+  
   // propagate the feature down the tree
   vector<NodeId> nodes;
   typename vector<NodeId>::const_iterator nit;
@@ -1240,7 +3106,8 @@ void TemplatedVocabulary<TDescriptor,F>::transform(const TDescriptor &feature,
     for(nit = nodes.begin() + 1; nit != nodes.end(); ++nit)
     {
       NodeId id = *nit;
-      double d = F::distance(feature, m_nodes[id].descriptor);
+      double d = 
+        BoundedDistance<F>::distance(feature, m_nodes[id].descriptor, best_d);
       if(d < best_d)
       {
         best_d = d;
@@ -1253,6 +3120,9 @@ void TemplatedVocabulary<TDescriptor,F>::transform(const TDescriptor &feature,
     
   } while( !m_nodes[final_id].isLeaf() );
 
+  // the leaf is the node if it is above the required level
+  if(nid != NULL && current_level < nid_level) *nid = final_id;
+
   // turn node id into word id
   word_id = m_nodes[final_id].word_id;
   weight = m_nodes[final_id].weight;
@@ -1261,61 +3131,312 @@ void TemplatedVocabulary<TDescriptor,F>::transform(const TDescriptor &feature,
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-NodeId TemplatedVocabulary<TDescriptor,F>::getParentNode
-  (WordId wid, int levelsup) const
+void TemplatedVocabulary<TDescriptor,F>::transformFeatures(
+  const std::vector<TDescriptor>& features, std::vector<WordId> &ids, 
+  std::vector<WordValue> &weights, std::vector<NodeId> *nids, 
+  int levelsup) const
 {
-  NodeId ret = m_words[wid]->id; // node id
-  while(levelsup > 0 && ret != 0) // ret == 0 --> root
+  ids.resize(features.size());
+  weights.resize(features.size());
+  if(nids != NULL) nids->resize(features.size());
+  
+  // beam searches are done feature by feature
+  if(m_transform_engine == INTERLEAVED && m_beam_width == 1)
+  {
+    for(size_t i = 0; i < features.size(); i += m_group_size)
+    {
+      const int n = (int)std::min((size_t)m_group_size, features.size() - i);
+      transformGroup(&features[i], n, &ids[i], &weights[i], 
+        (nids != NULL ? &(*nids)[i] : NULL), levelsup);
+    }
+  }
+  else
   {
-    --levelsup;
-    ret = m_nodes[ret].parent;
+    for(size_t i = 0; i < features.size(); ++i)
+    {
+      transform(features[i], ids[i], weights[i], 
+        (nids != NULL ? &(*nids)[i] : NULL), levelsup);
+    }
   }
-  return ret;
 }
 
 // --------------------------------------------------------------------------
 
 template<class TDescriptor, class F>
-void TemplatedVocabulary<TDescriptor,F>::getWordsFromNode
-  (NodeId nid, std::vector<WordId> &words) const
+void TemplatedVocabulary<TDescriptor,F>::transformGroup(
+  const TDescriptor *features, int n, WordId *ids, WordValue *weights, 
+  NodeId *nids, int levelsup) const
 {
-  words.clear();
+  // level at which the node must be stored in nids, if given
+  const int nid_level = m_L - levelsup;
+
+  // node reached by each feature, and features that have not reached a leaf
+  NodeId current[MAX_GROUP_SIZE];
+  int active[MAX_GROUP_SIZE];
+  int n_active = n;
   
-  if(m_nodes[nid].isLeaf())
+  for(int g = 0; g < n; ++g)
   {
-    words.push_back(m_nodes[nid].word_id);
+    current[g] = 0; // root
+    active[g] = g;
+    if(nids != NULL && nid_level <= 0) nids[g] = 0;
   }
-  else
+  
+  int current_level = 0;
+  
+  while(n_active > 0)
   {
-    words.reserve(m_k); // ^1, ^2, ...
+    ++current_level;
+    int n_next = 0;
+    
+    for(int a = 0; a < n_active; ++a)
+    {
+      const int g = active[a];
+      const vector<NodeId> &children = m_nodes[current[g]].children;
+      vector<NodeId>::const_iterator cit = children.begin();
+      
+      NodeId final_id = *cit;
+      double best_d = F::distance(features[g], m_nodes[final_id].descriptor);
+      
+      for(++cit; cit != children.end(); ++cit)
+      {
+        double d = BoundedDistance<F>::distance(features[g], 
+          m_nodes[*cit].descriptor, best_d);
+        if(d < best_d)
+        {
+          best_d = d;
+          final_id = *cit;
+        }
+      }
+      
+      current[g] = final_id;
+      const Node &node = m_nodes[final_id];
+      
+      if(nids != NULL && current_level == nid_level) nids[g] = final_id;
+      
+      if(node.isLeaf())
+      {
+        if(nids != NULL && current_level < nid_level) nids[g] = final_id;
+        ids[g] = node.word_id;
+        weights[g] = node.weight;
+      }
+      else
+      {
+        // the children are not needed until the distances of the other
+        // features of the group are computed
+        prefetchChildren(final_id);
+        active[n_next++] = g;
+      }
+    }
     
-    vector<NodeId> parents;
-    parents.push_back(nid);
+    n_active = n_next;
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+int TemplatedVocabulary<TDescriptor,F>::transformBeam(
+  const TDescriptor &feature, int n, WordId *ids, WordValue *weights, 
+  double *distances, NodeId *nid, int levelsup) const
+{
+  typedef std::pair<double, NodeId> Candidate;
+  
+  // max-heaps of the closest nodes of the next level and of the closest 
+  // leaves, so that the farthest one is replaced when they are full. 
+  // Leaves above the last level compete with the leaves found later
+  Candidate beam[MAX_BEAM_WIDTH], next[MAX_BEAM_WIDTH], 
+    leaves[MAX_BEAM_WIDTH];
+  int nbeam = 1, nleaves = 0;
+  n = std::max(1, std::min(n, (int)MAX_BEAM_WIDTH));
+  
+  beam[0] = Candidate(0., 0); // root
+  
+  while(nbeam > 0)
+  {
+    int nnext = 0;
     
-    while(!parents.empty())
+    for(int b = 0; b < nbeam; ++b)
     {
-      NodeId parentid = parents.back();
-      parents.pop_back();
+      const vector<NodeId> &children = m_nodes[beam[b].second].children;
       
-      const vector<NodeId> &child_ids = m_nodes[parentid].children;
       vector<NodeId>::const_iterator cit;
-      
-      for(cit = child_ids.begin(); cit != child_ids.end(); ++cit)
+      for(cit = children.begin(); cit != children.end(); ++cit)
       {
-        const Node &child_node = m_nodes[*cit];
+        const Node &child = m_nodes[*cit];
+        const bool leaf = child.isLeaf();
         
-        if(child_node.isLeaf())
-          words.push_back(child_node.word_id);
-        else
-          parents.push_back(*cit);
+        Candidate *heap = (leaf ? leaves : next);
+        int &size = (leaf ? nleaves : nnext);
+        const int capacity = (leaf ? n : m_beam_width);
+        
+        const double bound = (size < capacity ? 
+          std::numeric_limits<double>::max() : heap[0].first);
+        const double d = 
+          BoundedDistance<F>::distance(feature, child.descriptor, bound);
+        if(d >= bound) continue;
         
-      } // for each child
-    } // while !parents.empty
+        if(size == capacity) std::pop_heap(heap, heap + size--);
+        heap[size++] = Candidate(d, *cit);
+        std::push_heap(heap, heap + size);
+      }
+    }
+    
+    std::copy(next, next + nnext, beam);
+    nbeam = nnext;
+  }
+  
+  std::sort_heap(leaves, leaves + nleaves);
+  
+  for(int i = 0; i < nleaves; ++i)
+  {
+    const Node &node = m_nodes[leaves[i].second];
+    ids[i] = node.word_id;
+    weights[i] = node.weight;
+    distances[i] = leaves[i].first;
+  }
+  
+  if(nid != NULL && nleaves > 0)
+  {
+    // the node at level m_L - levelsup, or the leaf if it is above
+    const int level = std::max(0, 
+      std::min(m_L - levelsup, (int)m_word_depths[ids[0]]));
+    *nid = m_word_paths[ids[0] * m_path_length + level];
+  }
+  
+  return nleaves;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+WordValue TemplatedVocabulary<TDescriptor,F>::addSoftWords(
+  const TDescriptor &feature, BowVector &v, NodeId *nid, int levelsup) const
+{
+  WordId ids[MAX_BEAM_WIDTH];
+  WordValue weights[MAX_BEAM_WIDTH];
+  double distances[MAX_BEAM_WIDTH], shares[MAX_BEAM_WIDTH];
+  
+  const int n = transformBeam(feature, m_soft_words, ids, weights, 
+    distances, nid, levelsup);
+  
+  // exp(-d^2 / (2 sigma^2)), relative to the closest word to avoid 
+  // underflows
+  const double m0 = metric(distances[0]);
+  const double s2 = 2. * m_soft_sigma * m_soft_sigma;
+  double sum = 0.;
+  for(int i = 0; i < n; ++i)
+  {
+    const double m = metric(distances[i]);
+    shares[i] = exp(-(m * m - m0 * m0) / s2);
+    sum += shares[i];
+  }
+  
+  for(int i = 0; i < n; ++i)
+  {
+    // not stopped
+    if(weights[i] > 0) v.addWeight(ids[i], weights[i] * shares[i] / sum);
+  }
+  
+  return weights[0];
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline void TemplatedVocabulary<TDescriptor,F>::prefetchChildren
+  (NodeId nid) const
+{
+  const vector<NodeId> &children = m_nodes[nid].children;
+  vector<NodeId>::const_iterator cit;
+  for(cit = children.begin(); cit != children.end(); ++cit)
+  {
+    const Node &child = m_nodes[*cit];
+    prefetch(&child, sizeof(Node));
+    prefetch(child.descriptor);
   }
 }
 
 // --------------------------------------------------------------------------
 
+template<class TDescriptor, class F>
+template<class T>
+inline void TemplatedVocabulary<TDescriptor,F>::prefetch(const T &d)
+{
+  prefetch(&d, sizeof(T));
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+template<class T>
+inline void TemplatedVocabulary<TDescriptor,F>::prefetch
+  (const std::vector<T> &d)
+{
+  if(!d.empty()) prefetch(&d[0], d.size() * sizeof(T));
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline void TemplatedVocabulary<TDescriptor,F>::prefetch(const cv::Mat &d)
+{
+  if(d.data != NULL) prefetch(d.data, d.total() * d.elemSize());
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+inline void TemplatedVocabulary<TDescriptor,F>::prefetch
+  (const void *p, size_t bytes)
+{
+#if defined(__GNUC__)
+  const char *c = (const char*)p;
+  for(size_t i = 0; i < bytes; i += 64) __builtin_prefetch(c + i);
+#else
+  (void)p;
+  (void)bytes;
+#endif
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+NodeId TemplatedVocabulary<TDescriptor,F>::getParentNode
+  (WordId wid, int levelsup) const
+{
+  const int depth = m_word_depths[wid];
+  if(levelsup >= depth) return 0; // root
+  return m_word_paths[wid * m_path_length + depth - std::max(levelsup, 0)];
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::getWordsFromNode
+  (NodeId nid, std::vector<WordId> &words) const
+{
+  const std::pair<unsigned int, unsigned int> &r = m_node_words[nid];
+  words.assign(m_dfs_words.begin() + r.first, m_dfs_words.begin() + r.second);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+bool TemplatedVocabulary<TDescriptor,F>::getWordRange
+  (NodeId nid, WordId &first, WordId &last) const
+{
+  const std::pair<unsigned int, unsigned int> &r = m_node_words[nid];
+  if(r.first == r.second) return false;
+  
+  first = m_dfs_words[r.first];
+  last = first + (r.second - r.first);
+  
+  return m_node_contiguous[nid];
+}
+
+// --------------------------------------------------------------------------
+
 template<class TDescriptor, class F>
 int TemplatedVocabulary<TDescriptor,F>::stopWords(double minWeight)
 {
@@ -1375,6 +3496,7 @@ bool TemplatedVocabulary<TDescriptor,F>::loadFromTextFile(const std::string &fil
 
     m_nodes.resize(1);
     m_nodes[0].id = 0;
+    bool explicit_ids = false;
     while(!f.eof())
     {
         string snode;
@@ -1405,13 +3527,12 @@ bool TemplatedVocabulary<TDescriptor,F>::loadFromTextFile(const std::string &fil
 
         ssnode >> m_nodes[nid].weight;
 
+        // leaves are marked with 1, or with their word id + 1 if the word
+        // ids are not in node order
         if(nIsLeaf>0)
         {
-            int wid = m_words.size();
-            m_words.resize(wid+1);
-
-            m_nodes[nid].word_id = wid;
-            m_words[wid] = &m_nodes[nid];
+            m_nodes[nid].word_id = nIsLeaf - 1;
+            explicit_ids = explicit_ids || nIsLeaf > 1;
         }
         else
         {
@@ -1419,6 +3540,18 @@ bool TemplatedVocabulary<TDescriptor,F>::loadFromTextFile(const std::string &fil
         }
     }
 
+    if(!explicit_ids)
+    {
+        WordId wid = 0;
+        for(size_t i = 1; i < m_nodes.size(); ++i)
+        {
+            if(m_nodes[i].isLeaf()) m_nodes[i].word_id = wid++;
+        }
+    }
+
+    linkWords();
+    createNodeTables();
+
     return true;
 
 }
@@ -1434,13 +3567,21 @@ void TemplatedVocabulary<TDescriptor,F>::saveToTextFile(const std::string &filen
         std::cout<<"Cannot open: "<<filename.c_str()<<std::endl;
     f << m_k << " " << m_L << " " << " " << m_scoring << " " << m_weighting << endl;
 
+    // grown vocabularies save the word ids if they are not in node order
+    bool ordered = true;
+    WordId next_wid = 0;
+    for(size_t i=1; i<m_nodes.size() && ordered; i++)
+    {
+        if(m_nodes[i].isLeaf()) ordered = (m_nodes[i].word_id == next_wid++);
+    }
+
     for(size_t i=1; i<m_nodes.size();i++)
     {
         const Node& node = m_nodes[i];
 
         f << node.parent << " ";
         if(node.isLeaf())
-            f << 1 << " ";
+            f << (ordered ? 1 : node.word_id + 1) << " ";
         else
             f << 0 << " ";
 
@@ -1621,6 +3762,157 @@ void TemplatedVocabulary<TDescriptor,F>::load(const cv::FileStorage &fs,
     m_nodes[nid].word_id = wid;
     m_words[wid] = &m_nodes[nid];
   }
+  
+  createNodeTables();
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+TemplatedVocabulary<TDescriptor,F>::TransformCache::TransformCache(
+  const TemplatedVocabulary &voc, unsigned int capacity, int hint_levelsup)
+  : m_voc(&voc), m_slots(std::max(capacity, 1u)), 
+  m_hint_levelsup(hint_levelsup), m_hits(0), m_misses(0)
+{
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+WordId TemplatedVocabulary<TDescriptor,F>::TransformCache::transform(
+  const TDescriptor &feature, WordId hint, WordValue *weight)
+{
+  if(m_voc->empty())
+  {
+    if(weight) *weight = 0;
+    return 0;
+  }
+  
+  const size_t hash = DescriptorHash<F>::hash(feature);
+  Slot &slot = m_slots[hash % m_slots.size()];
+  
+  if(slot.used && slot.hash == hash && 
+    F::distance(feature, slot.descriptor) == 0)
+  {
+    ++m_hits;
+    if(weight) *weight = m_voc->m_words[slot.word_id]->weight;
+    return slot.word_id;
+  }
+  
+  ++m_misses;
+  
+  WordValue w;
+  if(hint < m_voc->size())
+  {
+    const WordId wid = m_voc->transformFromHint(feature, hint, 
+      m_hint_levelsup, &w);
+    if(weight) *weight = w;
+    return wid;
+  }
+  
+  m_voc->transform(feature, slot.word_id, w);
+  
+  copyDescriptor(feature, slot.descriptor);
+  slot.hash = hash;
+  slot.used = true;
+  
+  if(weight) *weight = w;
+  return slot.word_id;
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::TransformCache::transform(
+  const std::vector<TDescriptor> &features, BowVector &v,
+  const std::vector<WordId> *hints, std::vector<WordId> *words)
+{
+  if(m_voc->empty() || (m_voc->m_soft_words > 1 && 
+    (m_voc->m_weighting == TF || m_voc->m_weighting == TF_IDF)))
+  {
+    m_voc->transform(features, v);
+    if(words) words->assign(features.size(), 
+      std::numeric_limits<WordId>::max());
+    return;
+  }
+  
+  vector<WordId> ids;
+  vector<WordValue> weights;
+  transformFeatures(features, hints, ids, weights);
+  m_voc->makeBowVector(ids, weights, v);
+  
+  if(words) words->swap(ids);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::TransformCache::transform(
+  const std::vector<TDescriptor> &features, BowVector &v, 
+  FeatureVector &fv, int levelsup, const std::vector<WordId> *hints, 
+  std::vector<WordId> *words)
+{
+  if(m_voc->empty() || (m_voc->m_soft_words > 1 && 
+    (m_voc->m_weighting == TF || m_voc->m_weighting == TF_IDF)))
+  {
+    m_voc->transform(features, v, fv, levelsup);
+    if(words) words->assign(features.size(), 
+      std::numeric_limits<WordId>::max());
+    return;
+  }
+  
+  vector<WordId> ids;
+  vector<WordValue> weights;
+  transformFeatures(features, hints, ids, weights);
+  
+  // the node at level m_L - levelsup, or the leaf if it is above
+  vector<NodeId> nids(ids.size());
+  for(size_t i = 0; i < ids.size(); ++i)
+  {
+    const int level = std::max(0, 
+      std::min(m_voc->m_L - levelsup, (int)m_voc->m_word_depths[ids[i]]));
+    nids[i] = m_voc->m_word_paths[ids[i] * m_voc->m_path_length + level];
+  }
+  
+  std::vector<std::pair<NodeId, unsigned int> > nodes;
+  m_voc->makeBowVector(ids, weights, v, &nids, &nodes);
+  
+  fv.clear();
+  std::vector<std::pair<NodeId, unsigned int> >::const_iterator nit;
+  for(nit = nodes.begin(); nit != nodes.end(); ++nit)
+    fv.addFeature(nit->first, nit->second);
+  
+  if(words) words->swap(ids);
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::TransformCache::transformFeatures(
+  const std::vector<TDescriptor> &features, 
+  const std::vector<WordId> *hints, std::vector<WordId> &ids, 
+  std::vector<WordValue> &weights)
+{
+  ids.resize(features.size());
+  weights.resize(features.size());
+  
+  for(size_t i = 0; i < features.size(); ++i)
+  {
+    const WordId hint = (hints != NULL && i < hints->size() ? 
+      (*hints)[i] : std::numeric_limits<WordId>::max());
+    ids[i] = transform(features[i], hint, &weights[i]);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+template<class TDescriptor, class F>
+void TemplatedVocabulary<TDescriptor,F>::TransformCache::clear()
+{
+  const size_t capacity = m_slots.size();
+  m_slots.clear();
+  m_slots.resize(capacity);
+  m_hits = m_misses = 0;
 }
 
 // --------------------------------------------------------------------------
@@ -0,0 +1,104 @@
+/**
+ * File: BitCounter.cpp
+ * Date: October 2026
+ * Description: counters of the set bits of many binary descriptors
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#include <vector>
+#include "BitCounter.h"
+
+using namespace std;
+
+namespace DBoW2 {
+
+// ---------------------------------------------------------------------------
+
+/// Table with the 8 bits of each byte spread to the bytes of a word, so 
+/// that byte i of SpreadTable::v[b] is bit i of b
+static struct SpreadTable
+{
+  uint64_t v[256];
+
+  SpreadTable()
+  {
+    for(int b = 0; b < 256; ++b)
+    {
+      v[b] = 0;
+      for(int i = 0; i < 8; ++i)
+      {
+        if(b & (1 << i)) v[b] |= (uint64_t)1 << (8 * i);
+      }
+    }
+  }
+} spread_table;
+
+// ---------------------------------------------------------------------------
+
+BitCounter::BitCounter(size_t nbytes)
+{
+  reset(nbytes);
+}
+
+// ---------------------------------------------------------------------------
+
+void BitCounter::reset(size_t nbytes)
+{
+  m_lanes.assign(nbytes, 0);
+  m_counts.assign(nbytes * 8, 0);
+  m_pending = 0;
+  m_n = 0;
+}
+
+// ---------------------------------------------------------------------------
+
+void BitCounter::add(const unsigned char *bytes)
+{
+  const uint64_t *table = spread_table.v;
+  uint64_t *lane = m_lanes.empty() ? NULL : &m_lanes[0];
+  const size_t nbytes = m_lanes.size();
+
+  for(size_t j = 0; j < nbytes; ++j)
+  {
+    lane[j] += table[bytes[j]];
+  }
+
+  ++m_n;
+
+  // a byte counter overflows after 255 strings
+  if(++m_pending == 255) flush();
+}
+
+// ---------------------------------------------------------------------------
+
+const std::vector<unsigned int>& BitCounter::counts()
+{
+  flush();
+  return m_counts;
+}
+
+// ---------------------------------------------------------------------------
+
+void BitCounter::flush()
+{
+  if(m_pending == 0) return;
+
+  for(size_t j = 0; j < m_lanes.size(); ++j)
+  {
+    uint64_t lane = m_lanes[j];
+    unsigned int *c = &m_counts[j * 8];
+    for(int i = 0; i < 8; ++i, lane >>= 8)
+    {
+      c[i] += (unsigned int)(lane & 0xff);
+    }
+    m_lanes[j] = 0;
+  }
+
+  m_pending = 0;
+}
+
+// ---------------------------------------------------------------------------
+
+} // namespace DBoW2
+
@@ -0,0 +1,252 @@
+/**
+ * File: CompactFeatureVector.cpp
+ * Date: October 2026
+ * Description: feature vectors stored in contiguous arrays (CSR layout)
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#include "CompactFeatureVector.h"
+#include <algorithm>
+#include <vector>
+#include <iostream>
+
+using namespace std;
+
+namespace DBoW2 {
+
+// ---------------------------------------------------------------------------
+
+FeatureVectorView::const_iterator FeatureVectorView::find(NodeId id) const
+{
+  const NodeId *it = std::lower_bound(m_nodes, m_nodes + m_size, id);
+  if(it != m_nodes + m_size && *it == id)
+  {
+    const size_t i = it - m_nodes;
+    return const_iterator(m_nodes + i, m_offsets + i, m_features);
+  }
+  return end();
+}
+
+// ---------------------------------------------------------------------------
+
+void FeatureVectorView::toFeatureVector(FeatureVector &fv) const
+{
+  fv.clear();
+  for(size_t i = 0; i < m_size; ++i)
+  {
+    const FeatureIndices f = features(i);
+    fv.insert(fv.end(), FeatureVector::value_type(m_nodes[i],
+      std::vector<unsigned int>(f.begin(), f.end()) ));
+  }
+}
+
+// ---------------------------------------------------------------------------
+
+std::ostream& operator<<(std::ostream &out, const FeatureVectorView &v)
+{
+  for(size_t i = 0; i < v.size(); ++i)
+  {
+    const FeatureIndices f = v.features(i);
+
+    if(i > 0) out << ", ";
+    out << "<" << v.nodeId(i) << ": [";
+    if(!f.empty()) out << f[0];
+    for(size_t j = 1; j < f.size(); ++j)
+    {
+      out << ", " << f[j];
+    }
+    out << "]>";
+  }
+
+  return out;
+}
+
+// ---------------------------------------------------------------------------
+
+CompactFeatureVector::CompactFeatureVector()
+  : m_offsets(1, 0)
+{
+}
+
+// ---------------------------------------------------------------------------
+
+CompactFeatureVector::CompactFeatureVector(const FeatureVector &fv)
+{
+  assign(fv);
+}
+
+// ---------------------------------------------------------------------------
+
+void CompactFeatureVector::clear()
+{
+  m_nodes.resize(0);
+  m_offsets.resize(1);
+  m_offsets[0] = 0;
+  m_features.resize(0);
+}
+
+// ---------------------------------------------------------------------------
+
+void CompactFeatureVector::assign(
+  std::vector<std::pair<NodeId, unsigned int> > &pairs)
+{
+  clear();
+
+  // nodes in ascending order, features in ascending order in each node
+  std::sort(pairs.begin(), pairs.end());
+
+  m_features.reserve(pairs.size());
+
+  std::vector<std::pair<NodeId, unsigned int> >::const_iterator pit;
+  for(pit = pairs.begin(); pit != pairs.end(); ++pit)
+  {
+    if(m_nodes.empty() || m_nodes.back() != pit->first)
+    {
+      if(!m_nodes.empty()) m_offsets.push_back(m_features.size());
+      m_nodes.push_back(pit->first);
+    }
+    m_features.push_back(pit->second);
+  }
+
+  if(!m_nodes.empty()) m_offsets.push_back(m_features.size());
+}
+
+// ---------------------------------------------------------------------------
+
+void CompactFeatureVector::assign(const FeatureVector &fv)
+{
+  m_nodes.resize(0);
+  m_offsets.resize(0);
+  m_features.resize(0);
+
+  m_nodes.reserve(fv.size());
+  m_offsets.reserve(fv.size() + 1);
+  m_offsets.push_back(0);
+
+  FeatureVector::const_iterator fit;
+  for(fit = fv.begin(); fit != fv.end(); ++fit)
+  {
+    m_nodes.push_back(fit->first);
+    m_features.insert(m_features.end(), fit->second.begin(),
+      fit->second.end());
+    m_offsets.push_back(m_features.size());
+  }
+}
+
+// ---------------------------------------------------------------------------
+
+FeatureVectorView CompactFeatureVector::view() const
+{
+  return FeatureVectorView(
+    m_nodes.empty() ? NULL : &m_nodes[0],
+    &m_offsets[0],
+    m_features.empty() ? NULL : &m_features[0],
+    m_nodes.size());
+}
+
+// ---------------------------------------------------------------------------
+
+CompactDirectFile::CompactDirectFile()
+  : m_node_offsets(1, 0), m_entry_offsets(1, 0)
+{
+}
+
+// ---------------------------------------------------------------------------
+
+void CompactDirectFile::clear()
+{
+  m_nodes.resize(0);
+  m_node_offsets.resize(1);
+  m_node_offsets[0] = 0;
+  m_features.resize(0);
+  m_entry_offsets.resize(1);
+  m_entry_offsets[0] = 0;
+}
+
+// ---------------------------------------------------------------------------
+
+void CompactDirectFile::reserve(size_t nentries, size_t nnodes,
+  size_t nfeatures)
+{
+  m_entry_offsets.reserve(nentries + 1);
+  m_nodes.reserve(nnodes);
+  m_node_offsets.reserve(nnodes + 1);
+  m_features.reserve(nfeatures);
+}
+
+// ---------------------------------------------------------------------------
+
+void CompactDirectFile::push_back(const FeatureVector &fv)
+{
+  push_back();
+
+  FeatureVector::const_iterator fit;
+  for(fit = fv.begin(); fit != fv.end(); ++fit)
+  {
+    m_nodes.push_back(fit->first);
+    m_features.insert(m_features.end(), fit->second.begin(),
+      fit->second.end());
+    m_node_offsets.push_back(m_features.size());
+  }
+  m_entry_offsets.back() = m_nodes.size();
+}
+
+// ---------------------------------------------------------------------------
+
+void CompactDirectFile::push_back(const FeatureVectorView &fv)
+{
+  push_back();
+
+  for(size_t i = 0; i < fv.size(); ++i)
+  {
+    const FeatureIndices f = fv.features(i);
+    m_nodes.push_back(fv.nodeId(i));
+    m_features.insert(m_features.end(), f.begin(), f.end());
+    m_node_offsets.push_back(m_features.size());
+  }
+  m_entry_offsets.back() = m_nodes.size();
+}
+
+// ---------------------------------------------------------------------------
+
+void CompactDirectFile::push_back()
+{
+  m_entry_offsets.push_back(m_nodes.size());
+}
+
+// ---------------------------------------------------------------------------
+
+void CompactDirectFile::addNode(NodeId id)
+{
+  m_nodes.push_back(id);
+  m_node_offsets.push_back(m_features.size());
+  m_entry_offsets.back() = m_nodes.size();
+}
+
+// ---------------------------------------------------------------------------
+
+void CompactDirectFile::addFeature(unsigned int i_feature)
+{
+  m_features.push_back(i_feature);
+  m_node_offsets.back() = m_features.size();
+}
+
+// ---------------------------------------------------------------------------
+
+FeatureVectorView CompactDirectFile::operator[](size_t i) const
+{
+  const unsigned int first = m_entry_offsets[i];
+  const unsigned int n = m_entry_offsets[i+1] - first;
+
+  return FeatureVectorView(
+    n == 0 ? NULL : &m_nodes[first],
+    &m_node_offsets[first],
+    m_features.empty() ? NULL : &m_features[0],
+    n);
+}
+
+// ---------------------------------------------------------------------------
+
+} // namespace DBoW2
+
@@ -0,0 +1,183 @@
+/**
+ * File: EntryFilter.cpp
+ * Date: October 2026
+ * Description: set of database entries that can be returned by a query
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#include <iostream>
+#include <limits>
+#include "EntryFilter.h"
+
+using namespace std;
+
+namespace DBoW2
+{
+
+// ---------------------------------------------------------------------------
+
+/// Returns the index of the lowest set bit of a non-zero word
+static inline unsigned int lowestBit(uint64_t w)
+{
+#ifdef __GNUC__
+  return __builtin_ctzll(w);
+#else
+  unsigned int i = 0;
+  for(; !(w & 1); w >>= 1) ++i;
+  return i;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+
+EntryFilter::EntryFilter(bool allowed)
+  : m_default(allowed)
+{
+}
+
+// ---------------------------------------------------------------------------
+
+void EntryFilter::allow(EntryId id)
+{
+  set(id, id + 1, true);
+}
+
+// ---------------------------------------------------------------------------
+
+void EntryFilter::allow(EntryId first, EntryId last)
+{
+  set(first, last, true);
+}
+
+// ---------------------------------------------------------------------------
+
+void EntryFilter::deny(EntryId id)
+{
+  set(id, id + 1, false);
+}
+
+// ---------------------------------------------------------------------------
+
+void EntryFilter::deny(EntryId first, EntryId last)
+{
+  set(first, last, false);
+}
+
+// ---------------------------------------------------------------------------
+
+void EntryFilter::reset(bool allowed)
+{
+  m_bits.clear();
+  m_default = allowed;
+}
+
+// ---------------------------------------------------------------------------
+
+void EntryFilter::set(EntryId first, EntryId last, bool allowed)
+{
+  if(first >= last) return;
+
+  // the bitmap only grows to store entries different from the default
+  const size_t wlast = (last - 1) >> 6;
+  if(wlast >= m_bits.size())
+  {
+    if(allowed == m_default)
+    {
+      if((first >> 6) >= m_bits.size()) return;
+      last = (EntryId)(m_bits.size() << 6);
+    }
+    else
+      m_bits.resize(wlast + 1, m_default ? ~(uint64_t)0 : 0);
+  }
+
+  for(EntryId i = first; i < last; )
+  {
+    const size_t w = i >> 6;
+    const unsigned int b = i & 63;
+    const unsigned int n = (last - i < 64 - b ? last - i : 64 - b);
+    const uint64_t mask = (n == 64 ? ~(uint64_t)0 :
+      (((uint64_t)1 << n) - 1) << b);
+
+    if(allowed) m_bits[w] |= mask;
+    else m_bits[w] &= ~mask;
+
+    i += n;
+  }
+}
+
+// ---------------------------------------------------------------------------
+
+EntryId EntryFilter::nextAllowed(EntryId id) const
+{
+  size_t w = id >> 6;
+  if(w < m_bits.size())
+  {
+    uint64_t bits = m_bits[w] & (~(uint64_t)0 << (id & 63));
+    while(bits == 0 && ++w < m_bits.size()) bits = m_bits[w];
+
+    if(bits != 0) return (EntryId)((w << 6) + lowestBit(bits));
+    id = (EntryId)(m_bits.size() << 6);
+  }
+
+  return m_default ? id : numeric_limits<EntryId>::max();
+}
+
+// ---------------------------------------------------------------------------
+
+bool EntryFilter::anyAllowed(EntryId first, EntryId last) const
+{
+  return first < last && nextAllowed(first) < last;
+}
+
+// ---------------------------------------------------------------------------
+
+bool EntryFilter::allAllowed(EntryId first, EntryId last) const
+{
+  for(EntryId i = first; i < last; )
+  {
+    const size_t w = i >> 6;
+    if(w >= m_bits.size()) return m_default;
+
+    const unsigned int b = i & 63;
+    const unsigned int n = (last - i < 64 - b ? last - i : 64 - b);
+    const uint64_t mask = (n == 64 ? ~(uint64_t)0 :
+      (((uint64_t)1 << n) - 1) << b);
+
+    if((m_bits[w] & mask) != mask) return false;
+    i += n;
+  }
+  return true;
+}
+
+// ---------------------------------------------------------------------------
+
+ostream & operator<<(ostream& os, const EntryFilter& filter)
+{
+  os << "<Allowed:";
+
+  const EntryId end = (EntryId)(filter.m_bits.size() << 6);
+  EntryId i = filter.nextAllowed(0);
+  while(i < end)
+  {
+    EntryId j = i + 1;
+    while(j < end && filter.isAllowed(j)) ++j;
+
+    if(j == end && filter.m_default)
+      os << " [" << i << ", ...)";
+    else
+      os << " [" << i << ", " << j << ")";
+
+    i = (j < end ? filter.nextAllowed(j) : end);
+  }
+  if(i == end && filter.m_default && (end == 0 || !filter.isAllowed(end - 1)))
+    os << " [" << end << ", ...)";
+
+  os << ">";
+  return os;
+}
+
+// ---------------------------------------------------------------------------
+
+} // namespace DBoW2
+
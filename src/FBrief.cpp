@@ -13,6 +13,7 @@
 
 #include <DVision/DVision.h>
 #include "FBrief.h"
+#include "BitCounter.h"
 
 using namespace std;
 
@@ -30,21 +31,37 @@ void FBrief::meanValue(const std::vector<FBrief::pDescriptor> &descriptors,
   const int N2 = descriptors.size() / 2;
   const int L = descriptors[0]->size();
   
-  vector<int> counters(L, 0);
+  // the bits are counted from the blocks of the bitsets, whose bit i is 
+  // bit (i % bits_per_block) of block (i / bits_per_block)
+  typedef FBrief::TDescriptor::block_type Block;
+  vector<Block> blocks(descriptors[0]->num_blocks());
+  vector<unsigned char> bytes(blocks.size() * sizeof(Block));
+  
+  BitCounter counter(bytes.size());
 
   vector<FBrief::pDescriptor>::const_iterator it;
   for(it = descriptors.begin(); it != descriptors.end(); ++it)
   {
-    const FBrief::TDescriptor &desc = **it;
-    for(int i = 0; i < L; ++i)
+    boost::to_block_range(**it, blocks.begin());
+    
+    unsigned char *p = &bytes[0];
+    for(size_t k = 0; k < blocks.size(); ++k)
     {
-      if(desc[i]) counters[i]++;
+      Block block = blocks[k];
+      for(size_t b = 0; b < sizeof(Block); ++b, ++p, block >>= 8)
+      {
+        *p = (unsigned char)(block & 0xff);
+      }
     }
+    
+    counter.add(&bytes[0]);
   }
   
+  const vector<unsigned int> &counters = counter.counts();
+  
   for(int i = 0; i < L; ++i)
   {
-    if(counters[i] > N2) mean.set(i);
+    if((int)counters[i] > N2) mean.set(i);
   }
   
 }
@@ -57,6 +74,18 @@ double FBrief::distance(const FBrief::TDescriptor &a,
   return (double)DVision::BRIEF::distance(a, b);
 }
 
+// --------------------------------------------------------------------------
+
+size_t FBrief::hash(const FBrief::TDescriptor &a)
+{
+  // from the blocks of the bitset, without formatting its bits
+  std::vector<FBrief::TDescriptor::block_type> blocks(a.num_blocks());
+  boost::to_block_range(a, blocks.begin());
+  
+  if(blocks.empty()) return hashBytes(NULL, 0);
+  return hashBytes(&blocks[0], blocks.size() * sizeof(blocks[0]));
+}
+
 // --------------------------------------------------------------------------
   
 std::string FBrief::toString(const FBrief::TDescriptor &a)
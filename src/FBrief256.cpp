@@ -0,0 +1,231 @@
+/**
+ * File: FBrief256.cpp
+ * Date: October 2026
+ * Description: functions for BRIEF descriptors stored in fixed-size values
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cstring>
+
+#include <DVision/DVision.h>
+#include "FBrief256.h"
+
+using namespace std;
+
+namespace DBoW2 {
+
+// --------------------------------------------------------------------------
+
+void FBrief256::meanValue(
+  const std::vector<FBrief256::pDescriptor> &descriptors,
+  FBrief256::TDescriptor &mean)
+{
+  memset(mean.bits, 0, sizeof(mean.bits));
+
+  if(descriptors.empty())
+  {
+    return;
+  }
+  else if(descriptors.size() == 1)
+  {
+    mean = *descriptors[0];
+    return;
+  }
+
+  // the counters are bit-sliced: bit j of word w of plane k is bit k of
+  // the counter of bit (w*64 + j), so that a descriptor is added to the 256
+  // counters with a ripple-carry addition of 4 words per plane, which stops
+  // as soon as there is nothing left to carry
+  const size_t N = descriptors.size();
+  int P = 0;
+  while((N >> P) != 0) ++P;
+
+  vector<uint64_t> planes(P * 4, 0);
+
+  vector<FBrief256::pDescriptor>::const_iterator it;
+  for(it = descriptors.begin(); it != descriptors.end(); ++it)
+  {
+    uint64_t c[4];
+    memcpy(c, (*it)->bits, sizeof(c));
+
+    for(int k = 0; k < P && (c[0] | c[1] | c[2] | c[3]); ++k)
+    {
+      uint64_t *p = &planes[k * 4];
+      for(int w = 0; w < 4; ++w)
+      {
+        const uint64_t carry = p[w] & c[w];
+        p[w] ^= c[w];
+        c[w] = carry;
+      }
+    }
+  }
+
+  // a bit is set if its counter is greater than N2, as in FBrief. The
+  // counters are compared from the most significant plane, keeping the
+  // counters that are still equal to N2 and those already greater
+  const size_t N2 = N / 2;
+  uint64_t eq[4] = { ~(uint64_t)0, ~(uint64_t)0, ~(uint64_t)0, ~(uint64_t)0 };
+
+  for(int k = P - 1; k >= 0; --k)
+  {
+    const uint64_t *p = &planes[k * 4];
+    if((N2 >> k) & 1)
+    {
+      for(int w = 0; w < 4; ++w) eq[w] &= p[w];
+    }
+    else
+    {
+      for(int w = 0; w < 4; ++w)
+      {
+        mean.bits[w] |= eq[w] & p[w];
+        eq[w] &= ~p[w];
+      }
+    }
+  }
+}
+
+// --------------------------------------------------------------------------
+
+size_t FBrief256::hash(const FBrief256::TDescriptor &a)
+{
+  return hashBytes(a.bits, sizeof(a.bits));
+}
+
+// --------------------------------------------------------------------------
+
+std::string FBrief256::toString(const FBrief256::TDescriptor &a)
+{
+  // as boost::to_string, from the most significant bit
+  string s(FBrief256::BITS, '0');
+
+  for(int i = 0; i < FBrief256::BITS; ++i)
+  {
+    if(a.bits[i / 64] & ((uint64_t)1 << (i % 64)))
+      s[FBrief256::BITS - 1 - i] = '1';
+  }
+
+  return s;
+}
+
+// --------------------------------------------------------------------------
+
+void FBrief256::fromString(FBrief256::TDescriptor &a, const std::string &s)
+{
+  memset(a.bits, 0, sizeof(a.bits));
+
+  // as boost::dynamic_bitset's operator>>, from the most significant bit
+  string b;
+  stringstream ss(s);
+  ss >> b;
+
+  const int n = (int)b.size();
+  for(int j = 0; j < n; ++j)
+  {
+    const int i = n - 1 - j;
+    if(i < FBrief256::BITS && b[j] == '1')
+      a.bits[i / 64] |= (uint64_t)1 << (i % 64);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+void FBrief256::toMat32F(const std::vector<TDescriptor> &descriptors,
+  cv::Mat &mat)
+{
+  if(descriptors.empty())
+  {
+    mat.release();
+    return;
+  }
+
+  const size_t N = descriptors.size();
+
+  mat.create(N, FBrief256::BITS, CV_32F);
+  float *p = mat.ptr<float>();
+
+  for(size_t i = 0; i < N; ++i)
+  {
+    const uint64_t *desc = descriptors[i].bits;
+
+    for(int j = 0; j < FBrief256::BITS; ++j, ++p)
+    {
+      *p = ((desc[j / 64] >> (j % 64)) & 1 ? 1 : 0);
+    }
+  }
+}
+
+// --------------------------------------------------------------------------
+
+void FBrief256::fromBitset(const DVision::BRIEF::bitset &a,
+  FBrief256::TDescriptor &b)
+{
+  if(a.size() != (size_t)FBrief256::BITS)
+    throw std::string("BRIEF descriptors must have 256 bits");
+
+  // block k holds bits [k*B, (k+1)*B), and B divides 64
+  typedef DVision::BRIEF::bitset::block_type Block;
+  const size_t B = DVision::BRIEF::bitset::bits_per_block;
+
+  Block blocks[FBrief256::BITS / DVision::BRIEF::bitset::bits_per_block];
+  boost::to_block_range(a, blocks);
+
+  memset(b.bits, 0, sizeof(b.bits));
+  for(size_t k = 0; k < a.num_blocks(); ++k)
+  {
+    b.bits[k * B / 64] |= (uint64_t)blocks[k] << (k * B % 64);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+void FBrief256::fromBitset(const std::vector<DVision::BRIEF::bitset> &a,
+  std::vector<FBrief256::TDescriptor> &b)
+{
+  b.resize(a.size());
+
+  for(size_t i = 0; i < a.size(); ++i)
+  {
+    fromBitset(a[i], b[i]);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+void FBrief256::toBitset(const FBrief256::TDescriptor &a,
+  DVision::BRIEF::bitset &b)
+{
+  typedef DVision::BRIEF::bitset::block_type Block;
+  const size_t B = DVision::BRIEF::bitset::bits_per_block;
+
+  Block blocks[FBrief256::BITS / DVision::BRIEF::bitset::bits_per_block];
+  const size_t nblocks = sizeof(blocks) / sizeof(Block);
+
+  for(size_t k = 0; k < nblocks; ++k)
+  {
+    blocks[k] = (Block)(a.bits[k * B / 64] >> (k * B % 64));
+  }
+
+  b.clear();
+  b.append(blocks, blocks + nblocks);
+}
+
+// --------------------------------------------------------------------------
+
+void FBrief256::toBitset(const std::vector<FBrief256::TDescriptor> &a,
+  std::vector<DVision::BRIEF::bitset> &b)
+{
+  b.resize(a.size());
+
+  for(size_t i = 0; i < a.size(); ++i)
+  {
+    toBitset(a[i], b[i]);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+} // namespace DBoW2
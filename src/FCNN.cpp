@@ -2,6 +2,7 @@
 #include <string>
 #include <sstream>
 #include <cmath>
+#include <limits>
 #include<iostream>
 #include "FClass.h"
 #include "FCNN.h"
@@ -48,12 +49,37 @@ double FCNN::distance(const FCNN::TDescriptor &a, const FCNN::TDescriptor &b)
 //  double norm_dot_prod = dot_prod / ((sqrt(l2_norm_a)*sqrt(l2_norm_b)));
 //  cosine_dist = 1 - norm_dot_prod;
 //  return cosine_dist;
-    double sqd = 0;
-    for(int i = 0; i < FCNN::L; ++i)
+    return distance(a, b, std::numeric_limits<double>::max());
+}
+
+// --------------------------------------------------------------------------
+
+double FCNN::distance(const FCNN::TDescriptor &a, const FCNN::TDescriptor &b,
+  double bound)
+{
+  // four independent sums, so that the compiler can use SIMD instructions.
+  // The bound is checked after each block of 16 dimensions
+  double s0 = 0., s1 = 0., s2 = 0., s3 = 0.;
+  for(int i = 0; i < FCNN::L; i += 16)
+  {
+    for(int j = i; j < i + 16; j += 4)
     {
-        sqd += ((a[i]-b[i])*(a[i]-b[i]));
+      s0 += ((a[j  ]-b[j  ])*(a[j  ]-b[j  ]));
+      s1 += ((a[j+1]-b[j+1])*(a[j+1]-b[j+1]));
+      s2 += ((a[j+2]-b[j+2])*(a[j+2]-b[j+2]));
+      s3 += ((a[j+3]-b[j+3])*(a[j+3]-b[j+3]));
     }
-    return sqd;
+
+    if((s0 + s1) + (s2 + s3) >= bound) break;
+  }
+  return (s0 + s1) + (s2 + s3);
+}
+
+// --------------------------------------------------------------------------
+
+size_t FCNN::hash(const FCNN::TDescriptor &a)
+{
+  return hashBytes(&a[0], a.size() * sizeof(double));
 }
 
 // --------------------------------------------------------------------------
@@ -12,10 +12,12 @@
 #include <sstream>
 #include <stdint.h>
 #include <limits.h>
+#include <limits>
 
 #include <DUtils/DUtils.h>
 #include <DVision/DVision.h>
 #include "FORB.h"
+#include "BitCounter.h"
 
 using namespace std;
 
@@ -37,39 +39,28 @@ void FORB::meanValue(const std::vector<FORB::pDescriptor> &descriptors,
   }
   else
   {
-    vector<int> sum(FORB::L * 8, 0);
+    // sum[j*8 + b] counts bit b of byte j
+    BitCounter counter(FORB::L);
     
     for(size_t i = 0; i < descriptors.size(); ++i)
     {
-      const cv::Mat &d = *descriptors[i];
-      const unsigned char *p = d.ptr<unsigned char>();
-      
-      for(int j = 0; j < d.cols; ++j, ++p)
-      {
-        if(*p & (1 << 7)) ++sum[ j*8     ];
-        if(*p & (1 << 6)) ++sum[ j*8 + 1 ];
-        if(*p & (1 << 5)) ++sum[ j*8 + 2 ];
-        if(*p & (1 << 4)) ++sum[ j*8 + 3 ];
-        if(*p & (1 << 3)) ++sum[ j*8 + 4 ];
-        if(*p & (1 << 2)) ++sum[ j*8 + 5 ];
-        if(*p & (1 << 1)) ++sum[ j*8 + 6 ];
-        if(*p & (1))      ++sum[ j*8 + 7 ];
-      }
+      counter.add(descriptors[i]->ptr<unsigned char>());
     }
     
+    const vector<unsigned int> &sum = counter.counts();
+    
     mean = cv::Mat::zeros(1, FORB::L, CV_8U);
     unsigned char *p = mean.ptr<unsigned char>();
     
-    const int N2 = (int)descriptors.size() / 2 + descriptors.size() % 2;
-    for(size_t i = 0; i < sum.size(); ++i)
+    const unsigned int N2 = 
+      (unsigned int)(descriptors.size() / 2 + descriptors.size() % 2);
+    for(int j = 0; j < FORB::L; ++j, ++p)
     {
-      if(sum[i] >= N2)
+      for(int b = 0; b < 8; ++b)
       {
         // set bit
-        *p |= 1 << (7 - (i % 8));
+        if(sum[j*8 + b] >= N2) *p |= 1 << b;
       }
-      
-      if(i % 8 == 7) ++p;
     }
   }
 }
@@ -78,6 +69,14 @@ void FORB::meanValue(const std::vector<FORB::pDescriptor> &descriptors,
   
 double FORB::distance(const FORB::TDescriptor &a, 
   const FORB::TDescriptor &b)
+{
+  return distance(a, b, std::numeric_limits<double>::max());
+}
+
+// --------------------------------------------------------------------------
+
+double FORB::distance(const FORB::TDescriptor &a, 
+  const FORB::TDescriptor &b, double bound)
 {
   // Bit count function got from:
   // http://graphics.stanford.edu/~seander/bithacks.html#CountBitsSetKernighan
@@ -97,6 +96,9 @@ double FORB::distance(const FORB::TDescriptor &a,
     v = (v + (v >> 4)) & (uint64_t)~(uint64_t)0/255*15;
     ret += (uint64_t)(v * ((uint64_t)~(uint64_t)0/255)) >> 
       (sizeof(uint64_t) - 1) * CHAR_BIT;
+    
+    // the bound is checked once per 64 bits
+    if((double)ret >= bound) break;
   }
   
   return ret;
@@ -116,6 +118,13 @@ double FORB::distance(const FORB::TDescriptor &a,
   // return ret;
 }
 
+// --------------------------------------------------------------------------
+
+size_t FORB::hash(const FORB::TDescriptor &a)
+{
+  return hashBytes(a.ptr<unsigned char>(), a.cols);
+}
+
 // --------------------------------------------------------------------------
   
 std::string FORB::toString(const FORB::TDescriptor &a)
@@ -0,0 +1,204 @@
+/**
+ * File: FORB256.cpp
+ * Date: October 2026
+ * Description: functions for ORB descriptors stored in fixed-size values
+ * License: see the LICENSE.txt file
+ *
+ */
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cstring>
+
+#include "FORB256.h"
+#include "BitCounter.h"
+
+using namespace std;
+
+namespace DBoW2 {
+
+// --------------------------------------------------------------------------
+
+void FORB256::meanValue(const std::vector<FORB256::pDescriptor> &descriptors,
+  FORB256::TDescriptor &mean)
+{
+  memset(mean.bits, 0, sizeof(mean.bits));
+
+  if(descriptors.empty())
+  {
+    return;
+  }
+  else if(descriptors.size() == 1)
+  {
+    mean = *descriptors[0];
+  }
+  else
+  {
+    // sum[j*8 + b] counts bit b of byte j
+    BitCounter counter(FORB256::L);
+
+    for(size_t i = 0; i < descriptors.size(); ++i)
+    {
+      counter.add((const unsigned char*)descriptors[i]->bits);
+    }
+
+    const vector<unsigned int> &sum = counter.counts();
+
+    unsigned char *p = (unsigned char*)mean.bits;
+
+    const unsigned int N2 =
+      (unsigned int)(descriptors.size() / 2 + descriptors.size() % 2);
+    for(int j = 0; j < FORB256::L; ++j, ++p)
+    {
+      for(int b = 0; b < 8; ++b)
+      {
+        // set bit
+        if(sum[j*8 + b] >= N2) *p |= 1 << b;
+      }
+    }
+  }
+}
+
+// --------------------------------------------------------------------------
+
+size_t FORB256::hash(const FORB256::TDescriptor &a)
+{
+  return hashBytes(a.bits, FORB256::L);
+}
+
+// --------------------------------------------------------------------------
+
+std::string FORB256::toString(const FORB256::TDescriptor &a)
+{
+  stringstream ss;
+  const unsigned char *p = (const unsigned char*)a.bits;
+
+  for(int i = 0; i < FORB256::L; ++i, ++p)
+  {
+    ss << (int)*p << " ";
+  }
+
+  return ss.str();
+}
+
+// --------------------------------------------------------------------------
+
+void FORB256::fromString(FORB256::TDescriptor &a, const std::string &s)
+{
+  memset(a.bits, 0, sizeof(a.bits));
+  unsigned char *p = (unsigned char*)a.bits;
+
+  stringstream ss(s);
+  for(int i = 0; i < FORB256::L; ++i, ++p)
+  {
+    int n;
+    ss >> n;
+
+    if(!ss.fail())
+      *p = (unsigned char)n;
+  }
+}
+
+// --------------------------------------------------------------------------
+
+void FORB256::toMat32F(const std::vector<TDescriptor> &descriptors,
+  cv::Mat &mat)
+{
+  if(descriptors.empty())
+  {
+    mat.release();
+    return;
+  }
+
+  const size_t N = descriptors.size();
+
+  mat.create(N, FORB256::L*8, CV_32F);
+  float *p = mat.ptr<float>();
+
+  for(size_t i = 0; i < N; ++i)
+  {
+    const unsigned char *desc = (const unsigned char*)descriptors[i].bits;
+
+    for(int j = 0; j < FORB256::L; ++j, p += 8)
+    {
+      p[0] = (desc[j] & (1 << 7) ? 1 : 0);
+      p[1] = (desc[j] & (1 << 6) ? 1 : 0);
+      p[2] = (desc[j] & (1 << 5) ? 1 : 0);
+      p[3] = (desc[j] & (1 << 4) ? 1 : 0);
+      p[4] = (desc[j] & (1 << 3) ? 1 : 0);
+      p[5] = (desc[j] & (1 << 2) ? 1 : 0);
+      p[6] = (desc[j] & (1 << 1) ? 1 : 0);
+      p[7] = desc[j] & (1);
+    }
+  }
+}
+
+// --------------------------------------------------------------------------
+
+void FORB256::toMat8U(const std::vector<TDescriptor> &descriptors,
+  cv::Mat &mat)
+{
+  mat.create(descriptors.size(), FORB256::L, CV_8U);
+
+  if(!descriptors.empty())
+    memcpy(mat.data, &descriptors[0], descriptors.size() * FORB256::L);
+}
+
+// --------------------------------------------------------------------------
+
+void FORB256::fromMat8U(const cv::Mat &descriptors,
+  std::vector<TDescriptor> &out)
+{
+  if(descriptors.empty())
+  {
+    out.clear();
+    return;
+  }
+
+  if(descriptors.type() != CV_8U || descriptors.cols != FORB256::L)
+    throw std::string("ORB descriptors must be 32-byte CV_8U rows");
+
+  out.resize(descriptors.rows);
+
+  if(descriptors.isContinuous())
+  {
+    memcpy(&out[0], descriptors.data, out.size() * FORB256::L);
+  }
+  else
+  {
+    for(int i = 0; i < descriptors.rows; ++i)
+      memcpy(&out[i], descriptors.ptr<unsigned char>(i), FORB256::L);
+  }
+}
+
+// --------------------------------------------------------------------------
+
+const FORB256::TDescriptor* FORB256::view(const cv::Mat &descriptors)
+{
+  if(descriptors.empty()) return NULL;
+
+  if(descriptors.type() != CV_8U || descriptors.cols != FORB256::L)
+    throw std::string("ORB descriptors must be 32-byte CV_8U rows");
+
+  if(!descriptors.isContinuous() ||
+    (uintptr_t)descriptors.data % sizeof(uint64_t) != 0)
+    throw std::string("ORB descriptors must be continuous and aligned to "
+      "be viewed");
+
+  return (const TDescriptor*)descriptors.data;
+}
+
+// --------------------------------------------------------------------------
+
+cv::Mat FORB256::wrap(const std::vector<TDescriptor> &descriptors)
+{
+  if(descriptors.empty()) return cv::Mat();
+
+  return cv::Mat(descriptors.size(), FORB256::L, CV_8U,
+    (void*)&descriptors[0]);
+}
+
+// --------------------------------------------------------------------------
+
+} // namespace DBoW2
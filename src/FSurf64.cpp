@@ -10,6 +10,7 @@
 #include <vector>
 #include <string>
 #include <sstream>
+#include <limits>
 
 #include "FClass.h"
 #include "FSurf64.h"
@@ -46,15 +47,37 @@ void FSurf64::meanValue(const std::vector<FSurf64::pDescriptor> &descriptors,
   
 double FSurf64::distance(const FSurf64::TDescriptor &a, const FSurf64::TDescriptor &b)
 {
-  double sqd = 0.;
-  for(int i = 0; i < FSurf64::L; i += 4)
+  return distance(a, b, std::numeric_limits<double>::max());
+}
+
+// --------------------------------------------------------------------------
+
+double FSurf64::distance(const FSurf64::TDescriptor &a, 
+  const FSurf64::TDescriptor &b, double bound)
+{
+  // four independent sums, so that the compiler can use SIMD instructions.
+  // The bound is checked after each block of 16 dimensions
+  double s0 = 0., s1 = 0., s2 = 0., s3 = 0.;
+  for(int i = 0; i < FSurf64::L; i += 16)
   {
-    sqd += (a[i  ] - b[i  ])*(a[i  ] - b[i  ]);
-    sqd += (a[i+1] - b[i+1])*(a[i+1] - b[i+1]);
-    sqd += (a[i+2] - b[i+2])*(a[i+2] - b[i+2]);
-    sqd += (a[i+3] - b[i+3])*(a[i+3] - b[i+3]);
+    for(int j = i; j < i + 16; j += 4)
+    {
+      s0 += (a[j  ] - b[j  ])*(a[j  ] - b[j  ]);
+      s1 += (a[j+1] - b[j+1])*(a[j+1] - b[j+1]);
+      s2 += (a[j+2] - b[j+2])*(a[j+2] - b[j+2]);
+      s3 += (a[j+3] - b[j+3])*(a[j+3] - b[j+3]);
+    }
+    
+    if((s0 + s1) + (s2 + s3) >= bound) break;
   }
-  return sqd;
+  return (s0 + s1) + (s2 + s3);
+}
+
+// --------------------------------------------------------------------------
+
+size_t FSurf64::hash(const FSurf64::TDescriptor &a)
+{
+  return hashBytes(&a[0], a.size() * sizeof(float));
 }
 
 // --------------------------------------------------------------------------
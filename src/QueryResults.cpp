@@ -44,6 +44,18 @@ ostream & operator<<(ostream& os, const QueryResults& ret )
 
 // ---------------------------------------------------------------------------
 
+ostream & operator<<(ostream& os, const QueryStats& stats )
+{
+  os << "<Query words: " << stats.nQueryWords
+    << ", Scanned words: " << stats.nScannedWords
+    << ", Scanned postings: " << stats.nScannedPostings
+    << ", Skipped postings: " << stats.nSkippedPostings
+    << ", Stop words: " << stats.nStopWords << ">";
+  return os;
+}
+
+// ---------------------------------------------------------------------------
+
 void QueryResults::saveM(const std::string &filename) const
 {
   fstream f(filename.c_str(), ios::out);